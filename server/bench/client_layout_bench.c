@@ -0,0 +1,156 @@
+/**
+ * Microbenchmark for the layout of a worker thread's clients.
+ *
+ * Visits a worker's clients in a random order, the way epoll reports them and
+ * room members are delivered to, and touches what a read and a delivery touch
+ * of each: its fd, state, slot generation, worker, decoder and output queue.
+ * - unsplit: the Client before its name, partial message buffer and held
+ *   input were moved to Client_Cold, 328 bytes a client
+ * - split: the Client of server_config.h, its hot fields in two cache lines
+ *
+ * Once the clients outgrow the caches, every visit costs the cache lines the
+ * touched fields are spread over. Run with unsplit or split as the argument to
+ * measure a single layout, e.g. to count its cache misses with perf stat.
+ */
+#include "../server_config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define VISITS (1 << 24)        // Client visits per measurement
+#define CONTENT_LEN_TOUCHED 100 // Bytes a delivery adds to the output queue
+
+// Client as it was before its cold fields were moved to Client_Cold
+typedef struct Unsplit_Client {
+    int client_fd;
+    char name[MAX_USERNAME_LEN + 1];
+    ClIENT_STATE state;
+    int room_index;
+    bool in_use;
+    struct {
+        char *input;
+        size_t input_length;
+        char partial[MAX_MESSAGE_LEN_TO_SERVER];
+        size_t partial_length;
+        bool carried_cr;
+        bool discarding;
+    } decoder;
+    Worker_Thread *worker;
+    unsigned int generation;
+    Output_Queue out_queue;
+    struct Unsplit_Client *ready_prev;
+    struct Unsplit_Client *ready_next;
+    bool on_ready_list;
+    bool awaiting_room_reply;
+    char *held_input;
+    size_t held_input_length;
+    uint64_t held_input_received_at;
+    atomic_int room_member_index;
+} Unsplit_Client;
+
+static volatile uintptr_t sink;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Visits VISITS clients in the given order, touching the fields of a read and of a delivery
+#define VISIT_CLIENTS(clients, order, num_clients)                                                                     \
+    do {                                                                                                               \
+        uintptr_t total = 0;                                                                                           \
+        for (long visit = 0; visit < VISITS; visit++) {                                                                \
+            __typeof__(clients) client = &(clients)[(order)[visit % (num_clients)]];                                   \
+            if (!client->in_use || client->generation == 0) {                                                          \
+                continue;                                                                                              \
+            }                                                                                                          \
+            total += client->client_fd + client->state + (uintptr_t)client->worker;                                   \
+            total += client->decoder.input_length + client->decoder.partial_length;                                    \
+            client->out_queue.queued_bytes += CONTENT_LEN_TOUCHED;                                                     \
+            client->out_queue.send_pending = !client->out_queue.send_pending;                                          \
+        }                                                                                                              \
+        sink = total;                                                                                                  \
+    } while (0)
+
+/**
+ * @brief Measures a layout with num_clients clients in use
+ *
+ * @return Nanoseconds per visited client
+ */
+static double measure(bool split, int num_clients, const int *order) {
+    // Aligned like the worker's client slots, which are mapped
+    const size_t size = (size_t)num_clients * (split ? sizeof(Client) : sizeof(Unsplit_Client));
+    void *clients = aligned_alloc(CACHE_LINE_SIZE, (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+    if (clients == NULL) {
+        perror("aligned_alloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(clients, 0, size);
+    for (int i = 0; i < num_clients; i++) {
+        if (split) {
+            ((Client *)clients)[i].in_use = true;
+            ((Client *)clients)[i].generation = i + 1;
+        } else {
+            ((Unsplit_Client *)clients)[i].in_use = true;
+            ((Unsplit_Client *)clients)[i].generation = i + 1;
+        }
+    }
+
+    double start = now_ns();
+    if (split) {
+        VISIT_CLIENTS((Client *)clients, order, num_clients);
+    } else {
+        VISIT_CLIENTS((Unsplit_Client *)clients, order, num_clients);
+    }
+    double ns = (now_ns() - start) / VISITS;
+    free(clients);
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    const int client_counts[] = {1500, 6000, 24000, 96000};
+    const bool run_unsplit = argc < 2 || strcmp(argv[1], "unsplit") == 0;
+    const bool run_split = argc < 2 || strcmp(argv[1], "split") == 0;
+
+    printf("client layout, random visits of a worker's clients, ns per client\n");
+    printf("%-8s %12s %12s\n", "clients", "unsplit", "split");
+    printf("%-8s %12zu %12zu\n", "bytes", sizeof(Unsplit_Client), sizeof(Client));
+    for (size_t c = 0; c < sizeof(client_counts) / sizeof(client_counts[0]); c++) {
+        const int num_clients = client_counts[c];
+        int *order = malloc(sizeof(int) * num_clients);
+        if (order == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        // The same shuffled order for both layouts
+        srand(num_clients);
+        for (int i = 0; i < num_clients; i++) {
+            order[i] = i;
+        }
+        for (int i = num_clients - 1; i > 0; i--) {
+            const int j = rand() % (i + 1);
+            const int swapped = order[i];
+            order[i] = order[j];
+            order[j] = swapped;
+        }
+
+        printf("%-8d", num_clients);
+        if (run_unsplit) {
+            printf(" %12.1f", measure(false, num_clients, order));
+        } else {
+            printf(" %12s", "-");
+        }
+        if (run_split) {
+            printf(" %12.1f", measure(true, num_clients, order));
+        } else {
+            printf(" %12s", "-");
+        }
+        printf("\n");
+        free(order);
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+/**
+ * Microbenchmark for the worker thread's epoll event dispatch.
+ *
+ * Registers a growing number of idle clients with an epoll instance, keeps a
+ * fixed number of them readable, and measures how long it takes to go from an
+ * epoll_event to the Client it belongs to:
+ * - linear: searching the worker's client array for the fd, like
+ *   find_client_by_fd() used to
+ * - data.ptr: the Client registered as the epoll event data
+ *
+ * With data.ptr the cost per event should stay flat as the number of clients
+ * per thread grows, while the linear search grows with it.
+ */
+#include "../server_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READY_CLIENTS 64 // Clients with unread data, reported by every epoll_wait
+#define ROUNDS 20000     // epoll_wait calls per measurement
+
+static Worker_Thread worker;
+static Client clients[DEFAULT_CLIENTS_PER_THREAD]; // The worker's client slots
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static Client *find_client_by_fd(Worker_Thread *thread_data, int fd) {
+    for (int i = 0; i < DEFAULT_CLIENTS_PER_THREAD; i++) {
+        if (thread_data->clients[i].client_fd == fd) {
+            return &thread_data->clients[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs ROUNDS epoll_wait calls and resolves every event to its client
+ *
+ * @return Nanoseconds per resolved event
+ */
+static double measure(int epoll_fd, bool use_ptr) {
+    struct epoll_event events[READY_CLIENTS];
+    long resolved = 0;
+    volatile int sink = 0;
+
+    double start = now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        int count = epoll_wait(epoll_fd, events, READY_CLIENTS, 0);
+        for (int i = 0; i < count; i++) {
+            Client *client = use_ptr ? events[i].data.ptr : find_client_by_fd(&worker, events[i].data.fd);
+            sink += client->state;
+        }
+        resolved += count;
+    }
+    return (now_ns() - start) / resolved;
+}
+
+static void run(int num_clients) {
+    int epoll_ptr = epoll_create1(0);
+    int epoll_fd = epoll_create1(0);
+    int peers[DEFAULT_CLIENTS_PER_THREAD];
+
+    memset(&worker, 0, sizeof(worker));
+    memset(clients, 0, sizeof(clients));
+    worker.clients = clients;
+    for (int i = 0; i < num_clients; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        Client *client = &worker.clients[i];
+        client->client_fd = pair[0];
+        client->in_use = true;
+        peers[i] = pair[1];
+
+        struct epoll_event by_ptr = {.events = EPOLLIN, .data.ptr = client};
+        struct epoll_event by_fd = {.events = EPOLLIN, .data.fd = pair[0]};
+        epoll_ctl(epoll_ptr, EPOLL_CTL_ADD, pair[0], &by_ptr);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pair[0], &by_fd);
+    }
+    // The last clients in the array are the most expensive ones to find with a linear search
+    for (int i = num_clients - 1; i >= 0 && i >= num_clients - READY_CLIENTS; i--) {
+        if (write(peers[i], "x", 1) != 1) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double linear = measure(epoll_fd, false);
+    double ptr = measure(epoll_ptr, true);
+    printf("%-8d %12.1f %12.1f\n", num_clients, linear, ptr);
+
+    for (int i = 0; i < num_clients; i++) {
+        close(peers[i]);
+    }
+    for (int i = 0; i < DEFAULT_CLIENTS_PER_THREAD; i++) {
+        if (worker.clients[i].in_use) {
+            close(worker.clients[i].client_fd);
+        }
+    }
+    close(epoll_ptr);
+    close(epoll_fd);
+}
+
+int main() {
+    const int client_counts[] = {64, 128, 256, 512, 1024, DEFAULT_CLIENTS_PER_THREAD};
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("epoll event dispatch, %d ready clients per epoll_wait, ns per event\n", READY_CLIENTS);
+    printf("%-8s %12s %12s\n", "clients", "linear", "data.ptr");
+    for (size_t i = 0; i < sizeof(client_counts) / sizeof(client_counts[0]); i++) {
+        run(client_counts[i]);
+    }
+    return 0;
+}
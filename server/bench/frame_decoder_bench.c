@@ -0,0 +1,116 @@
+/**
+ * Microbenchmark for splitting the bytes read from a client into messages.
+ *
+ * Feeds the same stream of 100 byte room messages to:
+ * - strcat: the framing read_and_process_client_message() used to do, strstr
+ *   for the terminator, strcat into current_msg and a memset of current_msg
+ *   after every message
+ * - decoder: decode_next_message() from frame_decoder.c
+ *
+ * The stream is fed in reads holding many whole messages, the way a client
+ * pipelining its messages is read, and in reads that split every message in
+ * two, the worst case for both since every message has to be carried over.
+ */
+#include "../frame_decoder.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MESSAGES 50     // Messages in the stream
+#define CONTENT_LEN 100 // Content bytes per message
+#define ROUNDS 20000    // Times the stream is decoded per measurement
+
+static char stream[MESSAGES * (CONTENT_LEN + 4)];
+static size_t stream_length;
+static char read_buffer[sizeof(stream) + 1];
+static volatile size_t sink;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief The old framing, with a routed message consumed by reading its first byte
+ */
+static void strcat_framing(char current_msg[], size_t current_msg_size, char *data, size_t length) {
+    data[length] = '\0';
+    char *temp = data;
+    char *msg_term = strstr(data, "\r\n");
+    while (msg_term != NULL) {
+        *msg_term = '\0';
+        strcat(current_msg, temp);
+        sink += current_msg[0];
+        memset(current_msg, 0, current_msg_size);
+        temp = msg_term + 2;
+        msg_term = strstr(temp, "\r\n");
+    }
+    if (*temp != '\0') {
+        strcat(current_msg, temp);
+    }
+}
+
+static void decoder_framing(Frame_Decoder *decoder, char *data, size_t length) {
+    char *message;
+    size_t message_length;
+    set_decoder_input(decoder, data, length);
+    while (decode_next_message(decoder, &message, &message_length) != MESSAGE_INCOMPLETE) {
+        sink += message[0];
+    }
+}
+
+/**
+ * @brief Decodes the stream ROUNDS times in reads of read_size bytes
+ *
+ * @return Nanoseconds per decoded message
+ */
+static double measure(bool use_decoder, size_t read_size) {
+    char current_msg[MAX_MESSAGE_LEN_TO_SERVER * 3] = {0};
+    char partial[MAX_MESSAGE_LEN_TO_SERVER];
+    Frame_Decoder decoder = {.partial = partial};
+
+    double start = now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t offset = 0; offset < stream_length; offset += read_size) {
+            size_t length = stream_length - offset < read_size ? stream_length - offset : read_size;
+            // Like recv(), every read lands in the same buffer
+            memcpy(read_buffer, stream + offset, length);
+            if (use_decoder) {
+                decoder_framing(&decoder, read_buffer, length);
+            } else {
+                strcat_framing(current_msg, sizeof(current_msg), read_buffer, length);
+            }
+        }
+    }
+    return (now_ns() - start) / ((double)ROUNDS * MESSAGES);
+}
+
+int main() {
+    for (int i = 0; i < MESSAGES; i++) {
+        stream[stream_length++] = CMD_ROOM_MESSAGE_SEND;
+        stream[stream_length++] = ' ';
+        memset(stream + stream_length, 'a' + i % 26, CONTENT_LEN);
+        stream_length += CONTENT_LEN;
+        stream[stream_length++] = '\r';
+        stream[stream_length++] = '\n';
+    }
+    const size_t message_size = CONTENT_LEN + 4;
+    const struct {
+        const char *name;
+        size_t read_size;
+    } cases[] = {
+        {"coalesced", stream_length},
+        {"split", message_size / 2 + 1},
+    };
+
+    printf("client message framing, %d byte messages, ns per message\n", (int)message_size);
+    printf("%-10s %12s %12s\n", "reads", "strcat", "decoder");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        double old = measure(false, cases[i].read_size);
+        double decoder = measure(true, cases[i].read_size);
+        printf("%-10s %12.1f %12.1f\n", cases[i].name, old, decoder);
+    }
+    return 0;
+}
@@ -0,0 +1,885 @@
+/**
+ * Load generator for the chat server, speaking the protocol of protocol.h.
+ *
+ * Opens the connections of a scenario, gives every connection a username,
+ * fills the rooms, then sends room messages at a fixed total rate for the
+ * measured duration while optionally reconnecting members (churn). Every
+ * message carries the time it was sent, so each delivery to the other members
+ * of its room gives a fan-out latency, measured from the sender's send() to the
+ * recipient's recv():
+ * - delivery: the latency of every single delivery
+ * - first_delivery / last_delivery: the latency to the first and to the last
+ *   member of the room getting the message
+ *
+ * Each thread runs its own rooms and idle connections on its own epoll
+ * instance, so every delivery is read by the thread that sent the message.
+ * Against a loopback address the connections are spread over as many source
+ * addresses as needed to not run out of ephemeral ports, which is how one box
+ * opens 100k connections.
+ *
+ * The results are written as JSON, see print_results(). Progress and errors
+ * go to stderr.
+ */
+#define _GNU_SOURCE // For IP_BIND_ADDRESS_NO_PORT
+
+#include "../protocol.h"
+#include "../server_config.h" // For LATENCY_SUB_BUCKET_BITS, LATENCY_BUCKETS
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INPUT_BUFFER_SIZE 256          // Bytes of a connection's unfinished frame kept between reads
+#define OUTPUT_BUFFER_SIZE 256         // Bytes of a connection's message the server did not take yet
+#define READ_CHUNK_SIZE (64 * 1024)    // Bytes read from a socket per recv
+#define OUTSTANDING_MESSAGES 65536     // Messages per thread tracked until all their recipients got them
+#define MAX_EVENTS 1024                // Events per epoll_wait
+#define PORTS_PER_SOURCE_ADDRESS 20000 // Connections opened from one loopback source address
+#define DRAIN_SECONDS 2                // Longest wait for the last deliveries once the measured duration is over
+#define MIN_MESSAGE_SIZE 32            // Smallest content, the sequence number and send time must fit in it
+
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+typedef enum Connection_State {
+    UNUSED,           // Not connected, yet or any more
+    CONNECTING,       // connect() in progress
+    AWAITING_WELCOME, // Connected, waiting for CMD_WELCOME_REQUEST
+    AWAITING_LOBBY,   // Username sent, waiting for the room list the server sends when it is accepted
+    AWAITING_CREATE,  // Waiting for another member to create the room
+    AWAITING_ROOM,    // Waiting for the reply to the create or join
+    IN_ROOM,          // Sending and receiving room messages
+    IDLE,             // In the lobby for good
+} Connection_State;
+
+typedef struct Connection {
+    int fd;
+    Connection_State state;
+    int room; // Index in the thread's rooms, -1 for idle connections
+    bool reconnecting;
+    char last_byte; // Last byte read, the '\r' of the MSG_TERMINATOR when a read splits it
+    size_t input_length;
+    size_t output_length;
+    char input[INPUT_BUFFER_SIZE];
+    char output[OUTPUT_BUFFER_SIZE];
+} Connection;
+
+typedef struct Bench_Room {
+    int id;        // Names the room on the server
+    int joined;    // Members in the room
+    bool created;  // The server confirmed creating it
+    bool creating; // A member asked to create it
+} Bench_Room;
+
+// A message sent by the thread whose deliveries are still being counted
+typedef struct Outstanding_Message {
+    uint64_t sequence;
+    uint64_t sent_at;
+    int recipients_left;
+    bool delivered;
+} Outstanding_Message;
+
+typedef struct Histogram {
+    unsigned long buckets[LATENCY_BUCKETS];
+    unsigned long count;
+    uint64_t max_ns;
+} Histogram;
+
+typedef struct Load_Thread {
+    pthread_t id;
+    int index;
+    int epoll_fd;
+    Connection *connections; // The members of the thread's rooms, room by room, then its idle connections
+    int num_connections;
+    Bench_Room *rooms;
+    int num_rooms;
+    int next_to_connect; // Connections before this one were connected once
+    int connecting;      // connect() calls in progress
+    int settled;         // Connections that reached their room or the lobby, or failed, the first time
+    double message_rate; // Messages per second sent by the thread
+    double churn_rate;   // Reconnects per second done by the thread
+    int next_sender;
+    uint64_t sequence;
+    Outstanding_Message *outstanding;
+    char read_chunk[READ_CHUNK_SIZE];
+    unsigned int random_state;
+    // Results
+    uint64_t connected_at; // Time the last connection reached the lobby
+    unsigned long lobby_connections;
+    unsigned long failed_connections;
+    unsigned long failed_joins;
+    unsigned long disconnects; // Connections the server closed after setup
+    unsigned long sent;
+    unsigned long skipped_sends; // Messages not sent because the server had not taken the previous one yet
+    unsigned long deliveries;
+    unsigned long expected_deliveries;
+    unsigned long reconnects;
+    Histogram delivery;
+    Histogram first_delivery;
+    Histogram last_delivery;
+} Load_Thread;
+
+typedef struct Scenario {
+    const char *host;
+    int port;
+    int rooms;
+    int members;  // Per room
+    int idle;     // Connections that stay in the lobby
+    double rate;  // Messages per second over all rooms
+    int size;     // Content bytes per message
+    double churn; // Member reconnects per second over all rooms
+    double duration;
+    int threads;
+    int connect_batch; // connect() calls in progress at once per thread
+    int source_addresses;
+    double setup_timeout;
+    const char *output;
+} Scenario;
+
+static Scenario scenario = {
+    .host = "127.0.0.1",
+    .port = 30000,
+    .rooms = 10,
+    .members = 10,
+    .rate = 1000,
+    .size = 64,
+    .duration = 10,
+    .threads = 1,
+    .connect_batch = 256,
+    .setup_timeout = 60,
+};
+
+static struct sockaddr_in server_address;
+static atomic_int threads_ready;
+static _Atomic uint64_t measure_start; // 0 until every thread finished its setup
+static uint64_t setup_start;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(Histogram *histogram, uint64_t latency_ns) {
+    int bucket = (int)latency_ns;
+    if (latency_ns >= LATENCY_SUB_BUCKETS) {
+        const int highest_bit = 63 - __builtin_clzll(latency_ns);
+        bucket = (highest_bit - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+                 (int)((latency_ns >> (highest_bit - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    }
+    histogram->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    histogram->count++;
+    if (latency_ns > histogram->max_ns) {
+        histogram->max_ns = latency_ns;
+    }
+}
+
+/**
+ * @brief Returns a percentile of a histogram, as the highest latency of the
+ * bucket it falls in
+ */
+static uint64_t percentile(const Histogram *histogram, double fraction) {
+    const unsigned long rank = (unsigned long)(histogram->count * fraction + 0.999999);
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0) {
+            const int power = i / LATENCY_SUB_BUCKETS;
+            const uint64_t sub_bucket = i % LATENCY_SUB_BUCKETS;
+            const uint64_t highest =
+                power == 0 ? sub_bucket : ((LATENCY_SUB_BUCKETS + sub_bucket + 1) << (power - 1)) - 1;
+            return highest < histogram->max_ns ? highest : histogram->max_ns;
+        }
+    }
+    return 0;
+}
+
+static void merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if (from->max_ns > into->max_ns) {
+        into->max_ns = from->max_ns;
+    }
+}
+
+/**
+ * @brief Sends a whole message, or keeps what the server did not take for
+ * EPOLLOUT
+ *
+ * @return false if the previous message is still being sent, or the
+ * connection failed
+ */
+static bool send_message(Load_Thread *thread, Connection *connection, char command, const char *content) {
+    if (connection->output_length > 0) {
+        return false;
+    }
+    char message[MAX_MESSAGE_LEN_TO_SERVER + 3];
+    const int length = snprintf(message, sizeof(message), "%c %s" MSG_TERMINATOR, command, content);
+    ssize_t sent = send(connection->fd, message, length, MSG_NOSIGNAL);
+    if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+    }
+    if (sent == -1) {
+        sent = 0;
+    }
+    if (sent < length) {
+        memcpy(connection->output, message + sent, length - sent);
+        connection->output_length = length - sent;
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = connection};
+        epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+    return true;
+}
+
+static void flush_output(Load_Thread *thread, Connection *connection) {
+    ssize_t sent = send(connection->fd, connection->output, connection->output_length, MSG_NOSIGNAL);
+    if (sent <= 0) {
+        return;
+    }
+    memmove(connection->output, connection->output + sent, connection->output_length - sent);
+    connection->output_length -= sent;
+    if (connection->output_length == 0) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+        epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+}
+
+/**
+ * @brief Starts connecting a connection, from the loopback source address its
+ * index picks when the server is on a loopback address
+ */
+static void start_connect(Load_Thread *thread, Connection *connection) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        thread->failed_connections++;
+        thread->settled++;
+        return;
+    }
+    if (scenario.source_addresses > 1) {
+        const int one = 1;
+        const int source = (int)(connection - thread->connections) * scenario.threads + thread->index;
+        struct sockaddr_in local = {.sin_family = AF_INET};
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + source % scenario.source_addresses);
+        // The port is only picked at connect(), so every source address has its own ephemeral ports
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        bind(fd, (struct sockaddr *)&local, sizeof(local));
+    }
+    connection->fd = fd;
+    connection->state = CONNECTING;
+    connection->input_length = connection->output_length = 0;
+    connection->last_byte = '\0';
+    thread->connecting++;
+
+    if (connect(fd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        connection->state = UNUSED;
+        thread->connecting--;
+        thread->failed_connections++;
+        thread->settled++;
+        return;
+    }
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = connection};
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * @brief Closes a connection, counting it out of its room
+ */
+static void close_connection(Load_Thread *thread, Connection *connection) {
+    if (connection->state == CONNECTING) {
+        thread->connecting--;
+    }
+    if (connection->state == IN_ROOM) {
+        thread->rooms[connection->room].joined--;
+    }
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    connection->state = UNUSED;
+}
+
+/**
+ * @brief Gives up on a connection that did not make it to its room or the
+ * lobby
+ */
+static void fail_connection(Load_Thread *thread, Connection *connection, unsigned long *counter) {
+    const bool was_reconnecting = connection->reconnecting;
+    close_connection(thread, connection);
+    (*counter)++;
+    if (!was_reconnecting) {
+        thread->settled++;
+    }
+    connection->reconnecting = false;
+}
+
+static void settle(Load_Thread *thread, Connection *connection) {
+    if (connection->reconnecting) {
+        thread->reconnects++;
+        connection->reconnecting = false;
+    } else {
+        thread->settled++;
+    }
+}
+
+/**
+ * @brief Asks for the connection's room: creates it if no member did yet,
+ * joins it once it exists
+ */
+static void enter_room(Load_Thread *thread, Connection *connection) {
+    Bench_Room *room = &thread->rooms[connection->room];
+    char room_name[MAX_ROOM_NAME_LEN + 1];
+    snprintf(room_name, sizeof(room_name), "load%d", room->id);
+    connection->state = AWAITING_ROOM;
+    if (room->created) {
+        send_message(thread, connection, CMD_ROOM_JOIN_REQUEST, room_name);
+    } else if (!room->creating) {
+        room->creating = true;
+        send_message(thread, connection, CMD_ROOM_CREATE_REQUEST, room_name);
+    } else {
+        connection->state = AWAITING_CREATE;
+    }
+}
+
+/**
+ * @brief Sends the join requests of the members that waited for their room
+ * to be created
+ */
+static void join_created_room(Load_Thread *thread, int room_index) {
+    for (int i = 0; i < thread->num_connections; i++) {
+        Connection *connection = &thread->connections[i];
+        if (connection->room == room_index && connection->state == AWAITING_CREATE) {
+            enter_room(thread, connection);
+        }
+    }
+}
+
+/**
+ * @brief Counts the delivery of a room message sent by this thread
+ */
+static void handle_delivery(Load_Thread *thread, const char *frame) {
+    const char *marker = strstr(frame, ": L");
+    if (marker == NULL) {
+        return; // A member entered or left the room
+    }
+    char *end;
+    const uint64_t sequence = strtoull(marker + 3, &end, 10);
+    const uint64_t sent_at = strtoull(end, NULL, 16);
+    const uint64_t latency_ns = now_ns() - sent_at;
+    record(&thread->delivery, latency_ns);
+    thread->deliveries++;
+
+    Outstanding_Message *message = &thread->outstanding[sequence & (OUTSTANDING_MESSAGES - 1)];
+    if (message->sequence != sequence || message->recipients_left == 0) {
+        return;
+    }
+    if (!message->delivered) {
+        message->delivered = true;
+        record(&thread->first_delivery, latency_ns);
+    }
+    if (--message->recipients_left == 0) {
+        record(&thread->last_delivery, latency_ns);
+    }
+}
+
+/**
+ * @brief Moves a connection through the protocol as the server's frames
+ * arrive
+ */
+static void handle_frame(Load_Thread *thread, Connection *connection, const char *frame) {
+    const char command = frame[0];
+    switch (connection->state) {
+    case AWAITING_WELCOME:
+        if (command == CMD_WELCOME_REQUEST) {
+            char username[MAX_USERNAME_LEN + 1];
+            snprintf(username, sizeof(username), "t%dc%d", thread->index, (int)(connection - thread->connections));
+            connection->state = AWAITING_LOBBY;
+            send_message(thread, connection, CMD_USERNAME_SUBMIT, username);
+        } else {
+            fail_connection(thread, connection, &thread->failed_connections);
+        }
+        break;
+    case AWAITING_LOBBY:
+        if (command != CMD_ROOM_LIST_RESPONSE) {
+            fail_connection(thread, connection, &thread->failed_connections);
+            break;
+        }
+        if (!connection->reconnecting) {
+            thread->lobby_connections++;
+            thread->connected_at = now_ns();
+        }
+        if (connection->room == -1) {
+            connection->state = IDLE;
+            settle(thread, connection);
+        } else {
+            enter_room(thread, connection);
+        }
+        break;
+    case AWAITING_ROOM: {
+        Bench_Room *room = &thread->rooms[connection->room];
+        if (command == CMD_ROOM_CREATE_OK || command == CMD_ROOM_JOIN_OK) {
+            connection->state = IN_ROOM;
+            room->joined++;
+            settle(thread, connection);
+            if (command == CMD_ROOM_CREATE_OK) {
+                room->created = true;
+                room->creating = false;
+                join_created_room(thread, connection->room);
+            }
+        } else if (command == ERR_ROOM_NOT_FOUND && room->joined == 0) {
+            // Every member left with churn and the server released the room, it is created again
+            room->created = false;
+            enter_room(thread, connection);
+        } else if (command == ERR_ROOM_NOT_FOUND || command == ERR_ROOM_CAPACITY_FULL ||
+                   command == ERR_ROOM_NAME_INVALID) {
+            fail_connection(thread, connection, &thread->failed_joins);
+        }
+        break;
+    }
+    case IN_ROOM:
+        if (command == CMD_ROOM_MSG) {
+            handle_delivery(thread, frame);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Reads what the server sent and handles every complete frame in it
+ *
+ * Frames longer than the input buffer, e.g. long room lists, are only looked
+ * at up to the buffer's size, only their command matters.
+ */
+static void read_frames(Load_Thread *thread, Connection *connection) {
+    while (connection->state != UNUSED) {
+        ssize_t bytes = recv(connection->fd, thread->read_chunk, READ_CHUNK_SIZE, 0);
+        if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            if (connection->state == IN_ROOM || connection->state == IDLE) {
+                thread->disconnects++;
+                close_connection(thread, connection);
+            } else {
+                fail_connection(thread, connection, &thread->failed_connections);
+            }
+            return;
+        }
+
+        const char *data = thread->read_chunk;
+        const char *end = data + bytes;
+        while (data < end && connection->state != UNUSED) {
+            // Frames of the server can hold '\n's of their own before the MSG_TERMINATOR
+            const char *newline = memchr(data, '\n', end - data);
+            const size_t take = newline == NULL ? (size_t)(end - data) : (size_t)(newline - data + 1);
+            const size_t space = INPUT_BUFFER_SIZE - 1 - connection->input_length;
+            memcpy(connection->input + connection->input_length, data, take < space ? take : space);
+            connection->input_length += take < space ? take : space;
+            const char before_newline = newline == NULL ? '\0' : newline > data ? newline[-1] : connection->last_byte;
+            connection->last_byte = data[take - 1];
+            data += take;
+            if (before_newline == '\r') {
+                connection->input[connection->input_length] = '\0';
+                handle_frame(thread, connection, connection->input);
+                connection->input_length = 0;
+            }
+        }
+    }
+}
+
+static void handle_event(Load_Thread *thread, Connection *connection, uint32_t events) {
+    if (connection->state == CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            fail_connection(thread, connection, &thread->failed_connections);
+            return;
+        }
+        thread->connecting--;
+        connection->state = AWAITING_WELCOME;
+        const int one = 1;
+        setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+        epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+    if ((events & EPOLLOUT) && connection->output_length > 0) {
+        flush_output(thread, connection);
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        read_frames(thread, connection);
+    }
+}
+
+/**
+ * @brief Sends the messages due since the thread started measuring, from its
+ * room members in turn
+ */
+static void send_due_messages(Load_Thread *thread, uint64_t now, uint64_t start) {
+    const unsigned long due = (unsigned long)((now - start) / 1e9 * thread->message_rate);
+    const int members = thread->num_rooms * scenario.members;
+    char content[MAX_CONTENT_LEN + 1];
+
+    while (thread->sent + thread->skipped_sends < due && members > 0) {
+        Connection *sender = NULL;
+        for (int tries = 0; tries < members && sender == NULL; tries++) {
+            Connection *connection = &thread->connections[thread->next_sender];
+            thread->next_sender = (thread->next_sender + 1) % members;
+            if (connection->state == IN_ROOM) {
+                sender = connection;
+            }
+        }
+        if (sender == NULL) {
+            thread->skipped_sends++;
+            continue;
+        }
+
+        const uint64_t sequence = ++thread->sequence;
+        const uint64_t sent_at = now_ns();
+        int length = snprintf(content, sizeof(content), "L%lu %lx ", (unsigned long)sequence, (unsigned long)sent_at);
+        memset(content + length, 'x', scenario.size - length);
+        content[scenario.size] = '\0';
+        if (!send_message(thread, sender, CMD_ROOM_MESSAGE_SEND, content)) {
+            thread->skipped_sends++;
+            continue;
+        }
+
+        Outstanding_Message *message = &thread->outstanding[sequence & (OUTSTANDING_MESSAGES - 1)];
+        message->sequence = sequence;
+        message->sent_at = sent_at;
+        message->recipients_left = thread->rooms[sender->room].joined - 1;
+        message->delivered = false;
+        thread->expected_deliveries += message->recipients_left;
+        thread->sent++;
+    }
+}
+
+/**
+ * @brief Reconnects the members due since the thread started measuring,
+ * picked at random among those in their room
+ */
+static void churn_members(Load_Thread *thread, uint64_t now, uint64_t start, unsigned long *churned) {
+    const unsigned long due = (unsigned long)((now - start) / 1e9 * thread->churn_rate);
+    const int members = thread->num_rooms * scenario.members;
+    while (*churned < due && members > 0) {
+        (*churned)++;
+        Connection *connection = &thread->connections[rand_r(&thread->random_state) % members];
+        if (connection->state != IN_ROOM) {
+            continue;
+        }
+        close_connection(thread, connection);
+        connection->reconnecting = true;
+        start_connect(thread, connection);
+    }
+}
+
+static void wait_for_events(Load_Thread *thread, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    const int count = epoll_wait(thread->epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < count; i++) {
+        handle_event(thread, events[i].data.ptr, events[i].events);
+    }
+}
+
+static void *run_load_thread(void *arg) {
+    Load_Thread *thread = arg;
+    const uint64_t setup_deadline = setup_start + (uint64_t)(scenario.setup_timeout * 1e9);
+
+    // Setup: at most connect_batch connects in progress, until every connection got to its room or the lobby
+    while (thread->settled < thread->num_connections && now_ns() < setup_deadline) {
+        while (thread->connecting < scenario.connect_batch && thread->next_to_connect < thread->num_connections) {
+            start_connect(thread, &thread->connections[thread->next_to_connect++]);
+        }
+        wait_for_events(thread, 1);
+    }
+    if (thread->settled < thread->num_connections) {
+        fprintf(stderr, "Thread %d: %d of %d connections still not set up after %.0f s\n", thread->index,
+                thread->num_connections - thread->settled, thread->num_connections, scenario.setup_timeout);
+    }
+
+    // The last thread done with its setup starts the measurement for all of them
+    if (atomic_fetch_add(&threads_ready, 1) == scenario.threads - 1) {
+        atomic_store(&measure_start, now_ns());
+    }
+    uint64_t start;
+    while ((start = atomic_load(&measure_start)) == 0) {
+        wait_for_events(thread, 1);
+    }
+
+    const uint64_t end = start + (uint64_t)(scenario.duration * 1e9);
+    unsigned long churned = 0;
+    uint64_t now;
+    while ((now = now_ns()) < end) {
+        send_due_messages(thread, now, start);
+        churn_members(thread, now, start, &churned);
+        wait_for_events(thread, 1);
+    }
+
+    const uint64_t drain_end = now_ns() + DRAIN_SECONDS * 1000000000ULL;
+    while (thread->deliveries < thread->expected_deliveries && now_ns() < drain_end) {
+        wait_for_events(thread, 1);
+    }
+    return NULL;
+}
+
+static void print_latency(FILE *out, const char *name, const Histogram *histogram, bool last) {
+    fprintf(out,
+            "    \"%s\": {\"count\": %lu, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}%s\n", name,
+            histogram->count, percentile(histogram, 0.5) / 1e3, percentile(histogram, 0.99) / 1e3,
+            percentile(histogram, 0.999) / 1e3, histogram->max_ns / 1e3, last ? "" : ",");
+}
+
+/**
+ * @brief Writes the scenario and the results of every thread added up as JSON
+ *
+ * Rates are per second, latencies in microseconds. The connect rate counts the
+ * connections that reached the lobby, up to when the last of them did.
+ */
+static void print_results(FILE *out, Load_Thread threads[]) {
+    Load_Thread *total = calloc(1, sizeof(Load_Thread));
+    uint64_t connected_at = setup_start;
+    for (int i = 0; i < scenario.threads; i++) {
+        const Load_Thread *thread = &threads[i];
+        total->lobby_connections += thread->lobby_connections;
+        total->failed_connections += thread->failed_connections;
+        total->failed_joins += thread->failed_joins;
+        total->disconnects += thread->disconnects;
+        total->sent += thread->sent;
+        total->skipped_sends += thread->skipped_sends;
+        total->deliveries += thread->deliveries;
+        total->expected_deliveries += thread->expected_deliveries;
+        total->reconnects += thread->reconnects;
+        merge(&total->delivery, &thread->delivery);
+        merge(&total->first_delivery, &thread->first_delivery);
+        merge(&total->last_delivery, &thread->last_delivery);
+        if (thread->connected_at > connected_at) {
+            connected_at = thread->connected_at;
+        }
+    }
+    const double connect_seconds = (connected_at - setup_start) / 1e9;
+    const double setup_seconds = (atomic_load(&measure_start) - setup_start) / 1e9;
+
+    fprintf(out, "{\n");
+    fprintf(out,
+            "  \"scenario\": {\"host\": \"%s\", \"port\": %d, \"rooms\": %d, \"members\": %d, \"idle\": %d, "
+            "\"rate\": %.1f, \"size\": %d, \"churn\": %.1f, \"duration\": %.1f, \"threads\": %d, "
+            "\"source_addresses\": %d},\n",
+            scenario.host, scenario.port, scenario.rooms, scenario.members, scenario.idle, scenario.rate,
+            scenario.size, scenario.churn, scenario.duration, scenario.threads, scenario.source_addresses);
+    fprintf(out,
+            "  \"connect\": {\"connections\": %lu, \"failed\": %lu, \"failed_joins\": %lu, \"seconds\": %.3f, "
+            "\"per_second\": %.1f, \"setup_seconds\": %.3f},\n",
+            total->lobby_connections, total->failed_connections, total->failed_joins, connect_seconds,
+            connect_seconds > 0 ? total->lobby_connections / connect_seconds : 0, setup_seconds);
+    fprintf(out,
+            "  \"messages\": {\"sent\": %lu, \"skipped\": %lu, \"deliveries\": %lu, \"expected_deliveries\": %lu, "
+            "\"sent_per_second\": %.1f, \"deliveries_per_second\": %.1f},\n",
+            total->sent, total->skipped_sends, total->deliveries, total->expected_deliveries,
+            total->sent / scenario.duration, total->deliveries / scenario.duration);
+    fprintf(out, "  \"churn\": {\"reconnects\": %lu, \"disconnects\": %lu},\n", total->reconnects,
+            total->disconnects);
+    fprintf(out, "  \"latency_us\": {\n");
+    print_latency(out, "delivery", &total->delivery, false);
+    print_latency(out, "first_delivery", &total->first_delivery, false);
+    print_latency(out, "last_delivery", &total->last_delivery, true);
+    fprintf(out, "  }\n}\n");
+    free(total);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --host ADDRESS        Server address (%s)\n"
+            "  --port PORT           Server port (%d)\n"
+            "  --rooms N             Rooms (%d)\n"
+            "  --members N           Members per room (%d)\n"
+            "  --idle N              Extra connections that stay in the lobby (%d)\n"
+            "  --rate N              Messages per second over all rooms (%.0f)\n"
+            "  --size N              Content bytes per message, %d to %d (%d)\n"
+            "  --churn N             Members reconnecting per second over all rooms (%.0f)\n"
+            "  --duration SECONDS    Measured duration (%.0f)\n"
+            "  --threads N           Threads, each running its share of the rooms (%d)\n"
+            "  --connect-batch N     connect() calls in progress at once per thread (%d)\n"
+            "  --source-addresses N  Loopback source addresses, by default one per %d connections\n"
+            "  --setup-timeout SECS  Longest wait for the connections to be set up (%.0f)\n"
+            "  --output FILE         Where the JSON results go (standard output)\n"
+            "  --help                Print this message\n",
+            program, scenario.host, scenario.port, scenario.rooms, scenario.members, scenario.idle, scenario.rate,
+            MIN_MESSAGE_SIZE, MAX_CONTENT_LEN, scenario.size, scenario.churn, scenario.duration, scenario.threads,
+            scenario.connect_batch, PORTS_PER_SOURCE_ADDRESS, scenario.setup_timeout);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_arguments(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"host", required_argument, NULL, 'H'},          {"port", required_argument, NULL, 'p'},
+        {"rooms", required_argument, NULL, 'r'},         {"members", required_argument, NULL, 'm'},
+        {"idle", required_argument, NULL, 'i'},          {"rate", required_argument, NULL, 'R'},
+        {"size", required_argument, NULL, 's'},          {"churn", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},      {"threads", required_argument, NULL, 't'},
+        {"connect-batch", required_argument, NULL, 'b'}, {"source-addresses", required_argument, NULL, 'a'},
+        {"setup-timeout", required_argument, NULL, 'T'}, {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},                {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+        case 'H':
+            scenario.host = optarg;
+            break;
+        case 'p':
+            scenario.port = atoi(optarg);
+            break;
+        case 'r':
+            scenario.rooms = atoi(optarg);
+            break;
+        case 'm':
+            scenario.members = atoi(optarg);
+            break;
+        case 'i':
+            scenario.idle = atoi(optarg);
+            break;
+        case 'R':
+            scenario.rate = atof(optarg);
+            break;
+        case 's':
+            scenario.size = atoi(optarg);
+            break;
+        case 'c':
+            scenario.churn = atof(optarg);
+            break;
+        case 'd':
+            scenario.duration = atof(optarg);
+            break;
+        case 't':
+            scenario.threads = atoi(optarg);
+            break;
+        case 'b':
+            scenario.connect_batch = atoi(optarg);
+            break;
+        case 'a':
+            scenario.source_addresses = atoi(optarg);
+            break;
+        case 'T':
+            scenario.setup_timeout = atof(optarg);
+            break;
+        case 'o':
+            scenario.output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || scenario.rooms < 0 || scenario.members < 1 || scenario.idle < 0 || scenario.rate < 0 ||
+        scenario.size < MIN_MESSAGE_SIZE || scenario.size > MAX_CONTENT_LEN || scenario.churn < 0 ||
+        scenario.duration <= 0 || scenario.threads < 1 || scenario.connect_batch < 1) {
+        usage(argv[0]);
+    }
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(scenario.port);
+    if (inet_pton(AF_INET, scenario.host, &server_address.sin_addr) != 1) {
+        fprintf(stderr, "Not an IPv4 address: %s\n", scenario.host);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Hands the rooms out to the threads in turn and the idle connections
+ * evenly, and splits the message and churn rates by members
+ */
+static void setup_threads(Load_Thread threads[]) {
+    for (int t = 0; t < scenario.threads; t++) {
+        Load_Thread *thread = &threads[t];
+        thread->index = t;
+        thread->random_state = t + 1;
+        thread->num_rooms = scenario.rooms / scenario.threads + (t < scenario.rooms % scenario.threads);
+        const int idle = scenario.idle / scenario.threads + (t < scenario.idle % scenario.threads);
+        thread->num_connections = thread->num_rooms * scenario.members + idle;
+        thread->rooms = calloc(thread->num_rooms > 0 ? thread->num_rooms : 1, sizeof(Bench_Room));
+        thread->connections = calloc(thread->num_connections > 0 ? thread->num_connections : 1, sizeof(Connection));
+        thread->outstanding = calloc(OUTSTANDING_MESSAGES, sizeof(Outstanding_Message));
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (thread->rooms == NULL || thread->connections == NULL || thread->outstanding == NULL ||
+            thread->epoll_fd == -1) {
+            perror("setup_threads");
+            exit(EXIT_FAILURE);
+        }
+        for (int r = 0; r < thread->num_rooms; r++) {
+            thread->rooms[r].id = r * scenario.threads + t;
+        }
+        for (int i = 0; i < thread->num_connections; i++) {
+            thread->connections[i].room = i < thread->num_rooms * scenario.members ? i / scenario.members : -1;
+        }
+        const double share = scenario.rooms > 0 ? (double)thread->num_rooms / scenario.rooms : 0;
+        thread->message_rate = scenario.rate * share;
+        thread->churn_rate = scenario.churn * share;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_arguments(argc, argv);
+    const long connections = (long)scenario.rooms * scenario.members + scenario.idle;
+    if (scenario.source_addresses == 0) {
+        const bool loopback = (ntohl(server_address.sin_addr.s_addr) >> 24) == 127;
+        scenario.source_addresses = loopback ? (int)(connections / PORTS_PER_SOURCE_ADDRESS + 1) : 1;
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if ((rlim_t)connections + 64 > limit.rlim_cur) {
+            fprintf(stderr, "Open file limit %lu is too low for %ld connections, raise it with ulimit -n\n",
+                    (unsigned long)limit.rlim_cur, connections);
+        }
+    }
+
+    FILE *out = stdout;
+    if (scenario.output != NULL && (out = fopen(scenario.output, "w")) == NULL) {
+        perror(scenario.output);
+        return EXIT_FAILURE;
+    }
+
+    Load_Thread *threads = calloc(scenario.threads, sizeof(Load_Thread));
+    if (threads == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    setup_threads(threads);
+    fprintf(stderr, "Opening %ld connections to %s:%d with %d threads, then measuring for %.0f s\n", connections,
+            scenario.host, scenario.port, scenario.threads, scenario.duration);
+
+    setup_start = now_ns();
+    for (int t = 0; t < scenario.threads; t++) {
+        if (pthread_create(&threads[t].id, NULL, run_load_thread, &threads[t]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int t = 0; t < scenario.threads; t++) {
+        pthread_join(threads[t].id, NULL);
+    }
+
+    print_results(out, threads);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
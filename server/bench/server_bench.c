@@ -0,0 +1,414 @@
+/**
+ * Microbenchmarks for the server's hot functions, run on the server's own code.
+ *
+ * client_state_manager.c and room_manager.c are included here, since most of
+ * their hot functions are static, and the rest of the server but main.c is
+ * linked in. The sockets are in-memory stand-ins: recv(), send() and sendmsg()
+ * are wrapped by the linker, recv() hands out a prepared stream and the sends
+ * take every byte, so no socket system call is timed. malloc(), calloc() and
+ * realloc() are wrapped too, to count the allocations.
+ *
+ * The clients are spread over WORKERS worker contexts, without their threads
+ * running. The server's default limits are used, DEFAULT_ROOMS rooms are open,
+ * 50 by default: one full room of DEFAULT_CLIENTS_PER_ROOM members, created by
+ * the member sending to it, a room its only member sends to, a room of
+ * LARGE_ROOM members and rooms of 2 members. The room message is 100 bytes.
+ *
+ * - validate_msg_format: the room message
+ * - route_client_command: the room message in the full room, including its
+ *   broadcast
+ * - broadcast_message_in_room: the full room, formatting the frame and posting
+ *   it to the mailboxes of the members' workers
+ * - deliver_mailbox_messages: one worker's share of a broadcast in the full
+ *   room, and writing the frame to its members like at the end of an event
+ *   loop iteration. Then a broadcast in a room of LARGE_ROOM members on one
+ *   worker, per member, whose clients take more than the L2 cache of most
+ *   machines unless their hot fields are packed
+ * - send_avail_rooms: listing the rooms, with the worker's room list up to
+ *   date, and right after a room was created or released
+ * - read_and_process_client_message: reads holding all 50 messages of a stream
+ *   and reads splitting every message in two, from the member alone in its
+ *   room, per message
+ *
+ * Cycles are TSC ticks, only measured on x86. The benchmarks whose function
+ * starts with the first argument are the only ones run, e.g. to count their
+ * cache misses with perf stat.
+ */
+#include "../client_state_manager.c"
+#undef LOG_CATEGORY
+#include "../room_manager.c"
+
+#include <stdint.h>      // For uint64_t
+#include <sys/eventfd.h> // For eventfd
+#include <time.h>        // For clock_gettime
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // For __rdtsc
+#define read_cycles() __rdtsc()
+#define HAS_CYCLES true
+#else
+#define read_cycles() 0ULL
+#define HAS_CYCLES false
+#endif
+
+#define WORKERS 4            // Worker contexts the clients are spread over
+#define LARGE_ROOM 8192      // Members of the large room, all on one worker
+
+// Worker delivering its share of the broadcasts, not the sender's
+#define DELIVERING_WORKER (&workers[WORKERS > 1 ? 1 : 0])
+#define ROOMS DEFAULT_ROOMS  // Rooms open during the benchmarks
+#define MESSAGES 50          // Messages in the stream read from a client
+#define CONTENT_LEN 100      // Content bytes per room message
+#define BATCH 64             // Operations timed together when they need no preparation
+#define MIN_OPERATIONS 20000 // Every benchmark runs for at least this many operations
+#define MIN_NS 200000000.0   // and this many nanoseconds
+
+typedef struct Benchmark {
+    const char *function;
+    const char *input;
+    int operations_per_run;   // Operations done by one call of run, e.g. the messages of a stream
+    void (*prepare)(void);    // Untimed, before every run, NULL if runs are timed in batches
+    void (*run)(void);        // Timed
+    void (*after_runs)(void); // Untimed, after every batch or run, NULL if nothing to do
+} Benchmark;
+
+static Worker_Thread workers[WORKERS];
+static Client *full_room_sender; // Created the full room, owns it with ROOM_ACTORS
+static Client *solo_sender;      // Alone in its room
+static Client *lobby_client;
+static Client *large_room_sender; // Alone on its worker in the large room
+static int full_room_id;
+static int next_fd = 1000;
+
+static char room_message[2 + CONTENT_LEN + 1]; // A decoded room message, without its terminator
+static char room_line[MAX_MESSAGE_LEN_FROM_SERVER];
+static char stream[MESSAGES * (sizeof(room_message) + 1)];
+static size_t stream_length;
+
+// The socket recv() reads from
+static size_t stream_offset;
+static size_t read_size;
+
+static unsigned long allocations;
+static volatile unsigned long sink;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    allocations++;
+    return __real_realloc(pointer, size);
+}
+
+ssize_t __wrap_recv(int fd, void *buffer, size_t length, int flags) {
+    (void)fd;
+    (void)flags;
+    if (stream_offset == stream_length) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t bytes = stream_length - stream_offset;
+    bytes = bytes < read_size ? bytes : read_size;
+    bytes = bytes < length ? bytes : length;
+    memcpy(buffer, stream + stream_offset, bytes);
+    stream_offset += bytes;
+    return bytes;
+}
+
+ssize_t __wrap_send(int fd, const void *buffer, size_t length, int flags) {
+    (void)fd;
+    (void)flags;
+    sink += ((const char *)buffer)[0];
+    return length;
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+    (void)fd;
+    (void)flags;
+    size_t length = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        length += msg->msg_iov[i].iov_len;
+    }
+    return length;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Writes the queued output of the worker's clients, like the end of an
+ * event loop iteration
+ */
+static void flush_worker(Worker_Thread *worker) {
+    for (int i = 0; i < worker->num_pending_output; i++) {
+        Client *client = worker->pending_output[i];
+        client->out_queue.send_pending = false;
+        flush_output_queue(client);
+    }
+    worker->num_pending_output = 0;
+}
+
+/**
+ * @brief Delivers every mailbox message and writes the output, until no
+ * worker has anything left to do
+ */
+static void settle_workers(void) {
+    bool busy = true;
+    while (busy) {
+        busy = false;
+        for (int i = 0; i < WORKERS; i++) {
+            if (atomic_load_explicit(&workers[i].mailbox, memory_order_relaxed) != NULL) {
+                busy = true;
+                deliver_mailbox_messages(&workers[i]);
+            }
+            flush_worker(&workers[i]);
+        }
+    }
+}
+
+static Client *add_client(Worker_Thread *worker, const char *name) {
+    const int slot = atomic_fetch_add_explicit(&worker->num_of_clients, 1, memory_order_relaxed);
+    Client *client = &worker->clients[slot];
+    client->cold = &worker->client_cold[slot];
+    client->decoder.partial = client->cold->partial;
+    client->in_use = true;
+    client->state = IN_CHAT_LOBBY;
+    client->client_fd = next_fd++;
+    client->worker = worker;
+    client->generation = ++worker->next_client_generation;
+    snprintf(client->cold->name, sizeof(client->cold->name), "%s", name);
+    init_output_queue(client);
+    return client;
+}
+
+/**
+ * @brief Opens a room created by the first of its members, on the given
+ * worker, with the others spread over all the workers
+ *
+ * @return The room's creator
+ */
+static Client *open_room(const char *room_name, int members, int creator_worker) {
+    char name[MAX_USERNAME_LEN + 1];
+    snprintf(name, sizeof(name), "%s-0", room_name);
+    Client *creator = add_client(&workers[creator_worker], name);
+    create_chat_room(creator, room_name);
+    for (int i = 1; i < members; i++) {
+        snprintf(name, sizeof(name), "%s-%d", room_name, i);
+        join_chat_room(add_client(&workers[(creator_worker + i) % WORKERS], name), room_name);
+        settle_workers();
+    }
+    settle_workers();
+    return creator;
+}
+
+/**
+ * @brief Opens a room of LARGE_ROOM members, its creator on the first worker
+ * and the others on the delivering worker
+ *
+ * The members are added straight to the room, a join of each would send
+ * LARGE_ROOM squared joined messages.
+ *
+ * @return The room's creator
+ */
+static Client *open_large_room(Worker_Thread *members_worker) {
+    Client *creator = add_client(&workers[0], "large-0");
+    create_chat_room(creator, "large");
+    Room *room = get_room(creator->room_index);
+    for (int i = 1; i < LARGE_ROOM; i++) {
+        char name[MAX_USERNAME_LEN + 1];
+        snprintf(name, sizeof(name), "large-%d", i);
+        Client *member = add_client(members_worker, name);
+        if (!reserve_room_member(room)) {
+            exit(EXIT_FAILURE);
+        }
+        add_room_member(room, member, member->generation, members_worker);
+        member->room_index = room->id;
+        member->state = IN_CHAT_ROOM;
+    }
+    return creator;
+}
+
+static void setup(void) {
+    // Room for the large room on top of the default limits
+    server_limits = (Server_Limits){WORKERS, DEFAULT_CLIENTS_PER_THREAD + LARGE_ROOM, ROOMS, LARGE_ROOM};
+    init_room_registry();
+    for (int i = 0; i < WORKERS; i++) {
+        init_worker_memory(&workers[i]);
+        workers[i].index = i;
+        workers[i].mailbox_fd = eventfd(0, EFD_NONBLOCK);
+        if (workers[i].mailbox_fd == -1) {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    full_room_sender = open_room("full", DEFAULT_CLIENTS_PER_ROOM, 0);
+    full_room_id = full_room_sender->room_index;
+    solo_sender = open_room("solo", 1, 0);
+    for (int i = 2; i < ROOMS - 1; i++) {
+        char room_name[MAX_ROOM_NAME_LEN + 1];
+        snprintf(room_name, sizeof(room_name), "room%d", i);
+        open_room(room_name, 2, i % WORKERS);
+    }
+    large_room_sender = open_large_room(DELIVERING_WORKER);
+    lobby_client = add_client(&workers[0], "lobby");
+
+    room_message[0] = CMD_ROOM_MESSAGE_SEND;
+    room_message[1] = ' ';
+    for (int i = 0; i < CONTENT_LEN; i++) {
+        room_message[2 + i] = 'a' + i % 26;
+    }
+    snprintf(room_line, sizeof(room_line), "%s: %s", full_room_sender->cold->name, room_message + 2);
+    for (int i = 0; i < MESSAGES; i++) {
+        memcpy(stream + stream_length, room_message, sizeof(room_message) - 1);
+        stream_length += sizeof(room_message) - 1;
+        memcpy(stream + stream_length, MSG_TERMINATOR, strlen(MSG_TERMINATOR));
+        stream_length += strlen(MSG_TERMINATOR);
+    }
+}
+
+static void run_validate(void) {
+    sink += validate_msg_format(full_room_sender, room_message, sizeof(room_message) - 1);
+}
+
+static void run_route(void) {
+    route_client_command(full_room_sender, full_room_sender->worker, room_message, sizeof(room_message) - 1);
+}
+
+// Single threaded, so the room's lock its callers hold is not taken
+static void run_broadcast(void) {
+    broadcast_message_in_room(room_line, full_room_id, full_room_sender);
+}
+
+static void prepare_delivery(void) {
+    run_broadcast();
+    for (int i = 0; i < WORKERS; i++) {
+        if (&workers[i] != DELIVERING_WORKER) {
+            deliver_mailbox_messages(&workers[i]);
+            flush_worker(&workers[i]);
+        }
+    }
+}
+
+static void run_delivery(void) {
+    deliver_mailbox_messages(DELIVERING_WORKER);
+    flush_worker(DELIVERING_WORKER);
+}
+
+static void prepare_large_delivery(void) {
+    broadcast_message_in_room(room_line, large_room_sender->room_index, large_room_sender);
+}
+
+static void run_list(void) {
+    send_avail_rooms(lobby_client, NULL);
+}
+
+static void flush_lobby(void) {
+    flush_worker(lobby_client->worker);
+}
+
+static void run_framing(void) {
+    stream_offset = 0;
+    while (stream_offset < stream_length) {
+        read_and_process_client_message(solo_sender, solo_sender->worker);
+    }
+}
+
+static void read_whole_stream(void) {
+    read_size = stream_length;
+}
+
+static void read_split_messages(void) {
+    read_size = (sizeof(room_message) + 1) / 2 + 1;
+}
+
+/**
+ * @brief Runs a benchmark for at least MIN_OPERATIONS operations and MIN_NS,
+ * and prints its time, cycles and allocations per operation
+ */
+static void measure(const Benchmark *benchmark) {
+    const int runs_per_timing = benchmark->prepare == NULL ? BATCH : 1;
+    long operations = 0;
+    double ns = 0;
+    uint64_t cycles = 0;
+    unsigned long allocated = 0;
+
+    while (operations < MIN_OPERATIONS || ns < MIN_NS) {
+        if (benchmark->prepare != NULL) {
+            benchmark->prepare();
+        }
+        const unsigned long allocations_before = allocations;
+        const double start = now_ns();
+        const uint64_t start_cycles = read_cycles();
+        for (int i = 0; i < runs_per_timing; i++) {
+            benchmark->run();
+        }
+        cycles += read_cycles() - start_cycles;
+        ns += now_ns() - start;
+        allocated += allocations - allocations_before;
+        operations += (long)runs_per_timing * benchmark->operations_per_run;
+        if (benchmark->after_runs != NULL) {
+            benchmark->after_runs();
+        }
+    }
+
+    printf("%-32s %-36s %10.1f", benchmark->function, benchmark->input, ns / operations);
+    if (HAS_CYCLES) {
+        printf(" %10.1f", (double)cycles / operations);
+    } else {
+        printf(" %10s", "-");
+    }
+    printf(" %8.2f\n", (double)allocated / operations);
+}
+
+int main(int argc, char *argv[]) {
+    const char *only = argc > 1 ? argv[1] : "";
+    char full_room[64];
+    char delivery[64];
+    char rooms[64];
+    char changed_rooms[64];
+    char large_delivery[64];
+    snprintf(full_room, sizeof(full_room), "%d members, %d workers", DEFAULT_CLIENTS_PER_ROOM, WORKERS);
+    snprintf(delivery, sizeof(delivery), "%d of %d members", (DEFAULT_CLIENTS_PER_ROOM + WORKERS - 1) / WORKERS,
+             DEFAULT_CLIENTS_PER_ROOM);
+    snprintf(rooms, sizeof(rooms), "%d rooms, list up to date", ROOMS);
+    snprintf(changed_rooms, sizeof(changed_rooms), "%d rooms, right after a change", ROOMS);
+    snprintf(large_delivery, sizeof(large_delivery), "%d members on a worker, per member", LARGE_ROOM - 1);
+
+    setup();
+    const Benchmark benchmarks[] = {
+        {"validate_msg_format", "room message", 1, NULL, run_validate, NULL},
+        {"route_client_command", full_room, 1, NULL, run_route, settle_workers},
+        {"broadcast_message_in_room", full_room, 1, NULL, run_broadcast, settle_workers},
+        {"deliver_mailbox_messages", delivery, 1, prepare_delivery, run_delivery, NULL},
+        {"deliver_mailbox_messages", large_delivery, LARGE_ROOM - 1, prepare_large_delivery, run_delivery, NULL},
+        {"send_avail_rooms", rooms, 1, NULL, run_list, flush_lobby},
+        {"send_avail_rooms", changed_rooms, 1, room_list_changed, run_list, flush_lobby},
+        {"read_and_process_client_message", "reads of whole streams, per message", MESSAGES, read_whole_stream,
+         run_framing, NULL},
+        {"read_and_process_client_message", "split messages, per message", MESSAGES, read_split_messages,
+         run_framing, NULL},
+    };
+
+    printf("server hot functions, %d byte room messages, per operation\n", CONTENT_LEN);
+    printf("%-32s %-36s %10s %10s %8s\n", "function", "input", "ns", "cycles", "allocs");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (strncmp(benchmarks[i].function, only, strlen(only)) == 0) {
+            measure(&benchmarks[i]);
+        }
+    }
+    return 0;
+}
@@ -1,25 +1,158 @@
+#define _GNU_SOURCE // Enables GNU extensions required for CPU_SETSIZE
 
 // Local
-#include "client_state_manager.h" // For send_message_to_client()
+#include "client_state_manager.h" // For send_message_to_fd()
+#include "latency.h"              // For monotonic_time_ns()
 #include "logger.h"               // Has the logging function for LOG_INFO, LOG_SERVER_ERROR, LOG_WARNING
+#include "metrics.h"              // For count_metric(), main_thread_metrics
+#include "server_limits.h"        // For server_limits
 // Library
-#include "errno.h"   // For errno
-#include "string.h"  // For strerror
-#include <pthread.h> // For pthread_create
-#include <stdint.h>  // For uint64_t
-#include <unistd.h>  // For write, close
+#include "errno.h"      // For errno, EAGAIN
+#include "string.h"     // For strerror, strcmp
+#include <limits.h>     // For INT_MAX
+#include <sched.h>      // For CPU_SETSIZE
+#include <stdatomic.h>  // For atomic_load_explicit, atomic_store_explicit, atomic_fetch_add_explicit
+#include <stdbool.h>    // For bool type
+#include <stdint.h>     // For uint64_t
+#include <stdlib.h>     // For calloc, malloc
+#include <sys/socket.h> // For getsockopt, SO_INCOMING_CPU
+#include <unistd.h>     // For write, close
 
-static int find_worker_not_at_capacity(Worker_Thread workers[]);
+#define LOG_CATEGORY LOG_ACCEPT // The log level of this category enables the file's log lines
 
-static void handle_write_error(Worker_Thread workers[], int worker_index, int client_fd);
+// How busy a worker thread was, as last sampled by the main thread
+typedef struct Worker_Load {
+    unsigned long busy_ns; // The worker's busy_ns counter at the last sample
+    int busy_permille;     // Share of the last sample interval the worker spent busy
+} Worker_Load;
+
+// Names of the policies, as given to --placement and exported in the metrics
+static const char *const placement_names[] = {
+    [PLACE_ROUND_ROBIN] = "round-robin",
+    [PLACE_TWO_CHOICES] = "two-choices",
+    [PLACE_LEAST_LOADED] = "least-loaded",
+    [PLACE_INCOMING_CPU] = "incoming-cpu",
+    [PLACE_REUSEPORT] = "reuseport",
+};
+
+static PLACEMENT_POLICY placement = PLACE_TWO_CHOICES;
+
+// Only used by the main thread
+static Worker_Load *worker_loads; // One per worker thread
+static uint64_t last_load_sample_ns;
+static uint64_t random_state; // xorshift64 state of the two random choices
+// With incoming-cpu, the worker next given a connection that came in on each CPU, -1 if no worker is pinned to it,
+// and the worker after each worker on the same CPU, in a circle
+static int *cpu_workers;
+static int *next_cpu_workers;
+
+static int place_new_client(Worker_Thread workers[], int client_fd);
+
+static void sample_worker_loads(Worker_Thread workers[]);
+
+static int worker_load(Worker_Thread workers[], int worker_index);
+
+static int pick_round_robin(Worker_Thread workers[]);
+
+static int pick_two_choices(Worker_Thread workers[]);
+
+static int pick_least_loaded(Worker_Thread workers[]);
+
+static int pick_incoming_cpu(Worker_Thread workers[], int client_fd);
+
+static bool push_new_client(Worker_Thread *worker, int client_fd);
+
+static void handle_handoff_error(Worker_Thread workers[], int worker_index, int client_fd);
 
 /**
- * @brief Distributes new client connections across worker threads using
- * round-robin dispatching
+ * @brief Sets the placement policy given on the command line
+ *
+ * @param name round-robin, two-choices, least-loaded or incoming-cpu
  *
- * Attempts to assign the client to the next available worker thread that isn't
- * at capacity. If all threads are at capacity, rejects the connection. Uses
- * eventfd to notify worker threads of new clients.
+ * @return false if there is no such policy
+ */
+bool set_placement_policy(const char *name) {
+    for (PLACEMENT_POLICY policy = PLACE_ROUND_ROBIN; policy < PLACE_REUSEPORT; policy++) {
+        if (strcmp(name, placement_names[policy]) == 0) {
+            placement = policy;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Name of the placement policy in use, for the metrics
+ */
+const char *placement_policy_name(void) {
+    return placement_names[placement];
+}
+
+/**
+ * @brief Whether the placement policy needs the worker threads pinned to CPUs
+ */
+bool placement_pins_workers(void) {
+    return placement == PLACE_INCOMING_CPU;
+}
+
+/**
+ * @brief Sets up the load samples the placement policies compare the worker
+ * threads by, and with incoming-cpu which worker each CPU's connections go to
+ *
+ * @param workers    Array of worker threads, with their cpu set
+ * @param reuse_port Whether the server runs with --reuseport. The kernel then
+ *                   places the clients and the policy is reported as
+ *                   reuseport
+ *
+ * @note Must be called by the main thread after setup_threads(). Exits the
+ * process if the samples cannot be allocated
+ */
+void init_client_distributor(Worker_Thread workers[], bool reuse_port) {
+    if (reuse_port) {
+        placement = PLACE_REUSEPORT;
+        return;
+    }
+    worker_loads = calloc(server_limits.worker_threads, sizeof(Worker_Load));
+    if (worker_loads == NULL) {
+        print_erro_n_exit("Could not allocate the worker load samples in init_client_distributor");
+    }
+    if (placement == PLACE_INCOMING_CPU) {
+        cpu_workers = malloc(sizeof(int) * CPU_SETSIZE);
+        next_cpu_workers = malloc(sizeof(int) * server_limits.worker_threads);
+        if (cpu_workers == NULL || next_cpu_workers == NULL) {
+            print_erro_n_exit("Could not allocate the CPUs' workers in init_client_distributor");
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            cpu_workers[cpu] = -1;
+        }
+        for (int i = 0; i < server_limits.worker_threads; i++) {
+            const int cpu = workers[i].cpu;
+            if (cpu_workers[cpu] == -1) {
+                cpu_workers[cpu] = i;
+            }
+            // The last worker on the CPU closes the circle back to the first
+            next_cpu_workers[i] = cpu_workers[cpu];
+            for (int j = i + 1; j < server_limits.worker_threads; j++) {
+                if (workers[j].cpu == cpu) {
+                    next_cpu_workers[i] = j;
+                    break;
+                }
+            }
+        }
+    }
+    last_load_sample_ns = monotonic_time_ns();
+    random_state = last_load_sample_ns | 1;
+    LOG_INFO("Placing clients on worker threads with the %s policy\n", placement_names[placement]);
+}
+
+/**
+ * @brief Hands a new client connection to a worker thread picked by the
+ * placement policy
+ *
+ * Assigns the client to a worker thread that isn't at capacity. If all threads
+ * are at capacity, rejects the connection. The fd
+ * is added to the worker's new_clients queue and the worker's notification_fd
+ * eventfd is rung, without waiting for the worker to pick the client up.
  *
  * @param client_fd file descriptor of the newly accepted client connection
  * @param workers array of worker threads to distribute clients across
@@ -27,99 +160,257 @@ static void handle_write_error(Worker_Thread workers[], int worker_index, int cl
 void distribute_client(int client_fd, Worker_Thread workers[]) {
     const char *capacity_err_msg = "Sorry, the server is currently at full "
                                    "capacity. Please try again later!\r\n";
-
-    // Even though client_fd is an int, it needs to be converted for compatability
-    // with event_fd
-    uint64_t client_fd_as_uint64 = (uint64_t)client_fd;
+    const uint64_t ring = 1;
 
     LOG_INFO("Attempting to distribute new client with (fd=%d)\n", client_fd);
 
-    int worker_assigned_index = find_worker_not_at_capacity(workers);
+    int worker_assigned_index = place_new_client(workers, client_fd);
 
     if (worker_assigned_index == -1) {
-        send_message_to_client(client_fd, ERR_SERVER_FULL, capacity_err_msg);
+        count_metric(&main_thread_metrics.rejected_clients, 1);
+        send_message_to_fd(client_fd, ERR_SERVER_FULL, capacity_err_msg);
         if (close(client_fd) == -1) {
             LOG_SERVER_ERROR("Failed to close client fd %d: %s\n", client_fd, strerror(errno));
         }
         return;
     }
 
-    LOG_INFO("Assigned client (fd=%d) to worker thread %lu (current number of "
-             "clients=%d)\n",
-             client_fd, worker_assigned_index, workers[worker_assigned_index].id);
+    LOG_INFO("Assigned client (fd=%d) to worker thread %d\n", client_fd, worker_assigned_index);
 
-    if (sem_wait(&workers[worker_assigned_index].new_client) == -1) {
-        LOG_SERVER_ERROR("sem_Wait failed in distribute_client: %s\n", strerror(errno));
+    if (!push_new_client(&workers[worker_assigned_index], client_fd)) {
+        handle_handoff_error(workers, worker_assigned_index, client_fd);
+        return;
     }
 
-    // Notify chosen worker thread of new client using eventfd
-    if (write(workers[worker_assigned_index].notification_fd, &client_fd_as_uint64, sizeof(uint64_t)) == -1) {
-        handle_write_error(workers, worker_assigned_index, client_fd);
-        return;
+    // The fd is already queued, so a failed ring only delays the client until the next one
+    if (write(workers[worker_assigned_index].notification_fd, &ring, sizeof(ring)) == -1 && errno != EAGAIN) {
+        LOG_SERVER_ERROR("Failed to notify worker thread %d of new client (fd=%d): %s\n", worker_assigned_index,
+                         client_fd, strerror(errno));
     }
 }
+
 /**
- * @brief Handles write error that occurs when trying to write a new client fd
- * to the notification fd in the worker thread
+ * @brief Adds a client fd to a worker's new_clients queue. Must only be called
+ * from the main thread, the single producer of the queue.
  *
- * Performs cleanup when writing to worker's notification fd fails:
- * 1. Posts back to semaphore
- * 2. Sends error message to client
- * 3. Closes client connection
- * 4. Decrements worker's client count
+ * @param worker The worker thread the client was assigned to
+ * @param client_fd The client to hand over
+ * @return true if the fd was queued, false if the queue is full
+ */
+static bool push_new_client(Worker_Thread *worker, int client_fd) {
+    New_Client_Queue *queue = &worker->new_clients;
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head == queue->mask + 1) {
+        return false;
+    }
+    queue->fds[tail & queue->mask] = client_fd;
+    // Publishes the fd to the worker
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * @brief Handles a client that could not be handed over to its worker thread
+ *
+ * Performs cleanup when the worker's new_clients queue is full:
+ * 1. Sends error message to client
+ * 2. Closes client connection
+ * 3. Decrements worker's client count
  *
  * @param workers Array of worker threads
  * @param worker_index Index of worker that failed
  * @param client_fd Client connection to clean up
  */
-static void handle_write_error(Worker_Thread workers[], int worker_index, int client_fd) {
+static void handle_handoff_error(Worker_Thread workers[], int worker_index, int client_fd) {
     const char *connection_error_msg = "Sorry, there was an error connecting to the server. Please try "
                                        "again!\r\n";
 
-    LOG_SERVER_ERROR("Failed to notify worker thread %d of new client (fd=%d): %s\n", worker_index, client_fd,
-                     strerror(errno));
+    LOG_SERVER_ERROR("New client queue of worker thread %d is full, dropping client (fd=%d)\n", worker_index,
+                     client_fd);
 
-    if (sem_post(&workers[worker_index].new_client) == -1) {
-        LOG_SERVER_ERROR("sem_wait in distribute_client fialed: \n", strerror(errno));
-    }
-    send_message_to_client(client_fd, ERR_CONNECTING, connection_error_msg);
+    send_message_to_fd(client_fd, ERR_CONNECTING, connection_error_msg);
     if (close(client_fd) == -1) {
         LOG_SERVER_ERROR("Failed to close client fd %d: %s\n", client_fd, strerror(errno));
     }
-    pthread_mutex_lock(&workers[worker_index].num_of_clients_lock);
-    workers[worker_index].num_of_clients--;
-    pthread_mutex_unlock(&workers[worker_index].num_of_clients_lock);
+    atomic_fetch_sub_explicit(&workers[worker_index].num_of_clients, 1, memory_order_relaxed);
 }
 
 /**
- * @brief Finds next available worker thread that can accept new clients
+ * @brief Picks the worker thread a new client goes to with the placement
+ * policy, and counts the client against it
  *
- * Uses round-robin selection with. Maintains a static index
- * for distribution. Checks each worker's current client count. Returns first
- * worker found under capacity. Returns -1 if all workers are at capacity.
+ * @param workers   Array of worker threads to pick from
+ * @param client_fd The new client's socket
+ * @return index of the selected worker, or -1 if all workers are at capacity
+ */
+static int place_new_client(Worker_Thread workers[], int client_fd) {
+    int worker_index;
+    switch (placement) {
+    case PLACE_INCOMING_CPU:
+        sample_worker_loads(workers);
+        worker_index = pick_incoming_cpu(workers, client_fd);
+        break;
+    case PLACE_TWO_CHOICES:
+        sample_worker_loads(workers);
+        worker_index = pick_two_choices(workers);
+        break;
+    case PLACE_LEAST_LOADED:
+        sample_worker_loads(workers);
+        worker_index = pick_least_loaded(workers);
+        break;
+    default:
+        worker_index = pick_round_robin(workers);
+        break;
+    }
+
+    if (worker_index != -1) {
+        // Only the main thread raises the count, so it is still below clients_per_thread
+        atomic_fetch_add_explicit(&workers[worker_index].num_of_clients, 1, memory_order_relaxed);
+    }
+    return worker_index;
+}
+
+/**
+ * @brief Works out how busy each worker thread was since the last sample, at
+ * most every LOAD_SAMPLE_INTERVAL_MS
+ *
+ * A worker's busy_ns only grows when it goes back to waiting, so a worker
+ * stuck in a long loop iteration is seen as busy once the iteration ends.
+ *
+ * @param workers Array of worker threads
+ */
+static void sample_worker_loads(Worker_Thread workers[]) {
+    const uint64_t now = monotonic_time_ns();
+    const uint64_t elapsed_ns = now - last_load_sample_ns;
+    if (elapsed_ns < LOAD_SAMPLE_INTERVAL_MS * 1000000ULL) {
+        return;
+    }
+    for (int i = 0; i < server_limits.worker_threads; i++) {
+        const unsigned long busy_ns = atomic_load_explicit(&workers[i].metrics.busy_ns, memory_order_relaxed);
+        const int busy_permille = (busy_ns - worker_loads[i].busy_ns) * 1000 / elapsed_ns;
+        worker_loads[i].busy_permille = busy_permille < 1000 ? busy_permille : 1000;
+        worker_loads[i].busy_ns = busy_ns;
+    }
+    last_load_sample_ns = now;
+}
+
+/**
+ * @brief Load of a worker thread: the share of its clients_per_thread in use
+ * plus the share of the last sample interval it was busy, both in permille
+ *
+ * Live connections tell how many clients a worker has, busy time how much
+ * work they make, e.g. a worker holding the busiest rooms.
+ *
+ * @param workers      Array of worker threads
+ * @param worker_index The worker to weigh
+ *
+ * @return The load, from 0 to 2000, or INT_MAX if the worker is at capacity
+ */
+static int worker_load(Worker_Thread workers[], int worker_index) {
+    const int clients = atomic_load_explicit(&workers[worker_index].num_of_clients, memory_order_relaxed);
+    if (clients >= server_limits.clients_per_thread) {
+        return INT_MAX;
+    }
+    return (int)((long)clients * 1000 / server_limits.clients_per_thread) + worker_loads[worker_index].busy_permille;
+}
+
+/**
+ * @brief Finds the next worker thread, in turn, that is not at capacity
  *
  * @param workers Array of worker threads to search
  * @return index of selected worker, or -1 if all workers at capacity
  */
-static int find_worker_not_at_capacity(Worker_Thread workers[]) {
+static int pick_round_robin(Worker_Thread workers[]) {
     static int worker_index = 0;
-    int num_attempts = 0;
-
-    // Finds a worker thread not at capacity,otherwise reject
-    pthread_mutex_lock(&workers[worker_index].num_of_clients_lock);
-    while (workers[worker_index].num_of_clients >= MAX_CLIENTS_PER_THREAD) {
-        pthread_mutex_unlock(&workers[worker_index].num_of_clients_lock);
-        worker_index = (worker_index + 1) % MAX_THREADS;
-        if (num_attempts++ == MAX_THREADS) {
-            return -1;
+
+    for (int attempt = 0; attempt < server_limits.worker_threads; attempt++) {
+        const int candidate = worker_index;
+        worker_index = (worker_index + 1) % server_limits.worker_threads;
+        if (atomic_load_explicit(&workers[candidate].num_of_clients, memory_order_relaxed) <
+            server_limits.clients_per_thread) {
+            return candidate;
         }
-        pthread_mutex_lock(&workers[worker_index].num_of_clients_lock);
     }
+    return -1;
+}
 
-    workers[worker_index].num_of_clients++;
-    pthread_mutex_unlock(&workers[worker_index].num_of_clients_lock);
-    int selected_worker = worker_index;
-    worker_index = (worker_index + 1) % MAX_THREADS;
+/**
+ * @brief Picks two different worker threads at random and takes the less
+ * loaded one
+ *
+ * Comparing two random workers keeps the clients about as evenly spread as
+ * comparing them all, without every placement reading every worker's
+ * counters. If both are at capacity, every worker is looked at.
+ *
+ * @param workers Array of worker threads to pick from
+ * @return index of selected worker, or -1 if all workers at capacity
+ */
+static int pick_two_choices(Worker_Thread workers[]) {
+    const int num_workers = server_limits.worker_threads;
+    if (num_workers == 1) {
+        return worker_load(workers, 0) != INT_MAX ? 0 : -1;
+    }
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    const int first = random_state % num_workers;
+    int second = (random_state >> 32) % (num_workers - 1);
+    second += second >= first;
 
+    const int first_load = worker_load(workers, first);
+    const int second_load = worker_load(workers, second);
+    if (first_load == INT_MAX && second_load == INT_MAX) {
+        return pick_least_loaded(workers);
+    }
+    return first_load <= second_load ? first : second;
+}
+
+/**
+ * @brief Picks the least loaded worker thread
+ *
+ * @param workers Array of worker threads to pick from
+ * @return index of selected worker, or -1 if all workers at capacity
+ */
+static int pick_least_loaded(Worker_Thread workers[]) {
+    int selected_worker = -1;
+    int selected_load = INT_MAX;
+    for (int i = 0; i < server_limits.worker_threads; i++) {
+        const int load = worker_load(workers, i);
+        if (load < selected_load) {
+            selected_worker = i;
+            selected_load = load;
+        }
+    }
     return selected_worker;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Picks the worker thread pinned to the CPU the connection came in on
+ *
+ * The kernel reports the CPU that handled the connection's packets with
+ * SO_INCOMING_CPU, usually the one its network queue interrupts. Serving the
+ * client from a worker on that CPU keeps its interrupts, socket buffers and
+ * processing in one CPU's caches. Workers sharing a CPU take its connections
+ * in turns. If no worker is pinned to the CPU or it is at capacity, the
+ * client is placed by two-choices instead.
+ *
+ * @param workers   Array of worker threads to pick from
+ * @param client_fd The new client's socket
+ * @return index of selected worker, or -1 if all workers at capacity
+ */
+static int pick_incoming_cpu(Worker_Thread workers[], int client_fd) {
+    int cpu;
+    socklen_t length = sizeof(cpu);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == 0 && cpu >= 0 && cpu < CPU_SETSIZE &&
+        cpu_workers[cpu] != -1) {
+        const int worker_index = cpu_workers[cpu];
+        cpu_workers[cpu] = next_cpu_workers[worker_index];
+        if (worker_load(workers, worker_index) != INT_MAX) {
+            return worker_index;
+        }
+    }
+    return pick_two_choices(workers);
+}
@@ -1,5 +1,9 @@
 #ifndef CLIENT_DISTRIBUTOR_H
 #define CLIENT_DISTRIBUTOR_H
 #include "server_config.h"
+bool set_placement_policy(const char *name);
+const char *placement_policy_name(void);
+bool placement_pins_workers(void);
+void init_client_distributor(Worker_Thread workers[], bool reuse_port);
 void distribute_client(int client_fd, Worker_Thread workers[]);
 #endif
\ No newline at end of file
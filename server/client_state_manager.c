@@ -2,39 +2,59 @@
 // Local
 #include "client_state_manager.h" // For our own declarations and constants
 
-#include "logger.h"   // Has the logging function for LOG_INFO, LOG_SERVER_ERROR, LOG_WARNING
-#include "protocol.h" // For command types, message length constants
-#include "room_manager.h"
+#include "connection_handler.h" // For release_client_slot()
+#include "event_loop.h"         // For unwatch_client()
+#include "frame_decoder.h"      // For set_decoder_input(), decode_next_message()
+#include "latency.h"            // For monotonic_time_ns()
+#include "logger.h"             // For LOG_INFO, LOG_SERVER_ERROR, LOG_WARNING, set_log_client()
+#include "mailbox.h"            // For deliver_mailbox_messages()
+#include "metrics.h"            // For count_metric()
+#include "output_queue.h"       // For send_or_queue(), destroy_output_queue()
+#include "protocol.h"           // For command types, message length constants
+#include "room_manager.h"       // For join_chat_room(), leave_room(), send_room_message(), apply_room_reply()
 
 // Library
 #include <ctype.h>      // For isdigit
 #include <errno.h>      // For errno, EAGAIN, EWOULDBLOCK
-#include <pthread.h>    // For pthread_mutex_lock/unlock
+#include <stdatomic.h>  // For atomic_fetch_sub_explicit
 #include <stdbool.h>    // For bool type
 #include <stdio.h>      // For sprintf, snprintf, perror()
-#include <stdlib.h>     // For atoi
-#include <string.h>     // For strstr, strcpy, strlen, memset
+#include <stdlib.h>     // For atoi, realloc, free
+#include <string.h>     // For memchr, memcpy, strlen
 #include <string.h>     // For strerror()
-#include <sys/epoll.h>  // For epoll_ctl
 #include <sys/socket.h> // For recv, send
 #include <unistd.h>     // For close
 
-static void handle_awaiting_username(Client *client);
-static void handle_in_chat_lobby(Client *client);
-static void handle_in_chat_room(Client *client);
-static void route_client_command(Client *client, Worker_Thread *thread_context);
+#define LOG_CATEGORY LOG_PROTOCOL // The log level of this category enables the file's log lines
+
+static void handle_awaiting_username(Client *client, const char *username, size_t username_length);
+static void handle_in_chat_lobby(Client *client, char command, const char *content);
+static void handle_in_chat_room(Client *client, char command, const char *content);
+static void route_client_command(Client *client, Worker_Thread *thread_context, const char *message, size_t length);
 static void cleanup_client(Client *client, Worker_Thread *thread_context);
+static void hold_client_input(Client *client, Worker_Thread *thread_context, const char *data, size_t length);
+static bool read_client_socket(Client *client, Worker_Thread *thread_context);
+static void decode_client_data(Client *client, Worker_Thread *thread_context, char *data, size_t length);
 
-static bool validate_msg_format(Client *client);
-static bool command_valid_for_state(const Client *client);
+static bool validate_msg_format(Client *client, const char *message, size_t length);
+static bool command_valid_for_state(Client *client, char command);
 
 /**
  * @brief Reads client messages and process them.
  *
- * This function reads data from the client's socket, processes complete
- * messages terminated by "\r\n", and routes them for handling. Incomplete
- * messages are stored in the client's message buffer for later completion.
- * Handles disconnection if recv fails.
+ * This function reads data from the client's socket into the worker's
+ * recv_buffer, processes complete messages terminated by "\r\n", and routes
+ * them for handling. Incomplete messages are kept by the client's decoder for
+ * later completion. Handles disconnection if recv fails.
+ *
+ * In edge triggered mode the socket is read until EAGAIN, so that a client
+ * pipelining many messages costs one epoll wakeup, but never more than
+ * CLIENT_READ_BUDGET bytes per call so one chatty client cannot starve the
+ * others. In level triggered mode there is a single recv per call and epoll
+ * reports the client again if more data is waiting.
+ *
+ * The lines logged meanwhile are about the client, so they are logged whatever
+ * the log levels while the client is traced.
  *
  * @param client            Pointer to the Client structure representing the
  *                          connected client. Contains the socket fd and the
@@ -42,139 +62,352 @@ static bool command_valid_for_state(const Client *client);
  * @param thread_context    Pointer to the Worker thread context containing data
  *                          about the thread handling the client
  *
+ * @return true if the read budget ran out before the socket was drained, so
+ * the client has to be read again without waiting for epoll
+ */
+bool read_and_process_client_message(Client *client, Worker_Thread *thread_context) {
+    const Client *previous_log_client = set_log_client(client);
+    const bool budget_used_up = read_client_socket(client, thread_context);
+    set_log_client(previous_log_client);
+    return budget_used_up;
+}
+
+/**
+ * @brief Implementation of read_and_process_client_message()
+ *
+ * @param client         The client whose socket is readable
+ * @param thread_context Worker thread context containing data about the thread
+ *
+ * @return true if the read budget ran out before the socket was drained
  */
-void read_and_process_client_message(Client *client, Worker_Thread *thread_context) {
-    char read_buffer[MAX_MESSAGE_LEN_TO_SERVER + 1];
-    ssize_t bytes_received = recv(client->client_fd, read_buffer, MAX_MESSAGE_LEN_TO_SERVER, 0);
-    if (bytes_received <= 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+static bool read_client_socket(Client *client, Worker_Thread *thread_context) {
+    const unsigned int generation = client->generation;
+    size_t budget = CLIENT_READ_BUDGET;
+
+    do {
+        size_t read_size = budget < WORKER_RECV_BUFFER_SIZE ? budget : WORKER_RECV_BUFFER_SIZE;
+        ssize_t bytes_received = recv(client->client_fd, thread_context->recv_buffer, read_size, 0);
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             LOG_INFO("Tried getting client fd %d message but errno was EAGAIN or "
                      "EWOULDBLOCK\n",
                      client->client_fd);
+            return false;
+        }
+        if (bytes_received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_received <= 0) {
+            LOG_INFO("Client fd %d disconnected during receive\n", client->client_fd);
+            handle_client_disconnection(client, thread_context);
+            return false;
+        }
 
+        process_client_data(client, thread_context, thread_context->recv_buffer, bytes_received);
+        // The client may have exited, in which case its slot has been released
+        if (!client->in_use || client->generation != generation) {
+            return false;
+        }
+        budget -= bytes_received;
+    } while (EDGE_TRIGGERED_READS && budget > 0);
+
+    return EDGE_TRIGGERED_READS;
+}
+
+/**
+ * @brief Splits received data into messages and routes every complete one
+ *
+ * The client's decoder hands back each message as a view into the received
+ * data, or into its own partial buffer for a message split over several reads.
+ * A message longer than MAX_MESSAGE_LEN_TO_SERVER is answered with an
+ * ERR_PROTOCOL_INVALID_FORMAT error and skipped.
+ *
+ * Called with the worker's recv_buffer by read_and_process_client_message(),
+ * and with the kernel filled provided buffer of each recv completion by the
+ * io_uring backend.
+ *
+ * While the client awaits the reply to a join or leave posted to the room's
+ * owner with ROOM_ACTORS, the data is held back instead, and processed by
+ * replay_held_input() once the reply arrives.
+ *
+ * The lines logged meanwhile are about the client, see set_log_client(). The
+ * time the data is processed at is taken as the time the room messages in it
+ * were received, to time their fan-out to the room with.
+ *
+ * @param client         The client the data was received from
+ * @param thread_context Worker thread context containing data about the thread
+ * @param data           The received bytes
+ * @param length         Number of bytes received
+ *
+ * @see decode_next_message() in frame_decoder.c
+ */
+void process_client_data(Client *client, Worker_Thread *thread_context, char *data, size_t length) {
+    const Client *previous_log_client = set_log_client(client);
+    thread_context->received_at = monotonic_time_ns();
+    count_metric(&thread_context->metrics.bytes_in, length);
+    decode_client_data(client, thread_context, data, length);
+    set_log_client(previous_log_client);
+}
+
+/**
+ * @brief Implementation of process_client_data()
+ *
+ * @param client         The client the data was received from
+ * @param thread_context Worker thread context containing data about the thread
+ * @param data           The received bytes
+ * @param length         Number of bytes received
+ */
+static void decode_client_data(Client *client, Worker_Thread *thread_context, char *data, size_t length) {
+    char *message;
+    size_t message_length;
+
+    LOG_INFO("Received %zu bytes from client fd %d\n", length, client->client_fd);
+    if (client->awaiting_room_reply || client->replay_pending) {
+        hold_client_input(client, thread_context, data, length);
+        return;
+    }
+    set_decoder_input(&client->decoder, data, length);
+    while (1) {
+        DECODE_RESULT result = decode_next_message(&client->decoder, &message, &message_length);
+        if (result == MESSAGE_INCOMPLETE) {
+            return;
+        }
+        count_metric(&thread_context->metrics.messages_in, 1);
+        if (result == MESSAGE_TOO_LONG) {
+            LOG_USER_ERROR("Message from client fd %d is longer than MAX_MESSAGE_LEN_TO_SERVER, dropping it\n",
+                           client->client_fd);
+            send_message_to_client(client, ERR_PROTOCOL_INVALID_FORMAT,
+                                   "Invalid Foramt: Message too long\nCorrect format:[command "
+                                   "char][space][message content][MSG_TERMINATOR]\n");
+            continue;
+        }
+
+        LOG_INFO("Processing complete message from client fd %d: %s\n", client->client_fd, message);
+        route_client_command(client, thread_context, message, message_length);
+        // The client exited, the rest of the data is not read
+        if (!client->in_use) {
+            return;
+        }
+        if (client->awaiting_room_reply) {
+            hold_client_input(client, thread_context, client->decoder.input, client->decoder.input_length);
             return;
         }
-        LOG_INFO("Client fd %d disconnected during receive\n", client->client_fd);
+    }
+}
+
+/**
+ * @brief Applies the reply of a room's owner to the client's join or leave
+ * request
+ *
+ * The data received from the client in the meantime is not processed here but
+ * by replay_held_input() at the end of the loop iteration: it can make the
+ * client exit, and the events of the iteration not handled yet may still be
+ * about the client's slot. Until then, more data from the client is held too.
+ *
+ * @param client         The client that was awaiting the reply
+ * @param thread_context Worker thread context containing data about the thread
+ * @param reply          Command of the owner's reply
+ * @param room_index     The room the request was for
+ *
+ * @see handle_room_operation() in room_manager.c
+ */
+void finish_room_request(Client *client, Worker_Thread *thread_context, char reply, int room_index) {
+    const Client *previous_log_client = set_log_client(client);
+    client->awaiting_room_reply = false;
+    apply_room_reply(client, reply, room_index);
+
+    if (client->cold->held_input != NULL) {
+        client->replay_pending = true;
+        thread_context->replay_clients[thread_context->num_replay_clients++] =
+            (Mailbox_Recipient){.client = client, .generation = client->generation};
+    }
+    set_log_client(previous_log_client);
+}
+
+/**
+ * @brief Processes the data the clients received while awaiting a room's
+ * owner, for every client whose reply arrived during the loop iteration
+ *
+ * The room messages in the held data are timed from when the first of it was
+ * received, so their fan-out latency includes the wait for the reply. Held
+ * data can post another join or leave, so the mailbox is delivered again
+ * until no more replies come in. A client that disconnected meanwhile is
+ * skipped.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ *
+ * @note Called by the event loop once the events of the iteration are handled
+ */
+void replay_held_input(Worker_Thread *thread_context) {
+    while (thread_context->num_replay_clients > 0) {
+        const int num_replay_clients = thread_context->num_replay_clients;
+        thread_context->num_replay_clients = 0;
+        for (int i = 0; i < num_replay_clients; i++) {
+            Client *client = thread_context->replay_clients[i].client;
+            if (!client->in_use || client->generation != thread_context->replay_clients[i].generation) {
+                continue;
+            }
+            const Client *previous_log_client = set_log_client(client);
+            Client_Cold *cold = client->cold;
+            char *held_input = cold->held_input;
+            const size_t held_input_length = cold->held_input_length;
+            client->replay_pending = false;
+            cold->held_input = NULL;
+            cold->held_input_length = 0;
+            thread_context->received_at = cold->held_input_received_at;
+            decode_client_data(client, thread_context, held_input, held_input_length);
+            free(held_input);
+            set_log_client(previous_log_client);
+        }
+        deliver_mailbox_messages(thread_context);
+    }
+}
+
+/**
+ * @brief Keeps data received while the client awaits a room's owner, so its
+ * messages are processed in order after the reply
+ *
+ * At most CLIENT_READ_BUDGET bytes are held, a client sending more before the
+ * reply arrives is disconnected.
+ *
+ * @param client         The client the data was received from
+ * @param thread_context Worker thread context containing data about the thread
+ * @param data           The bytes not processed yet
+ * @param length         Number of bytes
+ */
+static void hold_client_input(Client *client, Worker_Thread *thread_context, const char *data, size_t length) {
+    Client_Cold *cold = client->cold;
+    if (length == 0) {
+        return;
+    }
+    if (cold->held_input_length + length > CLIENT_READ_BUDGET) {
+        LOG_USER_ERROR("Client fd %d sent more than %d bytes while awaiting a room reply, disconnecting\n",
+                       client->client_fd, CLIENT_READ_BUDGET);
         handle_client_disconnection(client, thread_context);
         return;
     }
 
-    read_buffer[bytes_received] = '\0';
-    LOG_INFO("Received %zd bytes from client fd %d: %s\n", bytes_received, client->client_fd, read_buffer);
-
-    // 1. Splits received data into complete messages (delimited by \r\n)
-    // 2. Processes each complete message
-    // 3. Stores any remaining partial message in client->current_msg buffer for future completion
-    char *temp = read_buffer;
-    char *msg_term = strstr(read_buffer, "\r\n");
-    while (msg_term != NULL) {
-        *msg_term = '\0';
-        strcat(client->current_msg, temp);
-        LOG_INFO("Processing complete message from client fd %d: %s\n", client->client_fd, client->current_msg);
-        route_client_command(client, thread_context); // Handle complete messages
-        memset(client->current_msg, 0, sizeof(client->current_msg));
-        temp = msg_term + 2;
-        msg_term = strstr(temp, "\r\n"); // find the next message
+    char *held_input = realloc(cold->held_input, cold->held_input_length + length);
+    if (held_input == NULL) {
+        LOG_SERVER_ERROR("Could not hold %zu bytes from client fd %d, disconnecting\n", length, client->client_fd);
+        handle_client_disconnection(client, thread_context);
+        return;
     }
-
-    // Saving the partial incomplete message
-    if (*temp != '\0') {
-        strcat(client->current_msg, temp);
-        LOG_INFO("Stored partial message from client fd %d: %s\n", client->client_fd, client->current_msg);
+    memcpy(held_input + cold->held_input_length, data, length);
+    if (cold->held_input_length == 0) {
+        cold->held_input_received_at = thread_context->received_at;
     }
+    cold->held_input = held_input;
+    cold->held_input_length += length;
 }
 
 /**
  * @brief Sends a message to a client formatted to the specification in
  * protcol.h
  *
- * Constructs a message with a command type, content, and terminator, then sends
- * it to the specified client's socket and logs the message.
+ * Constructs a message with a command type, content, and terminator, then
+ * writes it to the client's socket. Whatever the socket cannot take right away
+ * is kept in the client's output queue and flushed once the socket is writable
+ * again, so a slow reader never stalls the calling thread.
  *
- * @param client_fd  File descriptor of the client to send the message to.
+ * @param client    The client to send the message to.
  * @param cmd_type  Command character to prefix the message.
  * @param message   Message content to be sent to the client.
  *
  * @see protocol.h for the message protocol
+ * @see send_or_queue() in output_queue.c
+ * @see broadcast_message_in_room() which formats a message once for many clients
+ */
+void send_message_to_client(Client *client, const char cmd_type, const char *message) {
+    char message_buffer[MAX_MESSAGE_LEN_FROM_SERVER];
+    int length = snprintf(message_buffer, sizeof(message_buffer), "%c %s%s", cmd_type, message, MSG_TERMINATOR);
+    if (length < 0 || (size_t)length >= sizeof(message_buffer)) {
+        LOG_SERVER_ERROR("Message to client fd %d does not fit in a frame, dropping it\n", client->client_fd);
+        return;
+    }
+
+    send_or_queue(client, message_buffer, length, cmd_type);
+}
+
+/**
+ * @brief Sends a message to a socket that has not been set up as a client,
+ * e.g. a connection being rejected.
+ *
+ * The message is written with a single non-blocking send. If the socket
+ * cannot take all of it, the rest is dropped since the connection is about to
+ * be closed anyway.
+ *
+ * @param client_fd File descriptor of the socket to send the message to.
+ * @param cmd_type  Command character to prefix the message.
+ * @param message   Message content to be sent.
  */
-void send_message_to_client(const int client_fd, const char cmd_type, const char *message) {
+void send_message_to_fd(const int client_fd, const char cmd_type, const char *message) {
     char message_buffer[MAX_MESSAGE_LEN_FROM_SERVER] = {};
     sprintf(message_buffer, "%c %s%s", cmd_type, message, MSG_TERMINATOR);
 
-    const ssize_t length = strlen(message_buffer);
-    ssize_t sent = 0;
-    while (sent < length) {
-        ssize_t bytes = send(client_fd, message_buffer + sent, length - sent, MSG_NOSIGNAL);
-
-        if (bytes == -1) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                LOG_CLIENT_DISCONNECT("Failed to send message to client fd %d: %s. Message: %s\n", client_fd,
-                                      strerror(errno), message);
-                break;
-            }
-            LOG_INFO("Send would block or socket is full for client fd %d, retrying\n", client_fd);
-        } else if (bytes > 0) {
-            sent += bytes;
-            LOG_INFO("Sent %zd/%zd bytes to client fd %d\n", sent, length, client_fd);
-        }
+    if (send(client_fd, message_buffer, strlen(message_buffer), MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+        LOG_CLIENT_DISCONNECT("Failed to send message to fd %d: %s. Message: %s\n", client_fd, strerror(errno),
+                              message);
     }
 }
 
 /**
  * @brief Validates client message format against protocol requirements
  *
- * @param client Pointer to the Client structure with the message to validate.
+ * The message is known to be no longer than MAX_MESSAGE_LEN_TO_SERVER, the
+ * frame decoder enforces that before the message is routed.
+ *
+ * @param client Pointer to the Client structure that sent the message.
+ * @param message The message, without its terminator and '\0' terminated
+ * @param length Length of the message
  * @returns true if the message format is valid, false otherwis.e
  */
-static bool validate_msg_format(Client *client) {
+static bool validate_msg_format(Client *client, const char *message, size_t length) {
     // Check if message length is less than the minimum
-    if (strlen(client->current_msg) < 3) {
+    if (length < 3) {
         LOG_USER_ERROR("Invalid message format from client fd %d: Message too short\n", client->client_fd);
-        send_message_to_client(client->client_fd, ERR_PROTOCOL_INVALID_FORMAT,
+        send_message_to_client(client, ERR_PROTOCOL_INVALID_FORMAT,
                                "Message too short\nCorrect format:[command "
                                "char][space][message content][MSG_TERMINATOR]\n");
         return false;
     }
 
-    // Check if message length is longer  than the maximum
-    if (strlen(&client->current_msg[2]) > MAX_CONTENT_LEN) {
-        LOG_USER_ERROR("Invalid message format from client fd %d: Content too "
-                       "long, content length "
-                       "greater than MAX_CONTENT_LEN\n ",
-                       "%d\nand:%s\n", client->client_fd, strlen(&client->current_msg[2]), &client->current_msg[2]);
-        send_message_to_client(client->client_fd, ERR_PROTOCOL_INVALID_FORMAT,
-                               "Invalid Foramt: Message too long\nCorrect format:[command "
+    // Check if the message has a '\0' in it, the content is handled as a C string
+    if (memchr(message, '\0', length) != NULL) {
+        LOG_USER_ERROR("Invalid message format from client fd %d: Message contains a NUL byte\n", client->client_fd);
+        send_message_to_client(client, ERR_PROTOCOL_INVALID_FORMAT,
+                               "Message contains a NUL byte\nCorrect format:[command "
                                "char][space][message content][MSG_TERMINATOR]\n");
         return false;
     }
+
     // Check if space is missing
-    if (client->current_msg[1] != ' ') {
+    if (message[1] != ' ') {
         LOG_USER_ERROR("Invalid message format from client fd %d: Space missing "
                        "after the command\n",
-                       client->client_fd, client->current_msg[0]);
-        send_message_to_client(client->client_fd, ERR_PROTOCOL_INVALID_FORMAT,
+                       client->client_fd);
+        send_message_to_client(client, ERR_PROTOCOL_INVALID_FORMAT,
                                "Missing space after command.\nCorrect format: [command "
                                "char][space][message content][MSG_TERMINATOR]\n");
         return false;
     }
 
     // Check if command is not valid
-    if (client->current_msg[0] < CMD_EXIT || client->current_msg[0] > CMD_ROOM_MESSAGE_SEND) {
+    if (message[0] < CMD_EXIT || message[0] > CMD_ROOM_MESSAGE_SEND) {
         LOG_USER_ERROR("Invalid message format from client fd %d: Command not recognized\n", client->client_fd);
-        send_message_to_client(client->client_fd, ERR_PROTOCOL_INVALID_FORMAT,
+        send_message_to_client(client, ERR_PROTOCOL_INVALID_FORMAT,
                                "Command not found\nCorrect format: [command "
                                "char][space][message content][MSG_TERMINATOR]\n");
         return false;
     }
 
     // Check if content is empty
-    char *content = &client->current_msg[2];
+    const char *content = &message[2];
     while (*content == ' ') {
         content++;
     }
     if (*content == '\0') {
         LOG_USER_ERROR("Invalid message format from client fd %d: Content is empty\n", client->client_fd);
-        send_message_to_client(client->client_fd, ERR_MSG_EMPTY_CONTENT,
+        send_message_to_client(client, ERR_MSG_EMPTY_CONTENT,
                                "Content is Empty\nCorrect format: [command "
                                "char][space][message content][MSG_TERMINATOR]\n");
         return false;
@@ -185,20 +418,18 @@ static bool validate_msg_format(Client *client) {
 /**
  * @brief Validates if client's command is permitted in their current state
  *
- * @param client  Pointer to the Client structure contain command in the
- *                message field
+ * @param client  Pointer to the Client structure that sent the command
+ * @param command The command of the client's message
  * @returns true if command is valid for client's current state, false otherwise
  */
-static bool command_valid_for_state(const Client *client) {
-    char command = client->current_msg[0];
-
+static bool command_valid_for_state(Client *client, char command) {
     if (command == CMD_EXIT) {
         return true;
     }
     if (client->state == AWAITING_USERNAME && command != CMD_USERNAME_SUBMIT) {
-        LOG_USER_ERROR("Invalid command:'0x%x' from client fd %d in AWAITING_USERNAME state\n", client->current_msg[0],
+        LOG_USER_ERROR("Invalid command:'0x%x' from client fd %d in AWAITING_USERNAME state\n", command,
                        client->client_fd);
-        send_message_to_client(client->client_fd, ERR_PROTOCOL_INVALID_STATE_CMD,
+        send_message_to_client(client, ERR_PROTOCOL_INVALID_STATE_CMD,
                                "CMD not correct for client in awaiting username state\n");
         return false;
     } else if (client->state == IN_CHAT_LOBBY &&
@@ -206,13 +437,13 @@ static bool command_valid_for_state(const Client *client) {
                 command != CMD_ROOM_LIST_REQUEST)) {
         LOG_USER_ERROR("Invalid lobby command '%c' from client %s (fd %d) in chat "
                        "lobby state\n",
-                       client->current_msg[0], client->name, client->client_fd);
-        send_message_to_client(client->client_fd, ERR_PROTOCOL_INVALID_STATE_CMD, "Invalid command for lobby state\n");
+                       command, client->cold->name, client->client_fd);
+        send_message_to_client(client, ERR_PROTOCOL_INVALID_STATE_CMD, "Invalid command for lobby state\n");
         return false;
     } else if (client->state == IN_CHAT_ROOM && (command != CMD_ROOM_MESSAGE_SEND && command != CMD_LEAVE_ROOM)) {
-        LOG_USER_ERROR("Invalid room command '%0x%x' from client %s\n", command, client->name);
+        LOG_USER_ERROR("Invalid room command '%c' from client %s (fd %d)\n", command, client->cold->name, client->client_fd);
 
-        send_message_to_client(client->client_fd, ERR_PROTOCOL_INVALID_STATE_CMD,
+        send_message_to_client(client, ERR_PROTOCOL_INVALID_STATE_CMD,
                                "Invalid command for in chat room state\n");
         return false;
     }
@@ -229,29 +460,33 @@ static bool command_valid_for_state(const Client *client) {
  * command with the message
  * @param thread_context    Pointer to the Worker thread context containing data
  * about the thread handling the client
+ * @param message           The message, without its terminator and '\0'
+ * terminated
+ * @param length            Length of the message
  */
-static void route_client_command(Client *client, Worker_Thread *thread_context) {
-    if (!validate_msg_format(client) || !command_valid_for_state(client)) {
+static void route_client_command(Client *client, Worker_Thread *thread_context, const char *message, size_t length) {
+    if (!validate_msg_format(client, message, length) || !command_valid_for_state(client, message[0])) {
         return;
     }
+    const char command = message[0];
+    const char *content = &message[2];
 
-    LOG_INFO("Routing command '0x%x' from client fd %d in (state: %d)\n", client->current_msg[0], client->client_fd,
-             client->state);
+    LOG_INFO("Routing command '0x%x' from client fd %d in (state: %d)\n", command, client->client_fd, client->state);
 
-    if (client->current_msg[0] == CMD_EXIT) {
+    if (command == CMD_EXIT) {
         LOG_INFO("Client fd %d requested exit\n", client->client_fd);
         handle_client_disconnection(client, thread_context);
         return;
     }
     switch (client->state) {
     case AWAITING_USERNAME:
-        handle_awaiting_username(client);
+        handle_awaiting_username(client, content, length - 2);
         break;
     case IN_CHAT_LOBBY:
-        handle_in_chat_lobby(client);
+        handle_in_chat_lobby(client, command, content);
         break;
     case IN_CHAT_ROOM:
-        handle_in_chat_room(client);
+        handle_in_chat_room(client, command, content);
         break;
     }
 }
@@ -263,25 +498,25 @@ static void route_client_command(Client *client, Worker_Thread *thread_context)
  * Validates the command corresponds to the current state, assigns the username,
  * and transitions the client to the lobby state.
  *
- * @param client Pointer to the Client structure submitting the username. The
- * username is in the content portion of the current msg of the client.
+ * @param client Pointer to the Client structure submitting the username.
+ * @param username The content of the client's message
+ * @param username_length Length of the username
  */
 
-static void handle_awaiting_username(Client *client) {
-    size_t username_length = strlen(&client->current_msg[2]);
+static void handle_awaiting_username(Client *client, const char *username, size_t username_length) {
     if (username_length > MAX_USERNAME_LEN) {
         LOG_USER_ERROR("Username too long from client fd %d: %zu characters\n", client->client_fd, username_length);
-        send_message_to_client(client->client_fd, ERR_USERNAME_LENGTH,
+        send_message_to_client(client, ERR_USERNAME_LENGTH,
                                "\033[32m"
                                "User name too long, must be less than 32\n");
         return;
     }
 
-    strcpy(client->name, &client->current_msg[2]);
-    LOG_INFO("Client fd %d username set to '%s'\n", client->client_fd, client->name);
+    memcpy(client->cold->name, username, username_length + 1);
+    LOG_INFO("Client fd %d username set to '%s'\n", client->client_fd, client->cold->name);
 
     client->state = IN_CHAT_LOBBY;
-    send_avail_rooms(client);
+    send_avail_rooms(client, NULL);
 }
 
 /**
@@ -292,21 +527,22 @@ static void handle_awaiting_username(Client *client) {
  * list the current available rooms
  *
  * @param client Pointer to the Client structure in the lobby state.
+ * @param command The command of the client's message
+ * @param content The content of the client's message
  */
 
-static void handle_in_chat_lobby(Client *client) {
-    LOG_INFO("Processing lobby command '0x%x' from client %s (fd %d)\n", client->current_msg[0], client->name,
-             client->client_fd);
+static void handle_in_chat_lobby(Client *client, char command, const char *content) {
+    LOG_INFO("Processing lobby command '0x%x' from client %s (fd %d)\n", command, client->cold->name, client->client_fd);
 
-    switch (client->current_msg[0]) {
+    switch (command) {
     case CMD_ROOM_CREATE_REQUEST:
-        create_chat_room(client);
+        create_chat_room(client, content);
         break;
     case CMD_ROOM_JOIN_REQUEST:
-        join_chat_room(client);
+        join_chat_room(client, content);
         break;
     case CMD_ROOM_LIST_REQUEST:
-        send_avail_rooms(client);
+        send_avail_rooms(client, content);
         break;
     }
 }
@@ -315,26 +551,27 @@ static void handle_in_chat_lobby(Client *client) {
  * @brief Cleans up the client's resources and removes them from the thread
  * context.
  *
- * Removes the client's fd from epoll, closes the socket, clears the client
- * structure, and decrements the client count in the thread context.
+ * Removes the client's fd from epoll, closes the socket, gives the client's
+ * slot back to the thread context, and decrements the client count in the
+ * thread context.
  *
  * @param client Pointer to the Client structure to clean up.
  * @param thread_context Pointer to the Worker_Thread handling the client.
  */
 
 static void cleanup_client(Client *client, Worker_Thread *thread_context) {
-    LOG_INFO("Cleaning up client %s (fd %d) resources\n", client->name, client->client_fd);
-    if (epoll_ctl(thread_context->epoll_fd, EPOLL_CTL_DEL, client->client_fd, NULL) == -1) {
-        LOG_SERVER_ERROR("Failed to remove client fd %d from epoll: %s\n", client->client_fd, strerror(errno));
-    }
+    LOG_INFO("Cleaning up client %s (fd %d) resources\n", client->cold->name, client->client_fd);
+    unwatch_client(thread_context, client);
     if (close(client->client_fd) == -1) {
         LOG_SERVER_ERROR("Failed to close client fd %d: %s\n", client->client_fd, strerror(errno));
     }
-    memset(client, 0, sizeof(Client));
-    pthread_mutex_lock(&thread_context->num_of_clients_lock);
-    thread_context->num_of_clients--;
-    LOG_INFO("Client cleaned up and decremented client count to %d\n", thread_context->num_of_clients);
-    pthread_mutex_unlock(&thread_context->num_of_clients_lock);
+    destroy_output_queue(client);
+    free(client->cold->held_input);
+    client->cold->held_input = NULL;
+    release_client_slot(thread_context, client);
+    const int num_of_clients =
+        atomic_fetch_sub_explicit(&thread_context->num_of_clients, 1, memory_order_relaxed) - 1;
+    LOG_INFO("Client cleaned up and decremented client count to %d\n", num_of_clients);
 }
 
 /**
@@ -349,12 +586,12 @@ static void cleanup_client(Client *client, Worker_Thread *thread_context) {
  * @param thread_context Pointer to the Worker_Thread handling the client.
  */
 void handle_client_disconnection(Client *client, Worker_Thread *thread_context) {
-    ClIENT_STATE state = client->state;
-    if (state == IN_CHAT_ROOM) {
-        int room_index = client->room_index;
-        leave_room(client, room_index);
+    const Client *previous_log_client = set_log_client(client);
+    if (client->state == IN_CHAT_ROOM || client->awaiting_room_reply) {
+        leave_room(client, false);
     }
     cleanup_client(client, thread_context);
+    set_log_client(previous_log_client);
 }
 
 /**
@@ -365,31 +602,20 @@ void handle_client_disconnection(Client *client, Worker_Thread *thread_context)
  * list the current available rooms
  *
  * @param client Pointer to the Client structure in the lobby state.
+ * @param command The command of the client's message
+ * @param content The content of the client's message
  */
 
-static void handle_in_chat_room(Client *client) {
+static void handle_in_chat_room(Client *client, char command, const char *content) {
     char msg[MAX_MESSAGE_LEN_FROM_SERVER];
-    char command = client->current_msg[0];
-
-    int room_index = client->room_index;
 
     if (command == CMD_ROOM_MESSAGE_SEND) {
-        sprintf(msg, "%s: %s", client->name, &client->current_msg[2]);
-        LOG_INFO("Client %s (fd %d) sending message in room %d: %s\n", client->name, client->client_fd, room_index,
-                 msg);
-
-        pthread_mutex_lock(&SERVER_ROOMS[room_index].room_lock);
-        broadcast_message_in_room(msg, room_index, client);
-        pthread_mutex_unlock(&SERVER_ROOMS[room_index].room_lock);
+        sprintf(msg, "%s: %s", client->cold->name, content);
+        LOG_INFO("Client %s (fd %d) sending message in room %d: %s\n", client->cold->name, client->client_fd,
+                 client->room_index, msg);
+        send_room_message(client, msg);
     } else { // Clients want the leave the room
-        LOG_INFO("Client %s (fd %d) leaving room %d\n", client->name, client->client_fd, room_index);
-
-        sprintf(msg, "%s has left the room", client->name);
-        leave_room(client, room_index);
-        pthread_mutex_lock(&SERVER_ROOMS[room_index].room_lock);
-        send_message_to_client(client->client_fd, CMD_ROOM_LEAVE_OK, "You have left the room\n");
-        pthread_mutex_unlock(&SERVER_ROOMS[room_index].room_lock);
-        client->state = IN_CHAT_LOBBY;
-        LOG_INFO("Client %s (fd %d) returned to lobby state\n", client->name, client->client_fd);
+        LOG_INFO("Client %s (fd %d) leaving room %d\n", client->cold->name, client->client_fd, client->room_index);
+        leave_room(client, true);
     }
 }
@@ -2,8 +2,12 @@
 #define CLIENT_STATE_MANAGER
 
 #include "server_config.h" // Custom header containing server configuration
-void read_and_process_client_message(Client *client, Worker_Thread *thread_context);
+bool read_and_process_client_message(Client *client, Worker_Thread *thread_context);
+void process_client_data(Client *client, Worker_Thread *thread_context, char *data, size_t length);
+void finish_room_request(Client *client, Worker_Thread *thread_context, char reply, int room_index);
+void replay_held_input(Worker_Thread *thread_context);
 void handle_client_disconnection(Client *client, Worker_Thread *thread_context);
-void send_message_to_client(int client_fd, char cmd_type, const char *message);
+void send_message_to_client(Client *client, char cmd_type, const char *message);
+void send_message_to_fd(int client_fd, char cmd_type, const char *message);
 
 #endif
\ No newline at end of file
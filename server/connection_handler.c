@@ -1,136 +1,189 @@
 // Local
 #include "connection_handler.h"
 
-#include "client_state_manager.h" // For read_and_process_client_message()
+#include "client_state_manager.h" // For send_message_to_client(), send_message_to_fd()
+#include "event_loop.h"           // For run_event_loop(), watch_client()
 #include "logger.h"        // Has the logging function for LOG_INFO, LOG_SERVER_ERROR, LOG_WARNING and print_ero_n_exit
+#include "metrics.h"       // For count_metric()
+#include "output_queue.h"  // For init_output_queue()
 #include "protocol.h"      // FOR Commands in the messaging protocol
 #include "server_config.h" // Custom header containing server configuration
+#include "server_limits.h" // For server_limits, allocate_lazily()
 
 // Library
-#include <errno.h>   // For errno, EAGAIN
-#include <stdbool.h> // For bool type
+#include <errno.h>       // For errno, EAGAIN
+#include <netinet/in.h>  // For IPPROTO_TCP
+#include <netinet/tcp.h> // TCP protocol specific options and constants like TCP_KEEPINTVL, TCP_NODELAY
+#include <stdatomic.h>   // For atomic_load_explicit, atomic_fetch_add_explicit
+#include <stdbool.h>     // For bool type
 #include <stdint.h>  // For uint64_t
 #include <stdio.h>   // For perror(), sprintf
 #include <stdlib.h>
 #include <string.h>     // For strlen, memset
-#include <sys/epoll.h>  // For epoll functions, epoll_event struct
-#include <sys/socket.h> // For send
+#include <sys/socket.h> // For setsockopt
 #include <unistd.h>     // For read, EAGAIN
 
-static void register_new_client(Worker_Thread *thread_context);
-static void process_epoll_events(struct epoll_event event_queue[], int event_count, Worker_Thread *thread_context);
+#define LOG_CATEGORY LOG_ACCEPT // The log level of this category enables the file's log lines
 
-static bool register_with_epoll(int epoll_fd, int target_fd);
+static void setup_new_client(Worker_Thread *thread_context, int client_fd);
+static Client *allocate_client_slot(Worker_Thread *thread_data, int client_fd);
 
-static Client *find_client_by_fd(Worker_Thread *thread_data, int fd);
+/**
+ * @brief Configures TCP keepalive settings for the specified socket, and turns
+ * Nagle's algorithm off.
+ *
+ * Output is already gathered into one write per client per loop iteration, so
+ * Nagle would only hold the next small write back until the client's delayed
+ * ACK, about 40ms later.
+ *
+ * @param socket - The file descriptor the socket to configure
+ *
+ * @returns - 0 on success, -1 on failure
+ * Ref:https://stackoverflow.com/questions/31426420/configuring-tcp-keepalive-after-accept
+ */
+int set_socket_keep_alive(int socket) {
+    int enable = 1;    // enable tcp keep alive
+    int idle_time = 5; // wait 5 seconds befor the first pkeep alive proble
+    int interval = 1;  // wait 1 second between each subsequent probe
+    int probes = 2;    // send 2 close before the conneciton is considered dead
+
+    LOG_INFO("Configuring keepalive for socket %d: idle %ds, interval %ds, %d probes\n", socket, idle_time, interval,
+             probes);
+
+    if (setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) == -1) {
+        LOG_SERVER_ERROR("Error in setsockopt(SO_KEEPALIVE): %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle_time, sizeof(idle_time)) == -1) {
+        LOG_SERVER_ERROR("Error in setsockopt(TCP_KEEPIDLE): %s\n", strerror(errno));
+        return -1;
+    }
 
-static int allocate_client_slot(Worker_Thread *thread_data, int client_fd);
+    if (setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1) {
+        LOG_SERVER_ERROR("Error in setsockopt(TCP_KEEPINTVL): %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) == -1) {
+        LOG_SERVER_ERROR("Error in setsockopt(TCP_KEEPCNT): %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) == -1) {
+        LOG_SERVER_ERROR("Error in setsockopt(TCP_NODELAY): %s\n", strerror(errno));
+        return -1;
+    }
+    LOG_INFO("Successfully configured keepalive for socket %d\n", socket);
+
+    return 0;
+}
 
 /**
- * @brief Registers the target_fd with epoll_fd
+ * @brief Allocates the worker thread's client slots and the tables sized by
+ * the server's limits, and marks every client slot as free
  *
- * @param epoll_fd The epoll file descriptor
- * @param target_fd The file descriptor to register with epoll
+ * The client slots and their Client_Cold are only reserved: a page of them is
+ * committed the first time one of its slots is handed out. Slots are handed
+ * out lowest first, so the worker's memory grows with its clients rather than
+ * with clients_per_thread.
  *
- * @return bool true if registration successful, false if it fails
+ * @param thread_data Worker thread context the tables are allocated for
  *
+ * @note Exits the process if an allocation fails
  */
-static bool register_with_epoll(int epoll_fd, int target_fd) {
-    struct epoll_event event_config;
-    event_config.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-    event_config.data.fd = target_fd;
+void init_worker_memory(Worker_Thread *thread_data) {
+    const int num_clients = server_limits.clients_per_thread;
+    const int num_workers = server_limits.worker_threads;
 
-    if (epoll_fd < 0 || target_fd < 0) {
-        LOG_SERVER_ERROR("Invalid file descriptor to register_with_epoll- "
-                         "epoll_fd: %d, target_fd: %d\n",
-                         epoll_fd, target_fd);
-        return false;
+    thread_data->clients = allocate_lazily(sizeof(Client) * num_clients);
+    thread_data->client_cold = allocate_lazily(sizeof(Client_Cold) * num_clients);
+    thread_data->free_slot_words = (num_clients + 63) / 64;
+    thread_data->free_client_slots = calloc(thread_data->free_slot_words, sizeof(uint64_t));
+    thread_data->pending_output = calloc(num_clients, sizeof(Client *));
+    thread_data->replay_clients = calloc(num_clients, sizeof(Mailbox_Recipient));
+    thread_data->broadcast_recipients = calloc(num_workers, sizeof(int));
+    thread_data->broadcast_messages = calloc(num_workers, sizeof(Mailbox_Message *));
+    thread_data->broadcast_workers = calloc(num_workers, sizeof(Worker_Thread *));
+    if (thread_data->clients == NULL || thread_data->client_cold == NULL || thread_data->free_client_slots == NULL ||
+        thread_data->pending_output == NULL || thread_data->replay_clients == NULL ||
+        thread_data->broadcast_recipients == NULL || thread_data->broadcast_messages == NULL ||
+        thread_data->broadcast_workers == NULL) {
+        print_erro_n_exit("Could not allocate the client slots of a worker thread in init_worker_memory");
     }
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, target_fd, &event_config) == -1) {
-        LOG_SERVER_ERROR("Failed to register fd with epoll. target_fd: %d, epoll_fd: %d, "
-                         "Events: 0x%x, Error: %s\n",
-                         target_fd, epoll_fd, event_config.events, strerror(errno));
-        return false;
+    for (int i = 0; i < num_clients; i++) {
+        thread_data->free_client_slots[i / 64] |= 1ULL << (i % 64);
     }
-    return true;
+    thread_data->first_free_slot_word = 0;
 }
 
 /**
  * @brief Initializes a client structure in a free spot in thread_data with the
  * client_fd
  *
+ * Free slots are tracked in a bitmap, the lowest free slot is found with a
+ * find-first-set on the first word that has a bit set. Handing out the lowest
+ * slot keeps the clients packed at the start of the array.
+ *
  * @param thread_context Worker thread context containing data about the thread
  *                       including the client array
  * @param client_fd File descriptor associated with the new client
- * @returns 0 on success, -1 on failure
+ * @returns Pointer to the initialized client on success, NULL on failure
  */
-static int allocate_client_slot(Worker_Thread *thread_data, int client_fd) {
-    for (int i = 0; i < MAX_CLIENTS_PER_THREAD; i++) {
-        if (thread_data->clients[i].in_use == false) {
-            memset(&thread_data->clients[i], 0, sizeof(Client));
-            thread_data->clients[i].in_use = true;
-            thread_data->clients[i].state = AWAITING_USERNAME;
-            thread_data->clients[i].client_fd = client_fd;
-            return 0;
-        }
+static Client *allocate_client_slot(Worker_Thread *thread_data, int client_fd) {
+    int word = thread_data->first_free_slot_word;
+    while (word < thread_data->free_slot_words && thread_data->free_client_slots[word] == 0) {
+        word++;
+    }
+    thread_data->first_free_slot_word = word;
+
+    if (word < thread_data->free_slot_words) {
+        int bit = __builtin_ctzll(thread_data->free_client_slots[word]);
+        thread_data->free_client_slots[word] &= ~(1ULL << bit);
+
+        const int slot = word * 64 + bit;
+        Client *client = &thread_data->clients[slot];
+        memset(client, 0, offsetof(Client, room_member_index));
+        client->cold = &thread_data->client_cold[slot];
+        client->decoder.partial = client->cold->partial;
+        client->in_use = true;
+        client->state = AWAITING_USERNAME;
+        client->client_fd = client_fd;
+        client->worker = thread_data;
+        client->generation = ++thread_data->next_client_generation;
+        init_output_queue(client);
+        return client;
     }
     // num_of_clients was incremented by the main thread assuming the client was successfully, so it needs to be
     // decrmeneted to maintain correct clietn count
-    pthread_mutex_lock(&thread_data->num_of_clients_lock);
-    thread_data->num_of_clients--;
-    pthread_mutex_unlock(&thread_data->num_of_clients_lock);
+    atomic_fetch_sub_explicit(&thread_data->num_of_clients, 1, memory_order_relaxed);
 
     LOG_SERVER_ERROR("Failed to setup new user -Race condition: received client fd %d when "
                      "already at capacity\n",
-                     thread_data->id, client_fd);
+                     client_fd);
 
     if (close(client_fd) == -1) {
-        LOG_SERVER_ERROR("Failed to close client fd %d: %s for \n", thread_data->id, client_fd, strerror(errno));
+        LOG_SERVER_ERROR("Failed to close client fd %d: %s\n", client_fd, strerror(errno));
     };
-    return -1;
+    return NULL;
 }
 
 /**
- * @brief Processes epoll events for both new and existing client connections
- *
- * Iterates through the epoll event queue, handling two different types of
- * events:
- * 1. New client notifications from the main thread via the notification_fd.
- * 2. Messages from existing clients.
- *
- * @param event_queue Array of epoll events to process
- * @param event_count Number of events in the queue
- * @param thread_context Worker thread context containing data about the thread
- *
- * @see read_and_process_client_message() Processes messages from existing
- * clients in client_state_manager.c
+ * @brief Gives the client's slot back to the worker thread's free slots
  *
+ * @param thread_data Worker thread context the client belongs to
+ * @param client The client whose slot is freed, it is zeroed out but for its
+ *               room_member_index and cold, and its Client_Cold but for the
+ *               partial message buffer
  */
-static void process_epoll_events(struct epoll_event event_queue[], int event_count, Worker_Thread *thread_context) {
-    for (int i = 0; i < event_count; i++) {
-        // Received new client notification from the main thread
-        if (event_queue[i].data.fd == thread_context->notification_fd) {
-            LOG_INFO("Received new client notification\n");
-            register_new_client(thread_context);
-            continue;
-        }
-
-        // Handle existing client
-        Client *user = find_client_by_fd(thread_context, event_queue[i].data.fd);
-
-        if (user == NULL) {
-            LOG_SERVER_ERROR("Could not find client struct for fd %d\n", event_queue[i].data.fd);
-            continue;
-        }
-        // Check if connection closed
-        if (event_queue[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
-            LOG_INFO("Client disconnection detected for fd %d\n", event_queue[i].data.fd);
-            handle_client_disconnection(user, thread_context);
-            continue;
-        }
-        LOG_INFO("Processing message from client fd %d\n", event_queue[i].data.fd);
-        read_and_process_client_message(user, thread_context);
+void release_client_slot(Worker_Thread *thread_data, Client *client) {
+    int slot = (int)(client - thread_data->clients);
+    memset(client->cold, 0, offsetof(Client_Cold, partial));
+    memset(client, 0, offsetof(Client, room_member_index));
+    thread_data->free_client_slots[slot / 64] |= 1ULL << (slot % 64);
+    if (slot / 64 < thread_data->first_free_slot_word) {
+        thread_data->first_free_slot_word = slot / 64;
     }
 }
 
@@ -140,8 +193,11 @@ static void process_epoll_events(struct epoll_event event_queue[], int event_cou
  *
  * This function monitors and process events from clients connections. It
  * receives new clients via the the notification fd in the worker struct by the
- * main thread. Upon receiving the new client fd, it registers that in its epoll
- * instance and manages the client.
+ * main thread. Upon receiving the new client fd, it registers that with its
+ * event loop and manages the client.
+ *
+ * The event loop is the epoll loop in epoll_loop.c, or the io_uring loop in
+ * uring_loop.c when built with make BACKEND=uring.
  *
  * @param worker Pointer to Worker_Thread structure (cast from void*) containing
  * thread data, including epoll_fd and notification fd
@@ -151,96 +207,117 @@ static void process_epoll_events(struct epoll_event event_queue[], int event_cou
 void *process_client_connections(void *worker) {
     Worker_Thread *thread_context = (Worker_Thread *)worker;
 
-    // Size is to account for the notification fd
-    // used by the main thread to signal new client connections
-    struct epoll_event event_queue[MAX_CLIENTS_PER_THREAD + 1];
+    init_worker_memory(thread_context);
+    run_event_loop(thread_context);
+    return NULL;
+}
+
+/**
+ * @brief Sets up every client the main thread has handed over since the last
+ * notification
+ *
+ * The notification eventfd is reset before the new_clients queue is emptied,
+ * so a client queued after the last fd was taken rings the eventfd again
+ * instead of being missed.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ *
+ * @see setup_new_client()
+ */
+void register_new_clients(Worker_Thread *thread_context) {
+    New_Client_Queue *queue = &thread_context->new_clients;
+    uint64_t rings;
 
-    thread_context->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-    if (thread_context->epoll_fd == -1) {
-        print_erro_n_exit("Could not create epoll fd");
+    if (read(thread_context->notification_fd, &rings, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+        LOG_SERVER_ERROR("Failed to read from eventfd %d: %s\n", thread_context->notification_fd, strerror(errno));
     }
-    LOG_INFO("Created epoll fd %d\n", thread_context->epoll_fd);
 
-    if (!register_with_epoll(thread_context->epoll_fd, thread_context->notification_fd)) {
-        print_erro_n_exit("Could not register notification fd with epoll");
-    }
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    while (head != tail) {
+        int client_fd = queue->fds[head & queue->mask];
+        head++;
+        // Hands the queue position back to the main thread before the slower client setup
+        atomic_store_explicit(&queue->head, head, memory_order_release);
 
-    while (1) {
-        int event_count = epoll_wait(thread_context->epoll_fd, event_queue, MAX_CLIENTS_PER_THREAD + 1, -1);
-        if (event_count == -1 || event_count == 0) {
-            LOG_SERVER_ERROR("epoll_wait failed: %s\n", strerror(errno));
-            continue;
-        }
-        process_epoll_events(event_queue, event_count, thread_context);
+        LOG_INFO("Received new client fd %d from the main thread\n", client_fd);
+        setup_new_client(thread_context, client_fd);
     }
 }
 
 /**
- * @brief Processes and set up a new client received from the main
- * thread
+ * @brief Sets up a connection the worker accepted on its own SO_REUSEPORT
+ * listening socket
  *
- * Reads the new client file descriptor from the notification eventfd,
- * registers it with epoll, initializes the client data structure,
- * and sends a welcome message back to the client. The welcome message prompts
- * the user to enter their username.
+ * Each connection is counted against the worker's num_of_clients the same way
+ * the main thread does when it distributes clients. If the worker is at
+ * clients_per_thread the connection is rejected with ERR_SERVER_FULL.
  *
  * @param thread_context Worker thread context containing data about the thread
- *
+ * @param client_fd The accepted, non-blocking socket
  */
-static void register_new_client(Worker_Thread *thread_context) {
-    char welcome_msg[MAX_MESSAGE_LEN_FROM_SERVER] = "WELCOME TO THE SERVER: "
-                                                    "THIS IS A FAMILY FRIENDLY SPACE"
-                                                    ", NO CURSING\n"
-                                                    "Please enter Your User Name";
+void add_accepted_client(Worker_Thread *thread_context, int client_fd) {
+    const char *capacity_err_msg = "Sorry, the server is currently at full "
+                                   "capacity. Please try again later!\r\n";
 
-    uint64_t value;
+    LOG_INFO("New client connection accepted by worker %d: fd=%d\n", thread_context->index, client_fd);
+    count_metric(&thread_context->metrics.accepted_clients, 1);
 
-    if (read(thread_context->notification_fd, &value, sizeof(uint64_t)) == -1) {
-        pthread_mutex_lock(&thread_context->num_of_clients_lock);
-        thread_context->num_of_clients--;
-        pthread_mutex_unlock(&thread_context->num_of_clients_lock);
-        sem_post(&thread_context->new_client);
-        LOG_SERVER_ERROR("Failed to read from eventfd %d: %s\n", thread_context->notification_fd, strerror(errno));
+    if (set_socket_keep_alive(client_fd) == -1) {
+        close(client_fd);
         return;
     }
-    // Let the main thread no that the new client has been picked up so it does not wait
-    sem_post(&thread_context->new_client);
 
-    LOG_INFO("Received new client fd %llu from eventfd %d\n", value, thread_context->notification_fd);
+    // The worker is the only thread raising its count in this mode
+    bool at_capacity =
+        atomic_load_explicit(&thread_context->num_of_clients, memory_order_relaxed) >= server_limits.clients_per_thread;
+    if (!at_capacity) {
+        atomic_fetch_add_explicit(&thread_context->num_of_clients, 1, memory_order_relaxed);
+    }
 
-    int client_fd = (int)value;
-    if (register_with_epoll(thread_context->epoll_fd, client_fd) == false) {
-        pthread_mutex_lock(&thread_context->num_of_clients_lock);
-        thread_context->num_of_clients--;
-        pthread_mutex_unlock(&thread_context->num_of_clients_lock);
-        LOG_SERVER_ERROR("Failed to register client fd %d with epoll, closing connection\n", client_fd);
+    if (at_capacity) {
+        count_metric(&thread_context->metrics.rejected_clients, 1);
+        send_message_to_fd(client_fd, ERR_SERVER_FULL, capacity_err_msg);
         if (close(client_fd) == -1) {
             LOG_SERVER_ERROR("Failed to close client fd %d: %s\n", client_fd, strerror(errno));
         }
         return;
     }
-
-    if (allocate_client_slot(thread_context, client_fd) != -1) {
-        LOG_INFO("Successfully setup up new client (fd=%d), sending welcome message\n", client_fd);
-        send_message_to_client(client_fd, CMD_WELCOME_REQUEST, welcome_msg);
-    }
+    setup_new_client(thread_context, client_fd);
 }
 
 /**
- * @brief Finds the client structure in the thread_data associated with the fd
- * in the parameter
- *
- * @param thread_context Worker thread context containing data about the thread
- * @param fd File descriptor to search for
+ * @brief Sets up a client that has already been counted in the worker's
+ * num_of_clients
  *
- * @return Client* Pointer to found client structure, or NULL if not found
+ * Initializes the client data structure, registers it with the worker's event
+ * loop, and sends a welcome message back to the client. The welcome message
+ * prompts the user to enter their username.
  *
+ * @param thread_context Worker thread context containing data about the thread
+ * @param client_fd The new client's socket
  */
-static Client *find_client_by_fd(Worker_Thread *thread_data, int fd) {
-    for (int i = 0; i < MAX_CLIENTS_PER_THREAD; i++) {
-        if (thread_data->clients[i].client_fd == fd) {
-            return &thread_data->clients[i];
+static void setup_new_client(Worker_Thread *thread_context, int client_fd) {
+    char welcome_msg[MAX_MESSAGE_LEN_FROM_SERVER] = "WELCOME TO THE SERVER: "
+                                                    "THIS IS A FAMILY FRIENDLY SPACE"
+                                                    ", NO CURSING\n"
+                                                    "Please enter Your User Name";
+
+    Client *client = allocate_client_slot(thread_context, client_fd);
+    if (client == NULL) {
+        return;
+    }
+
+    if (watch_client(thread_context, client) == false) {
+        release_client_slot(thread_context, client);
+        atomic_fetch_sub_explicit(&thread_context->num_of_clients, 1, memory_order_relaxed);
+        LOG_SERVER_ERROR("Failed to register client fd %d with the event loop, closing connection\n", client_fd);
+        if (close(client_fd) == -1) {
+            LOG_SERVER_ERROR("Failed to close client fd %d: %s\n", client_fd, strerror(errno));
         }
+        return;
     }
-    return NULL;
+
+    LOG_INFO("Successfully setup up new client (fd=%d), sending welcome message\n", client_fd);
+    send_message_to_client(client, CMD_WELCOME_REQUEST, welcome_msg);
 }
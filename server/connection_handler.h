@@ -1,6 +1,13 @@
 #ifndef CLIENT_HANDLER_H
 #define CLIENT_HANDLER_H
 
+#include "server_config.h"
+
 void *process_client_connections(void *worker);
+void init_worker_memory(Worker_Thread *thread_data);
+int set_socket_keep_alive(int socket);
+void release_client_slot(Worker_Thread *thread_data, Client *client);
+void register_new_clients(Worker_Thread *thread_context);
+void add_accepted_client(Worker_Thread *thread_context, int client_fd);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE // Enables GNU extensions required for sched_getaffinity() and the CPU_* macros
+
+// Local
+#include "cpu_affinity.h"
+
+// Library
+#include <sched.h>  // For sched_getaffinity, cpu_set_t, CPU_ISSET, CPU_COUNT
+#include <stdio.h>  // For fopen, fscanf, snprintf
+#include <string.h> // For memset
+
+#define MAX_NUMA_NODES 64 // Nodes looked for in NUMA_NODE_PATH
+
+// cpulist of a NUMA node, e.g. 0-15,32-47
+#define NUMA_NODE_PATH "/sys/devices/system/node/node%d/cpulist"
+
+static signed char cpu_nodes[CPU_SETSIZE]; // NUMA node of each CPU, read once by plan_worker_cpus()
+
+static void read_cpu_nodes(void);
+
+/**
+ * @brief Picks the CPU each worker thread is pinned to
+ *
+ * The CPUs the process may run on are taken in turns from each NUMA node, the
+ * lowest numbered first, so that the workers are spread over the nodes and
+ * each gets the caches and memory bandwidth of its own node. With more
+ * workers than CPUs, the CPUs are handed out again from the start.
+ *
+ * @param worker_cpus Set to the CPU of each worker thread
+ * @param num_workers Number of worker threads
+ *
+ * @return false if the CPUs the process may run on could not be read
+ */
+bool plan_worker_cpus(int worker_cpus[], int num_workers) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return false;
+    }
+    read_cpu_nodes();
+
+    int ordered_cpus[CPU_SETSIZE];
+    int num_cpus = 0;
+    cpu_set_t taken;
+    CPU_ZERO(&taken);
+    while (num_cpus < CPU_COUNT(&allowed)) {
+        // One round takes the lowest numbered CPU left of every node
+        bool node_taken[MAX_NUMA_NODES] = {false};
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &taken) && !node_taken[cpu_nodes[cpu]]) {
+                node_taken[cpu_nodes[cpu]] = true;
+                CPU_SET(cpu, &taken);
+                ordered_cpus[num_cpus++] = cpu;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        worker_cpus[i] = ordered_cpus[i % num_cpus];
+    }
+    return true;
+}
+
+/**
+ * @brief NUMA node of a CPU, as read by plan_worker_cpus()
+ *
+ * @param cpu A CPU number below CPU_SETSIZE
+ *
+ * @return The node, 0 on machines without NUMA
+ */
+int cpu_numa_node(int cpu) {
+    return cpu_nodes[cpu];
+}
+
+/**
+ * @brief Reads the NUMA node of every CPU from sysfs. CPUs of no node listed
+ * there, e.g. on kernels without NUMA support, are on node 0
+ */
+static void read_cpu_nodes(void) {
+    memset(cpu_nodes, 0, sizeof(cpu_nodes));
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        char path[sizeof(NUMA_NODE_PATH) + 16];
+        snprintf(path, sizeof(path), NUMA_NODE_PATH, node);
+        FILE *cpulist = fopen(path, "r");
+        if (cpulist == NULL) {
+            continue;
+        }
+        // A comma separated list of CPUs and CPU ranges
+        int first, last;
+        while (fscanf(cpulist, "%d", &first) == 1) {
+            if (fscanf(cpulist, "-%d", &last) != 1) {
+                last = first;
+            }
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                cpu_nodes[cpu] = node;
+            }
+            if (fgetc(cpulist) != ',') {
+                break;
+            }
+        }
+        fclose(cpulist);
+    }
+}
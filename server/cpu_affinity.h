@@ -0,0 +1,9 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include "server_config.h"
+
+bool plan_worker_cpus(int worker_cpus[], int num_workers);
+int cpu_numa_node(int cpu);
+
+#endif
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE // Enables GNU extensions required for the accept4() function
+
+// Local
+#include "event_loop.h"
+
+#include "client_state_manager.h" // For read_and_process_client_message(), replay_held_input() and disconnections
+#include "connection_handler.h"   // For register_new_clients(), add_accepted_client()
+#include "latency.h"       // For monotonic_time_ns()
+#include "logger.h"        // Has the logging function for LOG_INFO, LOG_SERVER_ERROR, LOG_WARNING and print_ero_n_exit
+#include "mailbox.h"       // For handle_mailbox_notification(), deliver_mailbox_messages()
+#include "metrics.h"       // For count_metric()
+#include "output_queue.h"  // For flush_output_queue(), mark_output_pending()
+#include "server_config.h" // Custom header containing server configuration
+#include "server_limits.h" // For server_limits
+
+// Library
+#include <errno.h>      // For errno, EAGAIN, EINTR
+#include <stdbool.h>    // For bool type
+#include <stdint.h>     // For uint32_t, uint64_t
+#include <stdlib.h>     // For malloc
+#include <string.h>     // For strerror
+#include <sys/epoll.h>  // For epoll functions, epoll_event struct
+#include <sys/socket.h> // For accept4, SOCK_NONBLOCK
+
+#define LOG_CATEGORY LOG_EVENTS // The log level of this category enables the file's log lines
+
+static void accept_new_clients(Worker_Thread *thread_context);
+static void process_epoll_events(struct epoll_event event_queue[], int event_count, Worker_Thread *thread_context);
+
+static bool register_with_epoll(int epoll_fd, int target_fd, uint32_t events, void *event_data);
+static bool set_client_write_interest(Client *client, bool enable);
+static void write_client(Client *client);
+static void flush_client_output(Client *client);
+static void flush_pending_output(Worker_Thread *thread_context);
+
+static void read_client(Worker_Thread *thread_context, Client *client);
+static void read_ready_clients(Worker_Thread *thread_context);
+static void add_to_ready_list(Worker_Thread *thread_context, Client *client);
+static void remove_from_ready_list(Worker_Thread *thread_context, Client *client);
+
+// Events every client fd is registered for, EPOLLOUT is added on top while the client has queued output
+#if EDGE_TRIGGERED_READS
+#define CLIENT_EPOLL_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP | EPOLLET)
+#else
+#define CLIENT_EPOLL_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)
+#endif
+
+// Events the worker's eventfds and listening socket are registered for, always level triggered
+#define WORKER_FD_EPOLL_EVENTS EPOLLIN
+
+// Most connections a worker accepts from its own listening socket per wakeup, so a reconnect storm
+// cannot starve the clients it already has. Epoll is level triggered, so the rest are accepted later
+#define ACCEPT_BATCH_SIZE 64
+
+/**
+ * @brief Runs the worker's epoll loop, never returns
+ *
+ * The worker's notification fd, mailbox fd and, in --reuseport mode, its
+ * listening socket are registered with a pointer to the Worker_Thread field
+ * holding the fd, client sockets with their Client.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ */
+void run_event_loop(Worker_Thread *thread_context) {
+    // Size is to account for the notification fd used by the main thread to
+    // signal new client connections, the mailbox fd and the listening socket
+    const int max_events = server_limits.clients_per_thread + 3;
+    struct epoll_event *event_queue = malloc(sizeof(struct epoll_event) * max_events);
+    if (event_queue == NULL) {
+        print_erro_n_exit("Could not allocate the epoll event queue");
+    }
+
+    thread_context->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (thread_context->epoll_fd == -1) {
+        print_erro_n_exit("Could not create epoll fd");
+    }
+    LOG_INFO("Created epoll fd %d\n", thread_context->epoll_fd);
+
+    if (!register_with_epoll(thread_context->epoll_fd, thread_context->notification_fd, WORKER_FD_EPOLL_EVENTS,
+                             &thread_context->notification_fd)) {
+        print_erro_n_exit("Could not register notification fd with epoll");
+    }
+    if (!register_with_epoll(thread_context->epoll_fd, thread_context->mailbox_fd, WORKER_FD_EPOLL_EVENTS,
+                             &thread_context->mailbox_fd)) {
+        print_erro_n_exit("Could not register mailbox fd with epoll");
+    }
+    if (thread_context->listen_fd != -1 &&
+        !register_with_epoll(thread_context->epoll_fd, thread_context->listen_fd, WORKER_FD_EPOLL_EVENTS,
+                             &thread_context->listen_fd)) {
+        print_erro_n_exit("Could not register listening socket with epoll");
+    }
+
+    while (1) {
+        // Clients on the ready list still have data to read, so only poll for new events
+        int timeout = thread_context->ready_clients != NULL ? 0 : -1;
+        int event_count = epoll_wait(thread_context->epoll_fd, event_queue, max_events, timeout);
+        if (event_count == -1) {
+            if (errno != EINTR) {
+                LOG_SERVER_ERROR("epoll_wait failed: %s\n", strerror(errno));
+            }
+            continue;
+        }
+        const uint64_t woke_at = monotonic_time_ns();
+        count_metric(&thread_context->metrics.wakeups, 1);
+        count_metric(&thread_context->metrics.events, event_count);
+        process_epoll_events(event_queue, event_count, thread_context);
+        count_metric(&thread_context->metrics.busy_ns, monotonic_time_ns() - woke_at);
+    }
+}
+
+/**
+ * @brief Registers a freshly set up client's socket with the worker's epoll
+ * instance
+ *
+ * @param thread_context Worker thread context owning the epoll instance
+ * @param client The new client
+ *
+ * @return bool true if the client is registered, false if epoll_ctl failed
+ */
+bool watch_client(Worker_Thread *thread_context, Client *client) {
+    return register_with_epoll(thread_context->epoll_fd, client->client_fd, CLIENT_EPOLL_EVENTS, client);
+}
+
+/**
+ * @brief Stops watching a client that is being cleaned up
+ *
+ * Writes what is still queued for the client if the socket takes it, removes
+ * the client's socket from the epoll instance and takes the client off the
+ * ready list, before its socket is closed and its slot released.
+ *
+ * @param thread_context Worker thread context owning the epoll instance
+ * @param client The client being cleaned up
+ */
+void unwatch_client(Worker_Thread *thread_context, Client *client) {
+    if (!client->out_queue.overflowed) {
+        flush_output_queue(client);
+    }
+    if (epoll_ctl(thread_context->epoll_fd, EPOLL_CTL_DEL, client->client_fd, NULL) == -1) {
+        LOG_SERVER_ERROR("Failed to remove client fd %d from epoll: %s\n", client->client_fd, strerror(errno));
+    }
+    remove_from_ready_list(thread_context, client);
+}
+
+/**
+ * @brief Called once output has been queued for the client
+ *
+ * With WRITE_COALESCING the client is put on the worker's pending_output list
+ * and its queue is written at the end of the loop iteration. Otherwise the
+ * frame was only queued because the socket is full, and EPOLLOUT is added to
+ * the client's registration so the queue is flushed once it is writable.
+ *
+ * @param client The client with queued output
+ */
+void watch_client_output(Client *client) {
+    Output_Queue *queue = &client->out_queue;
+    Worker_Thread *thread_context = client->worker;
+
+    // The socket is full, the queue is flushed on EPOLLOUT
+    if (queue->epollout_armed) {
+        return;
+    }
+    if (!WRITE_COALESCING) {
+        if (set_client_write_interest(client, true)) {
+            queue->epollout_armed = true;
+        }
+        return;
+    }
+
+    if (!queue->send_pending) {
+        if (thread_context->num_pending_output == server_limits.clients_per_thread) {
+            // Only happens when released slots are reused within the iteration, leaving stale entries behind
+            flush_pending_output(thread_context);
+        }
+        mark_output_pending(client);
+    }
+    // A burst of room messages can fill the queue before the loop iteration ends. Once it passes half of
+    // OUTPUT_QUEUE_MAX_BYTES it is written right away, instead of dropping frames the socket would have taken
+    size_t added = queue->tail->frame->length - queue->tail->sent;
+    if (queue->queued_bytes > OUTPUT_QUEUE_MAX_BYTES / 2 && queue->queued_bytes - added <= OUTPUT_QUEUE_MAX_BYTES / 2) {
+        flush_client_output(client);
+    } else if (output_deadline_passed(thread_context)) {
+        flush_pending_output(thread_context);
+    }
+}
+
+/**
+ * @brief Writes a client's queue, adding EPOLLOUT to its registration if the
+ * socket cannot take all of it
+ *
+ * @param client The client with queued output
+ */
+static void flush_client_output(Client *client) {
+    Output_Queue *queue = &client->out_queue;
+    flush_output_queue(client);
+    if (queue->head != NULL && !queue->epollout_armed && set_client_write_interest(client, true)) {
+        queue->epollout_armed = true;
+    }
+}
+
+/**
+ * @brief Writes the queue of every client that got output since the last
+ * call, with a single sendmsg per client for up to MAX_FRAMES_PER_WRITE frames
+ *
+ * Called at the end of every loop iteration, and in the middle of it once the
+ * oldest pending output has waited COALESCE_MAX_DELAY_US.
+ *
+ * @param thread_context Worker thread context owning the pending_output list
+ */
+static void flush_pending_output(Worker_Thread *thread_context) {
+    for (int i = 0; i < thread_context->num_pending_output; i++) {
+        Client *client = thread_context->pending_output[i];
+        Output_Queue *queue = &client->out_queue;
+        // The client may have been cleaned up, or its slot reused, since it was put on the list
+        if (!client->in_use || !queue->send_pending) {
+            continue;
+        }
+        queue->send_pending = false;
+        if (!queue->overflowed && queue->head != NULL && !queue->epollout_armed) {
+            flush_client_output(client);
+        }
+    }
+    thread_context->num_pending_output = 0;
+}
+
+/**
+ * @brief Flushes a client's output queue on EPOLLOUT
+ *
+ * Once the queue is drained EPOLLOUT is removed from the client's epoll
+ * registration so the worker is not woken up for a writable socket it has
+ * nothing to write to.
+ *
+ * @param client The client whose socket became writable
+ */
+static void write_client(Client *client) {
+    Output_Queue *queue = &client->out_queue;
+    flush_output_queue(client);
+    if (queue->head == NULL && queue->epollout_armed && set_client_write_interest(client, false)) {
+        queue->epollout_armed = false;
+    }
+}
+
+/**
+ * @brief Registers the target_fd with epoll_fd
+ *
+ * The event_data pointer is what epoll hands back with every event for the
+ * fd, so the worker can get to the client without searching for it. Client
+ * fds are registered with their Client, the worker's own eventfds are
+ * registered with a pointer to the Worker_Thread field holding the fd, which
+ * can never be mistaken for a client.
+ *
+ * @param epoll_fd The epoll file descriptor
+ * @param target_fd The file descriptor to register with epoll
+ * @param events The epoll events to register the fd for
+ * @param event_data Pointer returned in epoll_event.data.ptr for the fd
+ *
+ * @return bool true if registration successful, false if it fails
+ *
+ */
+static bool register_with_epoll(int epoll_fd, int target_fd, uint32_t events, void *event_data) {
+    struct epoll_event event_config;
+    event_config.events = events;
+    event_config.data.ptr = event_data;
+
+    if (epoll_fd < 0 || target_fd < 0) {
+        LOG_SERVER_ERROR("Invalid file descriptor to register_with_epoll- "
+                         "epoll_fd: %d, target_fd: %d\n",
+                         epoll_fd, target_fd);
+        return false;
+    }
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, target_fd, &event_config) == -1) {
+        LOG_SERVER_ERROR("Failed to register fd with epoll. target_fd: %d, epoll_fd: %d, "
+                         "Events: 0x%x, Error: %s\n",
+                         target_fd, epoll_fd, event_config.events, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Adds or removes EPOLLOUT from the client's epoll registration
+ *
+ * @param client The client whose registration is modified
+ * @param enable true to be notified when the client's socket becomes writable,
+ *               false to stop being notified
+ *
+ * @return bool true if the registration was updated, false if epoll_ctl failed
+ */
+static bool set_client_write_interest(Client *client, bool enable) {
+    struct epoll_event event_config;
+    event_config.events = enable ? CLIENT_EPOLL_EVENTS | EPOLLOUT : CLIENT_EPOLL_EVENTS;
+    event_config.data.ptr = client;
+
+    if (epoll_ctl(client->worker->epoll_fd, EPOLL_CTL_MOD, client->client_fd, &event_config) == -1) {
+        LOG_SERVER_ERROR("Failed to update epoll events for client fd %d: %s\n", client->client_fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Processes epoll events for both new and existing client connections
+ *
+ * Iterates through the epoll event queue, handling four different types of
+ * events:
+ * 1. New client notifications from the main thread via the notification_fd.
+ * 2. New connections on the worker's own listening socket in --reuseport mode.
+ * 3. Room messages posted by other worker threads via the mailbox_fd.
+ * 4. Messages from existing clients and their sockets becoming writable again
+ *    while they have queued output.
+ *
+ * Once all events are handled, clients on the ready list are read again,
+ * room messages the worker posted to its own mailbox while handling them are
+ * delivered, the input held by clients whose room reply arrived is processed,
+ * and everything queued for the clients during the iteration is written.
+ *
+ * @param event_queue Array of epoll events to process
+ * @param event_count Number of events in the queue
+ * @param thread_context Worker thread context containing data about the thread
+ *
+ * @see read_and_process_client_message() Processes messages from existing
+ * clients in client_state_manager.c
+ *
+ */
+static void process_epoll_events(struct epoll_event event_queue[], int event_count, Worker_Thread *thread_context) {
+    for (int i = 0; i < event_count; i++) {
+        // Received new client notification from the main thread
+        if (event_queue[i].data.ptr == &thread_context->notification_fd) {
+            LOG_INFO("Received new client notification\n");
+            register_new_clients(thread_context);
+            continue;
+        }
+        if (event_queue[i].data.ptr == &thread_context->listen_fd) {
+            accept_new_clients(thread_context);
+            continue;
+        }
+        if (event_queue[i].data.ptr == &thread_context->mailbox_fd) {
+            handle_mailbox_notification(thread_context);
+            continue;
+        }
+
+        // Handle existing client, registered with its Client as the event data
+        Client *user = event_queue[i].data.ptr;
+        // The client left while an earlier event of the batch was handled
+        if (!user->in_use) {
+            continue;
+        }
+
+        // Check if connection closed
+        if (event_queue[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+            LOG_INFO("Client disconnection detected for fd %d\n", user->client_fd);
+            handle_client_disconnection(user, thread_context);
+            continue;
+        }
+        if (event_queue[i].events & EPOLLOUT) {
+            write_client(user);
+        }
+        if (event_queue[i].events & EPOLLIN) {
+            LOG_INFO("Processing message from client fd %d\n", user->client_fd);
+            read_client(thread_context, user);
+        }
+        if (output_deadline_passed(thread_context)) {
+            flush_pending_output(thread_context);
+        }
+    }
+    read_ready_clients(thread_context);
+    deliver_mailbox_messages(thread_context);
+    replay_held_input(thread_context);
+    flush_pending_output(thread_context);
+}
+
+/**
+ * @brief Reads a client that epoll reported readable
+ *
+ * A client on the ready list is skipped, it is read once the events are
+ * handled so it does not get more than its read budget in one loop iteration.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ * @param client The readable client
+ */
+static void read_client(Worker_Thread *thread_context, Client *client) {
+    if (client->on_ready_list) {
+        return;
+    }
+    if (read_and_process_client_message(client, thread_context)) {
+        add_to_ready_list(thread_context, client);
+    }
+}
+
+/**
+ * @brief Reads every client that used up its read budget in the previous loop
+ * iteration
+ *
+ * With edge triggered epoll a client with unread data is not reported again
+ * until more data arrives, so the worker keeps these clients on its ready list
+ * and polls epoll without blocking while the list is not empty. The list is
+ * taken as a whole first, so a client that uses up its budget again waits for
+ * the next loop iteration.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ */
+static void read_ready_clients(Worker_Thread *thread_context) {
+    Client *client = thread_context->ready_clients;
+    thread_context->ready_clients = NULL;
+
+    while (client != NULL) {
+        Client *next = client->ready_next;
+        client->ready_prev = NULL;
+        client->ready_next = NULL;
+        client->on_ready_list = false;
+        if (read_and_process_client_message(client, thread_context)) {
+            add_to_ready_list(thread_context, client);
+        }
+        if (output_deadline_passed(thread_context)) {
+            flush_pending_output(thread_context);
+        }
+        client = next;
+    }
+}
+
+/**
+ * @brief Puts a client at the front of the worker's ready list
+ *
+ * @param thread_context Worker thread context owning the ready list
+ * @param client The client to read again without waiting for epoll
+ */
+static void add_to_ready_list(Worker_Thread *thread_context, Client *client) {
+    client->ready_prev = NULL;
+    client->ready_next = thread_context->ready_clients;
+    if (thread_context->ready_clients != NULL) {
+        thread_context->ready_clients->ready_prev = client;
+    }
+    thread_context->ready_clients = client;
+    client->on_ready_list = true;
+}
+
+/**
+ * @brief Takes a client off the worker's ready list if it is on it
+ *
+ * @param thread_context Worker thread context owning the ready list
+ * @param client The client to take off the list
+ */
+static void remove_from_ready_list(Worker_Thread *thread_context, Client *client) {
+    if (!client->on_ready_list) {
+        return;
+    }
+    if (client->ready_prev != NULL) {
+        client->ready_prev->ready_next = client->ready_next;
+    } else {
+        thread_context->ready_clients = client->ready_next;
+    }
+    if (client->ready_next != NULL) {
+        client->ready_next->ready_prev = client->ready_prev;
+    }
+    client->on_ready_list = false;
+}
+
+/**
+ * @brief Accepts pending connections on the worker's own SO_REUSEPORT
+ * listening socket
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ *
+ * @see add_accepted_client()
+ */
+static void accept_new_clients(Worker_Thread *thread_context) {
+    for (int i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+        int client_fd = accept4(thread_context->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_SERVER_ERROR("Accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+        add_accepted_client(thread_context, client_fd);
+    }
+}
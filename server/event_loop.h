@@ -0,0 +1,12 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "server_config.h"
+
+// Implemented by epoll_loop.c or uring_loop.c, whichever WORKER_BACKEND picks
+void run_event_loop(Worker_Thread *thread_context);
+bool watch_client(Worker_Thread *thread_context, Client *client);
+void unwatch_client(Worker_Thread *thread_context, Client *client);
+void watch_client_output(Client *client);
+
+#endif
@@ -0,0 +1,138 @@
+// Local
+#include "frame_decoder.h"
+
+// Library
+#include <stdbool.h> // For bool type
+#include <string.h>  // For memchr, memcpy
+
+// A message can have at most this many bytes before the '\n' of its MSG_TERMINATOR, the '\r' included
+#define MAX_BYTES_BEFORE_NEWLINE (MAX_MESSAGE_LEN_TO_SERVER - 1)
+
+/**
+ * @brief Finds the '\n' of the first MSG_TERMINATOR in the decoder's input
+ *
+ * A '\n' at the start of the input terminates the message if the previous
+ * read ended with its '\r'. A '\n' that is not preceded by a '\r' is part of
+ * the message.
+ *
+ * @param decoder       The decoder to search the input of
+ * @param newline_index Set to the index of the '\n' in the input
+ * @return true if the input has a terminator, false otherwise
+ */
+static bool find_terminator(const Frame_Decoder *decoder, size_t *newline_index) {
+    size_t from = 0;
+    while (from < decoder->input_length) {
+        const char *newline = memchr(decoder->input + from, '\n', decoder->input_length - from);
+        if (newline == NULL) {
+            return false;
+        }
+        size_t index = newline - decoder->input;
+        if (index > 0 ? decoder->input[index - 1] == '\r' : decoder->carried_cr) {
+            *newline_index = index;
+            return true;
+        }
+        from = index + 1;
+    }
+    return false;
+}
+
+/**
+ * @brief Drops bytes from the start of the decoder's input
+ *
+ * @param decoder The decoder to advance
+ * @param length  Number of bytes that have been decoded
+ */
+static void consume_input(Frame_Decoder *decoder, size_t length) {
+    decoder->input += length;
+    decoder->input_length -= length;
+}
+
+/**
+ * @brief Hands bytes just received from a client to the client's decoder
+ *
+ * The decoder does not copy the bytes. They must stay valid and must not be
+ * reused until decode_next_message() returns MESSAGE_INCOMPLETE.
+ *
+ * @param decoder The client's decoder
+ * @param data    The received bytes
+ * @param length  Number of bytes received
+ */
+void set_decoder_input(Frame_Decoder *decoder, char *data, size_t length) {
+    decoder->input = data;
+    decoder->input_length = length;
+}
+
+/**
+ * @brief Decodes the next message from the decoder's input
+ *
+ * A message that is whole in the input is returned in place: its '\r' is
+ * overwritten with a '\0', nothing is copied. Only the start of a message
+ * split over several reads is copied into the decoder's partial buffer, and
+ * the message is returned from there once its terminator arrives.
+ *
+ * A message longer than MAX_MESSAGE_LEN_TO_SERVER, terminator included, is
+ * reported once with MESSAGE_TOO_LONG as soon as it is known to be too long.
+ * Its bytes are skipped up to and including its terminator, so the decoder
+ * is back in sync for the next message.
+ *
+ * @param decoder The client's decoder
+ * @param message Set to the start of the message on MESSAGE_COMPLETE, the
+ *                message is '\0' terminated and valid until the next call
+ * @param length  Set to the length of the message on MESSAGE_COMPLETE,
+ *                without the terminator. The message can contain '\0' bytes
+ *                if the client sent them.
+ *
+ * @return MESSAGE_COMPLETE, MESSAGE_TOO_LONG, or MESSAGE_INCOMPLETE once all
+ * of the input is decoded
+ */
+DECODE_RESULT decode_next_message(Frame_Decoder *decoder, char **message, size_t *length) {
+    while (decoder->input_length > 0) {
+        size_t newline_index;
+        if (!find_terminator(decoder, &newline_index)) {
+            // The rest of the input is the start of a message terminated in a later read
+            size_t message_length = decoder->partial_length + decoder->input_length;
+            decoder->carried_cr = decoder->input[decoder->input_length - 1] == '\r';
+            if (decoder->discarding) {
+                consume_input(decoder, decoder->input_length);
+                return MESSAGE_INCOMPLETE;
+            }
+            if (message_length > MAX_BYTES_BEFORE_NEWLINE) {
+                decoder->partial_length = 0;
+                decoder->discarding = true;
+                consume_input(decoder, decoder->input_length);
+                return MESSAGE_TOO_LONG;
+            }
+            memcpy(decoder->partial + decoder->partial_length, decoder->input, decoder->input_length);
+            decoder->partial_length = message_length;
+            consume_input(decoder, decoder->input_length);
+            return MESSAGE_INCOMPLETE;
+        }
+
+        char *data = decoder->input;
+        size_t message_length = decoder->partial_length + newline_index;
+        consume_input(decoder, newline_index + 1);
+        decoder->carried_cr = false;
+
+        if (decoder->discarding) {
+            decoder->discarding = false;
+            continue;
+        }
+        if (message_length > MAX_BYTES_BEFORE_NEWLINE) {
+            decoder->partial_length = 0;
+            return MESSAGE_TOO_LONG;
+        }
+        if (decoder->partial_length == 0) {
+            data[newline_index - 1] = '\0';
+            *message = data;
+            *length = newline_index - 1;
+            return MESSAGE_COMPLETE;
+        }
+        memcpy(decoder->partial + decoder->partial_length, data, newline_index);
+        decoder->partial[message_length - 1] = '\0';
+        decoder->partial_length = 0;
+        *message = decoder->partial;
+        *length = message_length - 1;
+        return MESSAGE_COMPLETE;
+    }
+    return MESSAGE_INCOMPLETE;
+}
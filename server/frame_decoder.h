@@ -0,0 +1,17 @@
+#ifndef FRAME_DECODER_H
+#define FRAME_DECODER_H
+
+#include "server_config.h"
+#include <stddef.h>
+
+// What decode_next_message() found in the decoder's input
+typedef enum DECODE_RESULT {
+    MESSAGE_COMPLETE,   // A whole message, without its MSG_TERMINATOR
+    MESSAGE_INCOMPLETE, // The input is used up, any unterminated message is kept for the next read
+    MESSAGE_TOO_LONG,   // A message longer than MAX_MESSAGE_LEN_TO_SERVER was skipped
+} DECODE_RESULT;
+
+void set_decoder_input(Frame_Decoder *decoder, char *data, size_t length);
+DECODE_RESULT decode_next_message(Frame_Decoder *decoder, char **message, size_t *length);
+
+#endif
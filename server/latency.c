@@ -0,0 +1,356 @@
+// Local
+#include "latency.h"
+
+#include "logger.h"        // For LOG_INFO
+#include "metrics.h"       // For count_metric()
+#include "room_registry.h" // For get_room(), room_id_limit()
+
+// Library
+#include <pthread.h> // For pthread_mutex_lock/unlock
+#include <string.h>  // For memmove
+#include <time.h>    // For clock_gettime
+
+#define LOG_CATEGORY LOG_EVENTS // The log level of this category enables the file's log lines
+
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+// A room whose latency is being recorded, and its histograms
+typedef struct Hot_Room {
+    Room *room; // NULL while the slot is free
+    Fanout_Latency latency;
+} Hot_Room;
+
+// Only the admin thread hands the slots out, the worker threads record into them through Room.hot_latency
+static Hot_Room hot_rooms[HOT_ROOMS];
+
+static void record_latency(Latency_Histogram *histogram, uint64_t latency_ns);
+static int latency_bucket(uint64_t latency_ns);
+static unsigned long bucket_highest_value(int bucket);
+static bool is_hottest(const Room *room, Room *const hottest[]);
+static void give_hot_room_slot(Room *room);
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @return The time in nanoseconds
+ */
+uint64_t monotonic_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Starts timing the fan-out of a client's room message
+ *
+ * @param frame    The CMD_ROOM_MSG frame of the message, not posted to any
+ *                 worker thread yet
+ * @param receiver The worker thread that received the message, its
+ *                 received_at is when
+ */
+void time_fanout(Frame *frame, Worker_Thread *receiver) {
+    frame->received_at = receiver->received_at;
+    frame->worker_latency = &receiver->fanout_latency;
+}
+
+/**
+ * @brief Sets how many recipients a timed frame is about to be posted to, so
+ * the worker thread delivering it to the last of them records the latency
+ *
+ * Also counts the broadcast for the room, which is how the admin thread finds
+ * the hot rooms, and records into the room's histograms too if it is one.
+ *
+ * @param frame      The frame being broadcast, ignored if it is not timed
+ * @param room       The room it is broadcast in
+ * @param recipients Number of recipients it is posted to
+ *
+ * @note The caller must hold the room's lock, or with ROOM_ACTORS run on the
+ * room's owner, and call this before posting the frame to any worker thread
+ */
+void expect_deliveries(Frame *frame, Room *room, int recipients) {
+    if (frame->received_at == 0) {
+        return;
+    }
+    count_metric(&room->timed_broadcasts, 1);
+    frame->room_latency = atomic_load_explicit(&room->hot_latency, memory_order_acquire);
+    atomic_store_explicit(&frame->deliveries_left, recipients, memory_order_relaxed);
+}
+
+/**
+ * @brief Records the latency of a timed frame that was just delivered to one of
+ * its recipients, if it is the first one
+ *
+ * The frame counts as delivered once its last byte is written to the
+ * recipient's socket, not when it is queued: with write coalescing that is at
+ * the end of the worker's loop iteration, with io_uring when the send
+ * completes, and for a slow reader once the backlog ahead of it is written.
+ *
+ * @param frame The frame
+ */
+void record_first_delivery(Frame *frame) {
+    if (frame->received_at == 0 || atomic_load_explicit(&frame->delivered, memory_order_relaxed) ||
+        atomic_exchange_explicit(&frame->delivered, true, memory_order_relaxed)) {
+        return;
+    }
+    const uint64_t latency_ns = monotonic_time_ns() - frame->received_at;
+    record_latency(&frame->worker_latency->first_delivery, latency_ns);
+    if (frame->room_latency != NULL) {
+        record_latency(&frame->room_latency->first_delivery, latency_ns);
+    }
+}
+
+/**
+ * @brief Counts recipients of a timed frame as done, and records its latency if
+ * they were the last ones
+ *
+ * A recipient is done once the frame is written to its socket, see
+ * record_first_delivery(). Recipients skipped because they left the room or
+ * disconnected, and those the frame was dropped for, count as well.
+ *
+ * @param frame      The frame
+ * @param recipients Number of recipients just done with the frame, at least 1
+ */
+void record_deliveries(Frame *frame, int recipients) {
+    if (frame->received_at == 0 ||
+        atomic_fetch_sub_explicit(&frame->deliveries_left, recipients, memory_order_relaxed) != recipients) {
+        return;
+    }
+    const uint64_t latency_ns = monotonic_time_ns() - frame->received_at;
+    record_latency(&frame->worker_latency->last_delivery, latency_ns);
+    if (frame->room_latency != NULL) {
+        record_latency(&frame->room_latency->last_delivery, latency_ns);
+    }
+}
+
+/**
+ * @brief Picks the HOT_ROOMS rooms that broadcast the most client messages
+ * since the previous call, and records their latency from now on
+ *
+ * A room that stays hot keeps its histograms, one that cools down or is
+ * released loses them, and the freed slots are cleared and given to the rooms
+ * that became hot. A frame broadcast before its room lost its slot can still
+ * record into the slot once it went to another room.
+ *
+ * @note Only called by the admin thread, every HOT_ROOMS_INTERVAL_MS
+ */
+void rank_hot_rooms(void) {
+    Room *hottest[HOT_ROOMS] = {};
+    unsigned long hottest_broadcasts[HOT_ROOMS] = {};
+    const int room_id_end = room_id_limit();
+
+    for (int i = 0; i < room_id_end; i++) {
+        Room *room = get_room(i);
+        if (room == NULL) { // Chunk still being allocated, none of its rooms broadcast anything yet
+            i += ROOM_CHUNK_SIZE - 1 - i % ROOM_CHUNK_SIZE;
+            continue;
+        }
+        const unsigned long broadcasts = atomic_load_explicit(&room->timed_broadcasts, memory_order_relaxed);
+        const unsigned long recent = broadcasts - room->ranked_broadcasts;
+        room->ranked_broadcasts = broadcasts;
+
+        int position = HOT_ROOMS;
+        while (position > 0 && recent > hottest_broadcasts[position - 1]) {
+            position--;
+        }
+        if (position < HOT_ROOMS) {
+            memmove(&hottest[position + 1], &hottest[position], sizeof(hottest[0]) * (HOT_ROOMS - 1 - position));
+            memmove(&hottest_broadcasts[position + 1], &hottest_broadcasts[position],
+                    sizeof(hottest_broadcasts[0]) * (HOT_ROOMS - 1 - position));
+            hottest[position] = room;
+            hottest_broadcasts[position] = recent;
+        }
+    }
+
+    for (int slot = 0; slot < HOT_ROOMS; slot++) {
+        Room *room = hot_rooms[slot].room;
+        if (room == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&room->room_lock);
+        // release_room() already took the slot away from a released room
+        const bool kept = atomic_load_explicit(&room->hot_latency, memory_order_relaxed) ==
+                              &hot_rooms[slot].latency &&
+                          is_hottest(room, hottest);
+        if (!kept) {
+            atomic_store_explicit(&room->hot_latency, NULL, memory_order_relaxed);
+            hot_rooms[slot].room = NULL;
+        }
+        pthread_mutex_unlock(&room->room_lock);
+    }
+
+    for (int i = 0; i < HOT_ROOMS && hottest[i] != NULL; i++) {
+        if (atomic_load_explicit(&hottest[i]->hot_latency, memory_order_relaxed) == NULL) {
+            give_hot_room_slot(hottest[i]);
+        }
+    }
+}
+
+/**
+ * @brief Returns the latency recorded for a hot room
+ *
+ * @param slot    Slot of the hot room, below HOT_ROOMS
+ * @param room_id Set to the id of the room
+ *
+ * @return The room's latency, or NULL if the slot is free
+ *
+ * @note Only called by the admin thread
+ */
+const Fanout_Latency *get_hot_room(int slot, int *room_id) {
+    if (hot_rooms[slot].room == NULL) {
+        return NULL;
+    }
+    *room_id = hot_rooms[slot].room->id;
+    return &hot_rooms[slot].latency;
+}
+
+/**
+ * @brief Reads the count, sum, maximum and the 50th, 99th and 99.9th
+ * percentiles of a histogram
+ *
+ * A percentile is the highest latency of the bucket it falls in, so it is at
+ * most 1/32 above the recorded one. The worker threads keep recording while
+ * the buckets are read, so the summary can be a few latencies behind.
+ *
+ * @param histogram The histogram
+ * @param summary   Filled with what was read
+ */
+void summarize_latency(const Latency_Histogram *histogram, Latency_Summary *summary) {
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        count += counts[i];
+    }
+    summary->count = count;
+    summary->sum_ns = atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed);
+    summary->max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    summary->p50_ns = summary->p99_ns = summary->p999_ns = 0;
+
+    // Rank of the latency each percentile is, counting from 1
+    const unsigned long p50_rank = (count * 500 + 999) / 1000;
+    const unsigned long p99_rank = (count * 990 + 999) / 1000;
+    const unsigned long p999_rank = (count * 999 + 999) / 1000;
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS && seen < p999_rank; i++) {
+        const unsigned long before = seen;
+        seen += counts[i];
+        const unsigned long highest = bucket_highest_value(i);
+        const unsigned long value = highest < summary->max_ns ? highest : summary->max_ns;
+        if (before < p50_rank && seen >= p50_rank) {
+            summary->p50_ns = value;
+        }
+        if (before < p99_rank && seen >= p99_rank) {
+            summary->p99_ns = value;
+        }
+        if (seen >= p999_rank) {
+            summary->p999_ns = value;
+        }
+    }
+}
+
+/**
+ * @brief Adds a latency to a histogram, from any thread
+ *
+ * @param histogram The histogram
+ * @param latency_ns The latency
+ */
+static void record_latency(Latency_Histogram *histogram, uint64_t latency_ns) {
+    atomic_fetch_add_explicit(&histogram->buckets[latency_bucket(latency_ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_ns, latency_ns, memory_order_relaxed);
+    unsigned long max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    while (latency_ns > max_ns && !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max_ns, latency_ns,
+                                                                          memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Finds the bucket of a latency
+ *
+ * Latencies below LATENCY_SUB_BUCKETS ns have a bucket each. Above, the
+ * position of the highest set bit picks the power of two, and the
+ * LATENCY_SUB_BUCKET_BITS bits below it the bucket within it.
+ *
+ * @param latency_ns The latency
+ *
+ * @return Index of the bucket, the last one for latencies past the range
+ */
+static int latency_bucket(uint64_t latency_ns) {
+    if (latency_ns < LATENCY_SUB_BUCKETS) {
+        return (int)latency_ns;
+    }
+    const int highest_bit = 63 - __builtin_clzll(latency_ns);
+    const int power = highest_bit - LATENCY_SUB_BUCKET_BITS + 1;
+    const int bucket = power * LATENCY_SUB_BUCKETS +
+                       (int)((latency_ns >> (highest_bit - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/**
+ * @brief Returns the highest latency counted in a bucket
+ *
+ * @param bucket Index of the bucket
+ *
+ * @return The latency in ns
+ */
+static unsigned long bucket_highest_value(int bucket) {
+    const int power = bucket / LATENCY_SUB_BUCKETS;
+    const unsigned long sub_bucket = bucket % LATENCY_SUB_BUCKETS;
+    if (power == 0) {
+        return sub_bucket;
+    }
+    return ((LATENCY_SUB_BUCKETS + sub_bucket + 1) << (power - 1)) - 1;
+}
+
+/**
+ * @brief Tells whether a room is among the hottest ones
+ *
+ * @param room    The room
+ * @param hottest The hottest rooms, NULL past the last one
+ *
+ * @return true if it is
+ */
+static bool is_hottest(const Room *room, Room *const hottest[]) {
+    for (int i = 0; i < HOT_ROOMS && hottest[i] != NULL; i++) {
+        if (hottest[i] == room) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Gives a free slot to a room that became hot, with its histograms
+ * cleared
+ *
+ * The room gets the slot under its lock, and only if it is still in use, so
+ * release_room() cannot miss taking it back.
+ *
+ * @param room The room
+ */
+static void give_hot_room_slot(Room *room) {
+    int slot = 0;
+    while (slot < HOT_ROOMS && hot_rooms[slot].room != NULL) {
+        slot++;
+    }
+    if (slot == HOT_ROOMS) {
+        return;
+    }
+
+    Fanout_Latency *latency = &hot_rooms[slot].latency;
+    Latency_Histogram *histograms[] = {&latency->first_delivery, &latency->last_delivery};
+    for (size_t h = 0; h < sizeof(histograms) / sizeof(histograms[0]); h++) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            atomic_store_explicit(&histograms[h]->buckets[i], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&histograms[h]->sum_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&histograms[h]->max_ns, 0, memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&room->room_lock);
+    if (room->in_use) {
+        atomic_store_explicit(&room->hot_latency, latency, memory_order_release);
+        hot_rooms[slot].room = room;
+        LOG_INFO("Room %d is hot, recording its fan-out latency\n", room->id);
+    }
+    pthread_mutex_unlock(&room->room_lock);
+}
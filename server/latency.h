@@ -0,0 +1,17 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "server_config.h"
+
+uint64_t monotonic_time_ns(void);
+
+void time_fanout(Frame *frame, Worker_Thread *receiver);
+void expect_deliveries(Frame *frame, Room *room, int recipients);
+void record_first_delivery(Frame *frame);
+void record_deliveries(Frame *frame, int recipients);
+
+void rank_hot_rooms(void);
+const Fanout_Latency *get_hot_room(int slot, int *room_id);
+void summarize_latency(const Latency_Histogram *histogram, Latency_Summary *summary);
+
+#endif
@@ -1,52 +1,183 @@
 #include "logger.h"
 
+#include "server_config.h" // For LOG_RING_RECORDS, LOG_RECORD_SIZE, LOG_FLUSH_INTERVAL_MS, LOG_CONTROL_FILE, Client
+
 // System/Library headers
-#include <errno.h>   // For errno
-#include <pthread.h> // For threading functions and data types
-#include <stdarg.h>  // For va_list, va_start, va_end
-#include <stdio.h>   // For printf, fprintf, perror, fflush, stdout, stderr
-#include <stdlib.h>  // For exit()
-#include <time.h>    // For time, local_time_r
+#include <errno.h>     // For errno
+#include <fcntl.h>     // For open, O_APPEND
+#include <limits.h>    // For INT_MAX
+#include <pthread.h>   // For threading functions and data types, pthread_sigmask
+#include <signal.h>    // For sigset_t, sigtimedwait, sigwaitinfo, SIGHUP
+#include <stdarg.h>    // For va_list, va_start, va_end
+#include <stdatomic.h> // For atomic_size_t, atomic_ulong
+#include <stdint.h>    // For uint64_t
+#include <stdio.h>     // For snprintf, vsnprintf, fprintf, perror, stderr, fopen, fgets
+#include <stdlib.h>    // For exit(), calloc, strtol
+#include <string.h>    // For memcpy, strlen, strcmp, strchr, strspn
+#include <time.h>      // For time, localtime_r, strftime, struct timespec
+#include <unistd.h>    // For write, STDOUT_FILENO
+
+#define LOG_PREFIX_LEN 96 // Bytes of the formatted timestamp or thread id put before each line
+#define LOG_TRUNCATED ANSI_RESET " [...]\n"
+#define LOG_CONTROL_LINE_LEN 256 // Longest line of the control file
+
+// A log line waiting in a thread's ring, with the second it was logged at
+typedef struct Log_Record {
+    time_t second;
+    size_t length;
+    char text[LOG_RECORD_SIZE];
+} Log_Record;
+
+// Single producer, single consumer ring of a thread's log lines. Only the thread logging advances tail and only
+// the writer thread advances head
+typedef struct Log_Ring {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // Next record the writer thread will write
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // Next free record for the thread
+    atomic_ulong dropped;                         // Lines the thread dropped because the ring was full
+    unsigned long dropped_reported;               // Part of dropped the writer thread already logged
+    unsigned long thread;                         // Id of the thread logging into the ring
+    char thread_id[LOG_PREFIX_LEN];               // The thread's id, formatted once
+    struct Log_Ring *next;
+    Log_Record records[LOG_RING_RECORDS];
+} Log_Ring;
+
+static _Thread_local Log_Ring *thread_ring; // The calling thread's ring, allocated on its first log line
+static _Atomic(Log_Ring *) rings;           // Every thread's ring, rings are never freed
+static atomic_ulong dropped_without_ring;   // Lines of threads whose ring could not be allocated
+static int log_fd = STDOUT_FILENO;
+
+// Held while draining the rings, by the writer thread or by print_erro_n_exit() before exiting
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+atomic_int log_gates[LOG_CATEGORIES];
+_Thread_local const struct Client *log_client;
+
+// Set from the control file, by the main thread at startup and by the writer thread on SIGHUP
+static atomic_int log_levels[LOG_CATEGORIES];
+static atomic_int trace_fd = -1;              // Socket of the client being traced, -1 for none
+static _Atomic uint64_t trace_name_hash;      // Hash of the username being traced, 0 for none
+static char trace_name[MAX_USERNAME_LEN + 1]; // The username itself, only used by the thread loading the file
+static sigset_t reload_signal;                // SIGHUP, blocked in every thread and waited for by the writer thread
+static bool logging_enabled;                  // A category logs something or a client is traced
+
+static const char *const category_names[LOG_CATEGORIES] = {"accept", "protocol", "room", "send", "events"};
+static const char *const level_names[] = {"off", "error", "warning", "info"};
 
-// The prgram is multithreaded so printing needs to be thread safe
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void write_log_record(const char *format_str, va_list args);
+static bool client_traced(const Client *client);
+static void load_log_control(bool report);
+static bool apply_control_line(const char *line, int levels[], int *fd, char name[]);
+static int find_name(const char *name, const char *const names[], int count);
+static uint64_t hash_username(const char *username);
+static Log_Ring *register_thread_ring(void);
+static void *run_log_writer(void *arg);
+static int drain_log_rings(void);
+static void write_batch(const char *batch, size_t length);
 
 /**
- * @brief Variadic wrapper around printf for thread-safe
+ * @brief Opens the log file, loads the log levels and starts the writer thread
+ * copying the threads' log lines to it
  *
- * @param format_str format string to be written to standard output. Can contain
+ * The log goes to standard output unless the server was built with
+ * make LOG_FILE=<path>, in which case it is appended to that file.
+ *
+ * Every category starts at LOG_LEVEL_INFO with make LOG=1 and LOG_LEVEL_OFF
+ * otherwise, then LOG_CONTROL_FILE is applied if it exists. SIGHUP is blocked
+ * here, so must be called before any other thread is started: the writer
+ * thread alone waits for it and loads the file again when it arrives.
+ *
+ * @note This function will exit the program if the log file cannot be opened
+ * or the writer thread cannot be started
+ */
+void init_logger(void) {
+#ifdef LOG_FILE
+    log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        print_erro_n_exit("Could not open the log file in init_logger");
+    }
+#endif
+    load_log_control(false);
+
+    sigemptyset(&reload_signal);
+    sigaddset(&reload_signal, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &reload_signal, NULL) != 0) {
+        print_erro_n_exit("Failed to block SIGHUP in init_logger");
+    }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, run_log_writer, NULL) != 0) {
+        print_erro_n_exit("Failed to start the log writer thread in init_logger");
+    }
+    pthread_detach(writer);
+}
+
+/**
+ * @brief Formats a log line into the calling thread's ring, whatever the log
+ * levels are. Never blocks.
+ *
+ * The line is written out later by the writer thread, which puts the time and
+ * the thread's id in front of it. If the ring is full the line is dropped and
+ * counted, the writer thread logs how many lines each thread dropped.
+ *
+ * @param format_str format string to be written to the log. Can contain
  *                  format specifiers which will be replaced by values from
  *                   additional arguments.
  * @param ... additional values to replace format specifiers in format_str
  */
 void log_message(const char *format_str, ...) {
     va_list args;
-    char time_stamp[200];
-    struct tm t;
     va_start(args, format_str);
-    time_t now = time(NULL);
+    write_log_record(format_str, args);
+    va_end(args);
+}
 
-    pthread_mutex_lock(&log_mutex);
-    if (localtime_r(&now, &t) != NULL) {
-        strftime(time_stamp, sizeof(time_stamp), "%Y:%m:%d:%T", &t);
-        printf("%s║%s %s%s%s%s %s║%s ", ANSI_MAGENTA, ANSI_RESET, ANSI_BOLD, ANSI_CYAN, time_stamp, ANSI_RESET,
-               ANSI_MAGENTA, ANSI_RESET);
-    } else {
-        printf("localtime_r error\n");
+/**
+ * @brief Logs a line of the LOG_* macros, which only call it once the
+ * category's gate lets the level through
+ *
+ * The gate is opened to LOG_LEVEL_INFO for every category while a client is
+ * traced, so the line is only logged if the category's own level lets it
+ * through or the thread is working for the traced client.
+ *
+ * @param category   What the line is about
+ * @param level      How important the line is
+ * @param format_str format string to be written to the log
+ * @param ... additional values to replace format specifiers in format_str
+ */
+void log_message_at(Log_Category category, Log_Level level, const char *format_str, ...) {
+    if ((int)level > atomic_load_explicit(&log_levels[category], memory_order_relaxed) &&
+        !client_traced(log_client)) {
+        return;
     }
-    printf("%s[TID- %lu]%s ", "\033[95;2m", pthread_self(), ANSI_RESET);
-
-    vprintf(format_str, args);
-    fflush(stdout);
-    pthread_mutex_unlock(&log_mutex);
+    va_list args;
+    va_start(args, format_str);
+    write_log_record(format_str, args);
     va_end(args);
 }
 
+/**
+ * @brief Total log lines dropped so far because a thread's ring was full
+ *
+ * @return Number of dropped log lines
+ */
+unsigned long dropped_log_records(void) {
+    unsigned long dropped = atomic_load_explicit(&dropped_without_ring, memory_order_relaxed);
+    for (Log_Ring *ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
 /**
  * @brief Prints an error message and exits the program
+ *
+ * Log lines still waiting in the rings are written first.
+ *
  * @param char *msg msg to be printed before exiting
  */
 void print_erro_n_exit(char *msg) {
+    const int saved_errno = errno;
+    drain_log_rings();
+    errno = saved_errno;
     if (errno != 0) {
         perror(msg);
     } else {
@@ -54,3 +185,342 @@ void print_erro_n_exit(char *msg) {
     }
     exit(EXIT_FAILURE);
 }
+
+/**
+ * @brief Formats a log line into the calling thread's ring, allocating the
+ * ring on the thread's first line
+ *
+ * @param format_str format string to be written to the log
+ * @param args       values to replace format specifiers in format_str
+ */
+static void write_log_record(const char *format_str, va_list args) {
+    Log_Ring *ring = thread_ring != NULL ? thread_ring : register_thread_ring();
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped_without_ring, 1, memory_order_relaxed);
+        return;
+    }
+
+    const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_RECORDS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    Log_Record *record = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+    int length = vsnprintf(record->text, sizeof(record->text), format_str, args);
+    if (length < 0) {
+        return;
+    }
+    if ((size_t)length >= sizeof(record->text)) {
+        length = sizeof(record->text) - sizeof(LOG_TRUNCATED);
+        memcpy(record->text + length, LOG_TRUNCATED, sizeof(LOG_TRUNCATED));
+        length += sizeof(LOG_TRUNCATED) - 1;
+    }
+    record->length = length;
+    record->second = time(NULL);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * @brief Tells whether the client is the one traced by socket or by username
+ *
+ * @param client The client the thread is working for, or NULL
+ *
+ * @return true if every line about the client is to be logged
+ */
+static bool client_traced(const Client *client) {
+    if (client == NULL) {
+        return false;
+    }
+    if (client->client_fd == atomic_load_explicit(&trace_fd, memory_order_relaxed)) {
+        return true;
+    }
+    const uint64_t name_hash = atomic_load_explicit(&trace_name_hash, memory_order_relaxed);
+    return name_hash != 0 && client->cold->name[0] != '\0' && hash_username(client->cold->name) == name_hash;
+}
+
+/**
+ * @brief Sets the log levels and the traced client from LOG_CONTROL_FILE
+ *
+ * Everything the file does not set goes back to its default: every category
+ * to LOG_DEFAULT_LEVEL and no client traced. Lines that cannot be parsed are
+ * logged and skipped. See README.md for the format of the file.
+ *
+ * @param report true to log the levels once loaded, and to log that the file
+ *               is missing
+ */
+static void load_log_control(bool report) {
+    int levels[LOG_CATEGORIES];
+    int fd = -1;
+    char name[MAX_USERNAME_LEN + 1] = "";
+    for (int i = 0; i < LOG_CATEGORIES; i++) {
+        levels[i] = LOG_DEFAULT_LEVEL;
+    }
+
+    FILE *file = fopen(LOG_CONTROL_FILE, "r");
+    if (file != NULL) {
+        char line[LOG_CONTROL_LINE_LEN];
+        int line_number = 0;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            line_number++;
+            if (!apply_control_line(line, levels, &fd, name)) {
+                log_message(ANSI_BOLD ANSI_RED "SERVER ERROR: Ignoring line %d of %s: %.*s" ANSI_RESET "\n",
+                            line_number, LOG_CONTROL_FILE, (int)strcspn(line, "\r\n"), line);
+            }
+        }
+        fclose(file);
+    } else if (report) {
+        log_message(ANSI_BOLD ANSI_RED "SERVER ERROR: Could not open %s: %s, using the default log levels" ANSI_RESET
+                    "\n",
+                    LOG_CONTROL_FILE, strerror(errno));
+    }
+
+    strcpy(trace_name, name);
+    atomic_store_explicit(&trace_fd, fd, memory_order_relaxed);
+    atomic_store_explicit(&trace_name_hash, name[0] != '\0' ? hash_username(name) : 0, memory_order_relaxed);
+    const bool tracing = fd != -1 || name[0] != '\0';
+    logging_enabled = tracing;
+    for (int i = 0; i < LOG_CATEGORIES; i++) {
+        atomic_store_explicit(&log_levels[i], levels[i], memory_order_relaxed);
+        atomic_store_explicit(&log_gates[i], tracing ? LOG_LEVEL_INFO : levels[i], memory_order_relaxed);
+        logging_enabled = logging_enabled || levels[i] != LOG_LEVEL_OFF;
+    }
+
+    if (report) {
+        log_message(ANSI_BOLD ANSI_GREEN "INFO: Log levels accept=%s protocol=%s room=%s send=%s events=%s, tracing "
+                                         "fd %d user '%s'" ANSI_RESET "\n",
+                    level_names[levels[LOG_ACCEPT]], level_names[levels[LOG_PROTOCOL]], level_names[levels[LOG_ROOM]],
+                    level_names[levels[LOG_SEND]], level_names[levels[LOG_EVENTS]], fd, trace_name);
+    }
+}
+
+/**
+ * @brief Applies a line of the control file: category=level, all=level,
+ * trace_fd=fd or trace_user=name. Empty lines and # comments are skipped.
+ *
+ * @param line   The line
+ * @param levels Level of each category, updated by category lines
+ * @param fd     Traced socket, updated by a trace_fd line, -1 for none
+ * @param name   Traced username, updated by a trace_user line, empty for none
+ *
+ * @return false if the line could not be parsed
+ */
+static bool apply_control_line(const char *line, int levels[], int *fd, char name[]) {
+    char text[LOG_CONTROL_LINE_LEN];
+    strcpy(text, line);
+    text[strcspn(text, "#\r\n")] = '\0';
+    char *key = text + strspn(text, " \t");
+    char *value = strchr(key, '=');
+    if (value == NULL) {
+        return *key == '\0';
+    }
+    *value++ = '\0';
+    value += strspn(value, " \t");
+    key[strcspn(key, " \t")] = '\0';
+    value[strcspn(value, " \t")] = '\0';
+
+    if (strcmp(key, "trace_fd") == 0) {
+        char *end;
+        const long traced = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || traced < -1 || traced > INT_MAX) {
+            return false;
+        }
+        *fd = (int)traced;
+        return true;
+    }
+    if (strcmp(key, "trace_user") == 0) {
+        if (strlen(value) > MAX_USERNAME_LEN) {
+            return false;
+        }
+        strcpy(name, value);
+        return true;
+    }
+
+    const int level = find_name(value, level_names, sizeof(level_names) / sizeof(level_names[0]));
+    if (level == -1) {
+        return false;
+    }
+    if (strcmp(key, "all") == 0) {
+        for (int i = 0; i < LOG_CATEGORIES; i++) {
+            levels[i] = level;
+        }
+        return true;
+    }
+    const int category = find_name(key, category_names, LOG_CATEGORIES);
+    if (category == -1) {
+        return false;
+    }
+    levels[category] = level;
+    return true;
+}
+
+/**
+ * @brief Looks a name up in a table of names
+ *
+ * @param name  The name
+ * @param names The table
+ * @param count Number of names in the table
+ *
+ * @return Index of the name in the table, -1 if it is not in it
+ */
+static int find_name(const char *name, const char *const names[], int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Hashes a username for comparing it with the traced one (FNV-1a)
+ *
+ * @param username The username
+ *
+ * @return The hash, never 0
+ */
+static uint64_t hash_username(const char *username) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)username; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Allocates the calling thread's ring and adds it to the rings the
+ * writer thread drains
+ *
+ * @return The ring, or NULL if it could not be allocated
+ */
+static Log_Ring *register_thread_ring(void) {
+    Log_Ring *ring = calloc(1, sizeof(Log_Ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->thread = pthread_self();
+    snprintf(ring->thread_id, sizeof(ring->thread_id), "%s[TID- %lu]%s ", "\033[95;2m", ring->thread, ANSI_RESET);
+
+    Log_Ring *head = atomic_load_explicit(&rings, memory_order_relaxed);
+    do {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&rings, &head, ring, memory_order_release, memory_order_relaxed));
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * @brief Runs the writer thread: drains the rings, and sleeps for
+ * LOG_FLUSH_INTERVAL_MS whenever they held less than a quarter of a ring
+ *
+ * The sleep is a wait for SIGHUP, which loads LOG_CONTROL_FILE again. While
+ * the rings keep it busy the thread still checks for a pending SIGHUP after
+ * every drain. With every category off and no client traced only this thread
+ * logs, so it waits for SIGHUP without waking up in between.
+ *
+ * @param arg Unused
+ *
+ * @return Never returns
+ */
+static void *run_log_writer(void *arg) {
+    (void)arg;
+    const struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000L};
+    const struct timespec no_wait = {.tv_sec = 0, .tv_nsec = 0};
+    while (1) {
+        const struct timespec *wait = drain_log_rings() < LOG_RING_RECORDS / 4 ? &interval : &no_wait;
+        const int signal_number =
+            logging_enabled ? sigtimedwait(&reload_signal, NULL, wait) : sigwaitinfo(&reload_signal, NULL);
+        if (signal_number == SIGHUP) {
+            load_log_control(true);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Writes every line waiting in the rings to the log file, in batches of
+ * up to LOG_WRITE_BATCH_SIZE bytes
+ *
+ * Lines of the same thread are written in the order they were logged. The
+ * timestamp is only formatted again when the second changes. A thread that
+ * dropped lines since the last drain gets a line saying how many.
+ *
+ * @return Number of lines written
+ */
+static int drain_log_rings(void) {
+    static char batch[LOG_WRITE_BATCH_SIZE];
+    static char time_stamp[LOG_PREFIX_LEN];
+    static size_t time_stamp_length;
+    static time_t time_stamp_second = -1;
+    size_t length = 0;
+    int drained = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (Log_Ring *ring = atomic_load_explicit(&rings, memory_order_acquire); ring != NULL; ring = ring->next) {
+        const size_t thread_id_length = strlen(ring->thread_id);
+        const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        for (; head != tail; head++) {
+            const Log_Record *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+            if (record->second != time_stamp_second) {
+                struct tm t;
+                char date[32] = "localtime_r error";
+                if (localtime_r(&record->second, &t) != NULL) {
+                    strftime(date, sizeof(date), "%Y:%m:%d:%T", &t);
+                }
+                time_stamp_length = snprintf(time_stamp, sizeof(time_stamp), "%s║%s %s%s%s%s %s║%s ", ANSI_MAGENTA,
+                                             ANSI_RESET, ANSI_BOLD, ANSI_CYAN, date, ANSI_RESET, ANSI_MAGENTA,
+                                             ANSI_RESET);
+                time_stamp_second = record->second;
+            }
+            if (length + time_stamp_length + thread_id_length + record->length > sizeof(batch)) {
+                write_batch(batch, length);
+                length = 0;
+            }
+            memcpy(batch + length, time_stamp, time_stamp_length);
+            length += time_stamp_length;
+            memcpy(batch + length, ring->thread_id, thread_id_length);
+            length += thread_id_length;
+            memcpy(batch + length, record->text, record->length);
+            length += record->length;
+            drained++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        const unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->dropped_reported) {
+            if (length + LOG_RECORD_SIZE > sizeof(batch)) {
+                write_batch(batch, length);
+                length = 0;
+            }
+            length += snprintf(batch + length, LOG_RECORD_SIZE,
+                               "%s%sSERVER ERROR: Log ring of thread %lu dropped %lu lines%s\n", ANSI_BOLD, ANSI_RED,
+                               ring->thread, dropped - ring->dropped_reported, ANSI_RESET);
+            ring->dropped_reported = dropped;
+        }
+    }
+    write_batch(batch, length);
+    pthread_mutex_unlock(&drain_lock);
+    return drained;
+}
+
+/**
+ * @brief Writes a batch of log lines to the log file
+ *
+ * @param batch  The log lines
+ * @param length Number of bytes in the batch
+ */
+static void write_batch(const char *batch, size_t length) {
+    while (length > 0) {
+        const ssize_t written = write(log_fd, batch, length);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return; // Nowhere to report it, the log itself is what failed
+        }
+        batch += written;
+        length -= written;
+    }
+}
@@ -1,10 +1,53 @@
-
 #ifndef LOGGER_H
 #define LOGGER_H
 
-void log_message(const char *format_str, ...);
+// Library
+#include <stdatomic.h> // For atomic_int, atomic_load_explicit
+
+struct Client;
+
+// What a log line is about. Every source file that logs defines LOG_CATEGORY as one of these before using the
+// LOG_* macros, and its lines are enabled by that category's level
+typedef enum Log_Category {
+    LOG_ACCEPT,   // Accepting connections and handing them to worker threads
+    LOG_PROTOCOL, // Reading and decoding client messages and the commands they carry
+    LOG_ROOM,     // Rooms, the room list and the mailboxes delivering broadcasts
+    LOG_SEND,     // Writing and queueing output for clients
+    LOG_EVENTS,   // The worker threads' event loops
+    LOG_CATEGORIES
+} Log_Category;
+
+// A category logs the lines of its level and every level above it
+typedef enum Log_Level { LOG_LEVEL_OFF, LOG_LEVEL_ERROR, LOG_LEVEL_WARNING, LOG_LEVEL_INFO } Log_Level;
+
+// Lowest level each category has to let through: its own level, or LOG_LEVEL_INFO while a client is traced
+extern atomic_int log_gates[LOG_CATEGORIES];
+// The client the calling thread is working for, its lines are logged whatever the level while it is traced
+extern _Thread_local const struct Client *log_client;
+
+void init_logger(void);
+// Checked like printf, the LOG_* macros are compiled in every build so a bad format would crash once enabled
+void log_message(const char *format_str, ...) __attribute__((format(printf, 1, 2)));
+void log_message_at(Log_Category category, Log_Level level, const char *format_str, ...)
+    __attribute__((format(printf, 3, 4)));
+unsigned long dropped_log_records(void);
 void print_erro_n_exit(char *msg);
 
+/**
+ * @brief Makes the client the one the calling thread's log lines are about,
+ * for tracing it
+ *
+ * @param client The client, NULL for none
+ *
+ * @return The client the lines were about before, to be restored once the
+ * thread is done with this one
+ */
+static inline const struct Client *set_log_client(const struct Client *client) {
+    const struct Client *previous = log_client;
+    log_client = client;
+    return previous;
+}
+
 #define ANSI_RED "\033[31m"
 #define ANSI_GREEN "\033[32m"
 #define ANSI_MAGENTA "\033[35m"
@@ -13,19 +56,23 @@ void print_erro_n_exit(char *msg);
 #define ANSI_BOLD "\033[1m"
 #define ANSI_YELLOW "\033[33m"
 
+// A disabled line costs one relaxed load of its category's gate and a branch predicted not taken, its arguments are
+// not evaluated
+#define LOG_AT_LEVEL(level, format, ...)                                                                               \
+    do {                                                                                                               \
+        if (__builtin_expect(atomic_load_explicit(&log_gates[LOG_CATEGORY], memory_order_relaxed) >= (level), 0)) {    \
+            log_message_at(LOG_CATEGORY, (level), format ANSI_RESET, ##__VA_ARGS__);                                   \
+        }                                                                                                              \
+    } while (0)
+
 // GOT HELP FORM CHATGP2 FOR THIS MACRO and GOT THE the ANSI ESCAPE COLOR MACROS FROM
 // IT AS WELL
-#ifdef LOG
-#define LOG_SERVER_ERROR(format, ...) log_message(ANSI_BOLD ANSI_RED "SERVER ERROR: " format ANSI_RESET, ##__VA_ARGS__)
-#define LOG_INFO(format, ...) log_message(ANSI_BOLD ANSI_GREEN "INFO: " format ANSI_RESET, ##__VA_ARGS__)
-#define LOG_USER_ERROR(format, ...) log_message(ANSI_BOLD ANSI_YELLOW "USER ERROR: " format ANSI_RESET, ##__VA_ARGS__)
+#define LOG_SERVER_ERROR(format, ...)                                                                                  \
+    LOG_AT_LEVEL(LOG_LEVEL_ERROR, ANSI_BOLD ANSI_RED "SERVER ERROR: " format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT_LEVEL(LOG_LEVEL_INFO, ANSI_BOLD ANSI_GREEN "INFO: " format, ##__VA_ARGS__)
+#define LOG_USER_ERROR(format, ...)                                                                                    \
+    LOG_AT_LEVEL(LOG_LEVEL_WARNING, ANSI_BOLD ANSI_YELLOW "USER ERROR: " format, ##__VA_ARGS__)
 #define LOG_CLIENT_DISCONNECT(format, ...)                                                                             \
-    log_message(ANSI_BOLD ANSI_CYAN "CLIENT DISCONNECTED: " format ANSI_RESET, ##__VA_ARGS__)
-#else
-#define LOG_SERVER_ERROR(format, ...) ((void)0)
-#define LOG_INFO(format, ...) ((void)0)
-#define LOG_USER_ERROR(format, ...) ((void)0)
-#define LOG_CLIENT_DISCONNECT(format, ...) ((void)0)
-#endif
+    LOG_AT_LEVEL(LOG_LEVEL_WARNING, ANSI_BOLD ANSI_CYAN "CLIENT DISCONNECTED: " format, ##__VA_ARGS__)
 
 #endif
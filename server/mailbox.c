@@ -0,0 +1,183 @@
+// Local
+#include "mailbox.h"
+
+#include "client_state_manager.h" // For finish_room_request()
+#include "latency.h"              // For record_deliveries()
+#include "logger.h"               // Has the logging function for LOG_INFO, LOG_SERVER_ERROR
+#include "output_queue.h"         // For send_frame(), release_frame()
+#include "room_manager.h"         // For handle_room_operation()
+
+// Library
+#include <errno.h>   // For errno, EAGAIN
+#include <stdint.h>  // For uint64_t
+#include <stdlib.h>  // For malloc, free
+#include <string.h>  // For strerror
+#include <unistd.h>  // For read, write
+
+#define LOG_CATEGORY LOG_ROOM // The log level of this category enables the file's log lines
+
+static void deliver_mailbox_message(Worker_Thread *thread_context, Mailbox_Message *message);
+
+/**
+ * @brief Allocates a mailbox message for delivering a room frame to some of a
+ * worker thread's clients
+ *
+ * The message takes its own reference on the frame, dropped once the message
+ * has been delivered. It is a ROOM_BROADCAST, room operations set their type
+ * and fields after creating it.
+ *
+ * @param frame          The frame to deliver, or NULL for a room operation
+ *                       without one
+ * @param room_index     The room the frame was broadcast in
+ * @param max_recipients Number of recipients the message needs space for
+ *
+ * @return The message with no recipients added yet, or NULL if the allocation
+ * failed
+ */
+Mailbox_Message *create_mailbox_message(Frame *frame, int room_index, int max_recipients) {
+    Mailbox_Message *message = malloc(sizeof(Mailbox_Message) + sizeof(Mailbox_Recipient) * max_recipients);
+    if (message == NULL) {
+        LOG_SERVER_ERROR("Could not allocate mailbox message for %d recipients\n", max_recipients);
+        return NULL;
+    }
+    if (frame != NULL) {
+        atomic_fetch_add_explicit(&frame->ref_count, 1, memory_order_relaxed);
+    }
+    message->next = NULL;
+    message->type = ROOM_BROADCAST;
+    message->frame = frame;
+    message->room_index = room_index;
+    message->sender = NULL;
+    message->reply = 0;
+    message->reply_message = NULL;
+    message->room_name[0] = '\0';
+    message->num_recipients = 0;
+    return message;
+}
+
+/**
+ * @brief Posts a message to a worker thread's mailbox. Lock-free and safe to
+ * call from any thread.
+ *
+ * The mailbox is a stack that producers push onto with a compare and swap.
+ * The worker's mailbox_fd is only written when the stack goes from empty to
+ * non empty, since the worker takes every message off the stack in one go
+ * after it reads the eventfd. A worker posting to itself never rings, it
+ * delivers its own mailbox at the end of every epoll loop iteration anyway.
+ *
+ * @param worker  The worker thread owning the recipients of the message
+ * @param message The message to post, owned by the worker from now on
+ * @param sender  The worker thread posting the message
+ */
+void post_to_mailbox(Worker_Thread *worker, Mailbox_Message *message, const Worker_Thread *sender) {
+    Mailbox_Message *head = atomic_load_explicit(&worker->mailbox, memory_order_relaxed);
+    do {
+        message->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&worker->mailbox, &head, message, memory_order_release,
+                                                    memory_order_relaxed));
+
+    if (head == NULL && worker != sender) {
+        uint64_t ring = 1;
+        if (write(worker->mailbox_fd, &ring, sizeof(ring)) == -1 && errno != EAGAIN) {
+            LOG_SERVER_ERROR("Failed to ring mailbox of worker %d: %s\n", worker->index, strerror(errno));
+        }
+    }
+}
+
+/**
+ * @brief Handles the worker's mailbox_fd becoming readable
+ *
+ * The eventfd is reset before the mailbox is emptied, so a message posted
+ * after the mailbox was taken rings the eventfd again instead of being missed.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ */
+void handle_mailbox_notification(Worker_Thread *thread_context) {
+    uint64_t rings;
+    if (read(thread_context->mailbox_fd, &rings, sizeof(rings)) == -1 && errno != EAGAIN) {
+        LOG_SERVER_ERROR("Failed to read mailbox eventfd %d: %s\n", thread_context->mailbox_fd, strerror(errno));
+    }
+    deliver_mailbox_messages(thread_context);
+}
+
+/**
+ * @brief Sends every message waiting in the worker's mailbox to its recipients
+ *
+ * The whole stack is taken with a single exchange and reversed, so messages
+ * are delivered in the order they were posted. Since broadcasts in a room post
+ * while holding the room's lock, or with ROOM_ACTORS only from the room's
+ * owner, this keeps the order of messages in a room the same for every
+ * recipient.
+ *
+ * A recipient is skipped if its slot now belongs to another client, or if it
+ * is no longer in the room the message was broadcast in, but still counts
+ * towards the fan-out latency of a timed message. Room operations are
+ * handed to the room manager, and replies to them to the client state manager.
+ *
+ * The mailbox is taken again until it is empty: a worker posting to itself
+ * while delivering, e.g. the owner of a room broadcasting a message posted to
+ * it, does not ring its own mailbox_fd.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ */
+void deliver_mailbox_messages(Worker_Thread *thread_context) {
+    Mailbox_Message *stack;
+    while ((stack = atomic_exchange_explicit(&thread_context->mailbox, NULL, memory_order_acquire)) != NULL) {
+        Mailbox_Message *in_order = NULL;
+        while (stack != NULL) {
+            Mailbox_Message *next = stack->next;
+            stack->next = in_order;
+            in_order = stack;
+            stack = next;
+        }
+
+        while (in_order != NULL) {
+            Mailbox_Message *message = in_order;
+            in_order = message->next;
+            deliver_mailbox_message(thread_context, message);
+        }
+    }
+}
+
+/**
+ * @brief Delivers a single message taken from the worker's mailbox, and frees
+ * it
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ * @param message        The message
+ */
+static void deliver_mailbox_message(Worker_Thread *thread_context, Mailbox_Message *message) {
+    switch (message->type) {
+    case ROOM_BROADCAST: {
+        int skipped = 0;
+        for (int i = 0; i < message->num_recipients; i++) {
+            Client *client = message->recipients[i].client;
+            if (client->in_use && client->generation == message->recipients[i].generation &&
+                client->state == IN_CHAT_ROOM && client->room_index == message->room_index) {
+                send_frame(client, message->frame);
+            } else {
+                skipped++;
+            }
+        }
+        // The recipients sent to count themselves once the frame is written to their socket or dropped
+        if (skipped > 0) {
+            record_deliveries(message->frame, skipped);
+        }
+        break;
+    }
+    case ROOM_REPLY: {
+        Client *client = message->recipients[0].client;
+        if (client->in_use && client->generation == message->recipients[0].generation) {
+            finish_room_request(client, thread_context, message->reply, message->room_index);
+        }
+        break;
+    }
+    default:
+        handle_room_operation(thread_context, message);
+        break;
+    }
+    if (message->frame != NULL) {
+        release_frame(message->frame);
+    }
+    free(message);
+}
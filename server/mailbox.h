@@ -0,0 +1,11 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include "server_config.h"
+
+Mailbox_Message *create_mailbox_message(Frame *frame, int room_index, int max_recipients);
+void post_to_mailbox(Worker_Thread *worker, Mailbox_Message *message, const Worker_Thread *sender);
+void handle_mailbox_notification(Worker_Thread *thread_context);
+void deliver_mailbox_messages(Worker_Thread *thread_context);
+
+#endif
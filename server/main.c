@@ -3,51 +3,101 @@
 
 // Local headers
 #include "client_distributor.h" // Custom header containing thread-related definitions and functions
-#include "connection_handler.h" // Contains the function that the threads will run after being set up, handles all functionality related to when the the client is succesfully connected
+#include "connection_handler.h" // Contains the function that the threads will run after being set up, handles all functionality related to when the the client is succesfully connected, and set_socket_keep_alive()
+#include "cpu_affinity.h"       // For plan_worker_cpus(), cpu_numa_node()
 #include "logger.h" // Has the logging functin for LOG_INFO, LOG_SERVER_ERROR, LOG_WARNING and also the print_err_n_exit
+#include "metrics.h"       // For start_admin_server(), count_metric(), main_thread_metrics
+#include "room_registry.h" // For init_room_registry()
 #include "server_config.h" // Custom header containing server configuration
+#include "server_limits.h" // For server_limits, load_server_limits(), set_limit_option(), allocate_lazily()
 
 // System/Library headers
 #include <errno.h>       // Provides error codes like EAGAIN, EWOULDBLOCK and errno variable
 #include <netinet/ip.h>  // IP protocol definitions and constants
-#include <netinet/tcp.h> // TCP protocol specific options and constants like TCP_KEEPINTVL
-#include <stdio.h>       // For printf(), this funciton is used only once in the program
-#include <string.h>      // For strerror() to convert error numbers to messages
+#include <pthread.h>     // For pthread_create, pthread_attr_setaffinity_np
+#include <sched.h>       // For cpu_set_t, CPU_SET
+#include <stdio.h>       // For printf(), fprintf()
+#include <stdlib.h>      // For calloc()
+#include <string.h>      // For strerror() to convert error numbers to messages, strcmp()
 #include <sys/eventfd.h> // For eventfd, EFD_NONBLOCK
 #include <sys/socket.h>  // Socket-related functions and constants (accept4(), SOCK_NONBLOCK, SOMAXCONN)
 #include <unistd.h>      // close() function
 
+#define LOG_CATEGORY LOG_ACCEPT // The log level of this category enables the file's log lines
+
 #define PORT_NUMBER 30000 // PORT NUMBER FOR THE SERVER TO LISTEN ON
 #define BACKLOG SOMAXCONN // DEFINED IN socket.h
 
-// This is a global that will also be used by other files
-Room SERVER_ROOMS[MAX_ROOMS] = {};
-
-static void init_server_rooms();
-static int setup_server(int port_number, int backlog);
-static int set_socket_keep_alive(int socket);
-static void setup_threads(Worker_Thread worker_threads[]);
+static int setup_server(int port_number, int backlog, bool reuse_port, int incoming_cpu);
+static Worker_Thread *setup_threads(bool reuse_port, bool pin_cpus);
+static void wait_for_worker_threads(Worker_Thread worker_threads[]);
 /**
  * @brief Main server loop that initializes the chat server and handles incoming
  * connections
  *
+ * The server runs in one of two modes:
+ * - By default the main thread accepts every connection and hands it to the
+ * worker thread picked by the --placement policy, two-choices unless given
+ * - With --reuseport, every worker thread has its own SO_REUSEPORT listening
+ * socket and accepts connections in its epoll loop, the kernel spreads the
+ * connections over the workers. The main thread just waits.
+ *
+ * With --pin-cpus every worker thread is pinned to its own CPU, see
+ * setup_threads().
+ *
  * @note press ctrl c to exit the server
  */
-int main() {
+int main(int argc, char *argv[]) {
     int server_listen_fd, client_fd;
+    bool reuse_port = false;
+    bool pin_cpus = false;
+    const char *config_file = NULL;
+    Server_Limits limit_options = {0};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reuseport") == 0) {
+            reuse_port = true;
+        } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+            pin_cpus = true;
+        } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            config_file = argv[++i];
+        } else if (strcmp(argv[i], "--placement") == 0 && i + 1 < argc && set_placement_policy(argv[i + 1])) {
+            i++;
+        } else if (i + 1 < argc && set_limit_option(&limit_options, argv[i], argv[i + 1])) {
+            i++;
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [--reuseport] [--placement round-robin|two-choices|least-loaded|incoming-cpu] "
+                    "[--pin-cpus] [--config FILE] [--worker-threads N] [--clients-per-thread N] [--rooms N] "
+                    "[--clients-per-room N]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    load_server_limits(config_file, &limit_options);
+
+    // Before any thread is started, they all inherit the signal mask blocking SIGHUP for the log writer thread
+    init_logger();
+    // Initialize the room registry, rooms are allocated as they are created, and the worker threads
+    init_room_registry();
     // these threads will manage the clients
-    Worker_Thread worker_threads[MAX_THREADS];
+    Worker_Thread *worker_threads = setup_threads(reuse_port, pin_cpus || placement_pins_workers());
+    init_client_distributor(worker_threads, reuse_port);
+    start_admin_server(worker_threads);
+    LOG_INFO("Initialized room registry for %d rooms and %d worker threads for MAX: %ld clients\n", server_limits.rooms,
+             server_limits.worker_threads, (long)server_limits.worker_threads * server_limits.clients_per_thread);
 
-    // Initialize all the rooms in the servers and worker threads
-    init_server_rooms();
-    setup_threads(worker_threads);
-    LOG_INFO("Initialized %d rooms and %d worker threads for MAX: %d clients\n", MAX_ROOMS, MAX_THREADS, MAX_CLIENTS);
+    printf("%d worker threads of %d clients, %d rooms of %d clients\n", server_limits.worker_threads,
+           server_limits.clients_per_thread, server_limits.rooms, server_limits.clients_per_room);
 
-    // set up the server listening socket
-    server_listen_fd = setup_server(PORT_NUMBER, BACKLOG);
+    printf("Waiting for connection on Port %d (%s placement)\n", PORT_NUMBER, placement_policy_name());
+    if (reuse_port) {
+        wait_for_worker_threads(worker_threads);
+        return 0;
+    }
 
-    // printf is only ever used here
-    printf("Waiting for connection on Port %d \n", PORT_NUMBER);
+    // set up the server listening socket
+    server_listen_fd = setup_server(PORT_NUMBER, BACKLOG, false, -1);
 
     while (1) {
         // Accept new connection with non-blocking socket
@@ -61,6 +111,7 @@ int main() {
             continue;
         }
         LOG_INFO("New client connection accepted: fd=%d\n", client_fd);
+        count_metric(&main_thread_metrics.accepted_clients, 1);
 
         if (set_socket_keep_alive(client_fd) == -1) {
             continue;
@@ -75,98 +126,107 @@ int main() {
     return 0;
 }
 
-/**
- * @brief Configures TCP keepalive settings for the specified socket.
- *
- * @param socket - The file descriptor the socket to configure
- *
- * @returns - 0 on success, -1 on failure
- * Ref:https://stackoverflow.com/questions/31426420/configuring-tcp-keepalive-after-accept
- */
-static int set_socket_keep_alive(int socket) {
-    int enable = 1;    // enable tcp keep alive
-    int idle_time = 5; // wait 5 seconds befor the first pkeep alive proble
-    int interval = 1;  // wait 1 second between each subsequent probe
-    int probes = 2;    // send 2 close before the conneciton is considered dead
-
-    LOG_INFO("Configuring keepalive for socket %d\n", socket, idle_time, interval, probes);
-
-    if (setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) == -1) {
-        LOG_SERVER_ERROR("Error in setsockopt(SO_KEEPALIVE): %s\n", strerror(errno));
-        return -1;
-    }
-
-    if (setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle_time, sizeof(idle_time)) == -1) {
-        LOG_SERVER_ERROR("Error in setsockopt(TCP_KEEPIDLE): %s\n", strerror(errno));
-        return -1;
-    }
-
-    if (setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1) {
-        LOG_SERVER_ERROR("Error in setsockopt(TCP_KEEPINTVL): %s\n", strerror(errno));
-        return -1;
-    }
-
-    if (setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) == -1) {
-        LOG_SERVER_ERROR("Error in setsockopt(TCP_KEEPCNT): %s\n", strerror(errno));
-        return -1;
-    }
-    LOG_INFO("Successfully configured keepalive for socket %d\n", socket);
-
-    return 0;
-}
-
 /**
  * @brief Initializes and creates worker threads for processing client
  * connections.
  *
  * This function for each worker thread:
- * - Initializes a non-blocking 'eventfd', which the main thread can uses to
- * pass new incoming client fds
+ * - Initializes a non-blocking 'eventfd', which the main thread rings after
+ * adding new client fds to the worker's new_clients queue
+ * - Initializes a second non-blocking 'eventfd' that other worker threads
+ * ring after posting room messages to the worker's mailbox
+ * - In reuse_port mode, opens the worker's own listening socket
+ * - Allocates the worker's new_clients queue, big enough for all its clients
  * - Zeroes out the num_of_clients and epoll_fd fields
+ * - With pin_cpus, starts the worker pinned to its CPU
+ *
+ * The workers are mapped with allocate_lazily(), server_limits.worker_threads
+ * of them, and each worker allocates its client slots itself once it runs.
+ * Only the first page of each worker, with the fields set here, is written by
+ * the main thread. The worker's own fields, receive buffer and metrics start
+ * on the next page, see Worker_Thread, so they and its clients are first
+ * touched by the worker, and a pinned worker gets them from its own NUMA node.
+ * A pinned worker's listening socket asks the kernel with SO_INCOMING_CPU for
+ * the connections coming in on the worker's CPU.
+ *
+ * @param reuse_port true if every worker thread accepts its own connections
+ * @param pin_cpus   true to pin every worker thread to a CPU, spread over the
+ *                   NUMA nodes by plan_worker_cpus()
  *
- * @param worker_threads Array of Worker_Thread structures to initialize
- * @note If eventfd or pthread_create system calls fail, the function will exit
- * the process
+ * @return The array of worker threads
+ * @note If eventfd, an allocation or pthread_create fail, the function will
+ * exit the process
  * @see process_client_connections() in "connection_handler.c" The function each
  * worker thread will run
  */
-static void setup_threads(Worker_Thread worker_threads[]) {
-    LOG_INFO("Initializing %d worker threads\n", MAX_THREADS);
-    memset(worker_threads, 0, sizeof(Worker_Thread) * MAX_THREADS);
-    for (int i = 0; i < MAX_THREADS; i++) {
+static Worker_Thread *setup_threads(bool reuse_port, bool pin_cpus) {
+    const int num_workers = server_limits.worker_threads;
+    size_t queue_size = 1;
+    while (queue_size < (size_t)server_limits.clients_per_thread) {
+        queue_size <<= 1;
+    }
+
+    LOG_INFO("Initializing %d worker threads\n", num_workers);
+    // Page aligned and zeroed
+    Worker_Thread *worker_threads = allocate_lazily(sizeof(Worker_Thread) * num_workers);
+    if (worker_threads == NULL) {
+        print_erro_n_exit("Could not allocate the worker threads in setup_threads");
+    }
+    static int worker_cpus[MAX_WORKER_THREADS];
+    if (pin_cpus && !plan_worker_cpus(worker_cpus, num_workers)) {
+        print_erro_n_exit("Could not read the CPUs to pin the worker threads to in setup_threads");
+    }
+    for (int i = 0; i < num_workers; i++) {
+        worker_threads[i].index = i;
+        worker_threads[i].cpu = pin_cpus ? worker_cpus[i] : -1;
+        worker_threads[i].listen_fd = reuse_port ? setup_server(PORT_NUMBER, BACKLOG, true, worker_threads[i].cpu) : -1;
         worker_threads[i].notification_fd = eventfd(0, EFD_NONBLOCK);
         if (worker_threads[i].notification_fd == -1) {
             print_erro_n_exit("Could not create event_fd in setup_threads");
         }
-
-        if (sem_init(&worker_threads[i].new_client, 0, 1) == -1) {
-            print_erro_n_exit("Could not initialize semaphore in setup_threads\n");
+        worker_threads[i].mailbox_fd = eventfd(0, EFD_NONBLOCK);
+        if (worker_threads[i].mailbox_fd == -1) {
+            print_erro_n_exit("Could not create mailbox event_fd in setup_threads");
         }
+        worker_threads[i].new_clients.fds = calloc(queue_size, sizeof(int));
+        if (worker_threads[i].new_clients.fds == NULL) {
+            print_erro_n_exit("Could not allocate a new client queue in setup_threads");
+        }
+        worker_threads[i].new_clients.mask = queue_size - 1;
 
-        if (pthread_mutex_init(&worker_threads[i].num_of_clients_lock, NULL) != 0) {
-            print_erro_n_exit("Could not worker thread num of clients mutex");
+        // A pinned worker starts on its CPU, before it first touches its memory
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        if (pin_cpus) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(worker_threads[i].cpu, &cpus);
+            if (pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus) != 0) {
+                print_erro_n_exit("Could not pin worker thread to its CPU");
+            }
+            LOG_INFO("Pinning worker thread %d to CPU %d on NUMA node %d\n", i, worker_threads[i].cpu,
+                     cpu_numa_node(worker_threads[i].cpu));
         }
-        if (pthread_create(&worker_threads[i].id, NULL, process_client_connections, &worker_threads[i]) != 0) {
+        if (pthread_create(&worker_threads[i].id, &attributes, process_client_connections, &worker_threads[i]) != 0) {
             print_erro_n_exit("Failed to create worker thread");
         }
+        pthread_attr_destroy(&attributes);
         LOG_INFO("Successfully initialized worker thread %d\n", i);
     }
     LOG_INFO("Successfully initialized all worker threads\n");
+    return worker_threads;
 }
 
 /**
- * @brief Initializes the server rooms by clearing the room data and setting up
- * mutexes.
+ * @brief Blocks the main thread until the worker threads exit, which they only
+ * do when the process is terminated
  *
- * @note This function will exit the program if any room mutex initialization
- * fails
+ * @param worker_threads Array of the running worker threads
  */
-static void init_server_rooms() {
-    memset(&SERVER_ROOMS, 0, sizeof(Room) * MAX_ROOMS);
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        if (pthread_mutex_init(&SERVER_ROOMS[i].room_lock, NULL) != 0) {
-            print_erro_n_exit("Failed to initialize mutex for a server room in "
-                              "init_server_room");
+static void wait_for_worker_threads(Worker_Thread worker_threads[]) {
+    for (int i = 0; i < server_limits.worker_threads; i++) {
+        if (pthread_join(worker_threads[i].id, NULL) != 0) {
+            LOG_SERVER_ERROR("Failed to join worker thread %d\n", i);
         }
     }
 }
@@ -177,19 +237,23 @@ static void init_server_rooms() {
  *
  * @param port_number The port number to be used for the server
  * @param backlog The maximum number of clients that can be held up in the queue
+ * @param reuse_port true to open one of several non-blocking SO_REUSEPORT
+ *                   sockets sharing the port, one per worker thread
+ * @param incoming_cpu With reuse_port, the CPU whose incoming connections the
+ *                     socket should be given, -1 for any
  *
  * @return int A file descriptor for the server socket, or -1 on failure.
  *
  * @note ON failure during the socket creation, binding or listening system
  * calls, this function will print an error and exit.
  */
-static int setup_server(int port_number, int backlog) {
+static int setup_server(int port_number, int backlog, bool reuse_port, int incoming_cpu) {
     int server_fd;
     int value = 1;
     struct sockaddr_in server_address = {
         .sin_family = AF_INET, .sin_port = htons(port_number), .sin_addr.s_addr = INADDR_ANY};
 
-    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (reuse_port ? SOCK_NONBLOCK : 0), 0);
     if (server_fd == -1) {
         print_erro_n_exit("Socket creation failed");
     }
@@ -197,6 +261,13 @@ static int setup_server(int port_number, int backlog) {
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) == -1) {
         print_erro_n_exit("setsockopt failed");
     }
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) == -1) {
+        print_erro_n_exit("setsockopt(SO_REUSEPORT) failed");
+    }
+    if (incoming_cpu != -1 &&
+        setsockopt(server_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu)) == -1) {
+        print_erro_n_exit("setsockopt(SO_INCOMING_CPU) failed");
+    }
     if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1) {
         print_erro_n_exit("Bind failed");
     }
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE // Enables GNU extensions required for the accept4() function
+
+// Local
+#include "metrics.h"
+
+#include "client_distributor.h" // For placement_policy_name()
+#include "latency.h"            // For rank_hot_rooms(), get_hot_room(), summarize_latency(), monotonic_time_ns()
+#include "logger.h"             // For LOG_INFO, LOG_SERVER_ERROR, print_erro_n_exit(), dropped_log_records()
+#include "room_registry.h"      // For get_room(), room_id_limit()
+#include "server_limits.h"      // For server_limits
+
+// Library
+#include <errno.h>      // For errno, EAGAIN, EINTR
+#include <pthread.h>    // For pthread_create, pthread_mutex_lock/unlock
+#include <stdarg.h>     // For va_list, va_start, va_end
+#include <stdatomic.h>  // For atomic_load_explicit
+#include <stdio.h>      // For snprintf, vsnprintf
+#include <stdlib.h>     // For malloc, realloc, free
+#include <string.h>     // For strcpy, strlen, strncmp, strstr
+#include <sys/socket.h> // For socket, bind, listen, accept4, recv, send, setsockopt
+#include <sys/stat.h>   // For lstat, chmod, S_ISSOCK
+#include <sys/time.h>   // For struct timeval
+#include <sys/un.h>     // For struct sockaddr_un
+#include <unistd.h>     // For close, unlink
+
+#define LOG_CATEGORY LOG_EVENTS // The log level of this category enables the file's log lines
+
+#define ADMIN_REQUEST_LEN 1024 // Most bytes of a scraper's request read before answering it
+
+// The metrics being formatted for a scrape, grown as lines are added
+typedef struct Metrics_Text {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed; // A line could not be added, the text is incomplete
+} Metrics_Text;
+
+// A counter of Worker_Metrics, exported with one line per worker thread
+typedef struct Counter_Description {
+    const char *name;
+    const char *help;
+    size_t offset;    // Of the counter in Worker_Metrics
+    bool main_thread; // Also counted by the main thread
+} Counter_Description;
+
+// A latency of Fanout_Latency, exported per worker thread and per hot room
+typedef struct Latency_Description {
+    const char *name; // Without the chat_ or chat_room_ prefix and the _seconds suffix
+    const char *help;
+    size_t offset; // Of the histogram in Fanout_Latency
+} Latency_Description;
+
+static const Counter_Description counters[] = {
+    {"chat_accepted_clients_total", "Connections accepted", offsetof(Worker_Metrics, accepted_clients), true},
+    {"chat_rejected_clients_total", "Connections turned away with ERR_SERVER_FULL",
+     offsetof(Worker_Metrics, rejected_clients), true},
+    {"chat_messages_in_total", "Complete messages received from clients", offsetof(Worker_Metrics, messages_in),
+     false},
+    {"chat_bytes_in_total", "Bytes received from clients", offsetof(Worker_Metrics, bytes_in), false},
+    {"chat_frames_out_total", "Frames sent or queued for clients", offsetof(Worker_Metrics, frames_out), false},
+    {"chat_bytes_out_total", "Bytes written to client sockets", offsetof(Worker_Metrics, bytes_out), false},
+    {"chat_send_would_block_total", "Writes that found a client's socket full and left output queued",
+     offsetof(Worker_Metrics, send_would_block), false},
+    {"chat_event_loop_wakeups_total", "Returns of the event loop from waiting for events",
+     offsetof(Worker_Metrics, wakeups), false},
+    {"chat_event_loop_events_total", "Events and completions handled by the event loop",
+     offsetof(Worker_Metrics, events), false},
+    {"chat_event_loop_busy_nanoseconds_total", "Time the event loop spent handling events rather than waiting",
+     offsetof(Worker_Metrics, busy_ns), false},
+};
+
+static const Latency_Description latencies[] = {
+    {"fanout_first_delivery", "Time from receiving a room message to sending it to its first recipient",
+     offsetof(Fanout_Latency, first_delivery)},
+    {"fanout_last_delivery", "Time from receiving a room message to sending it to its last recipient",
+     offsetof(Fanout_Latency, last_delivery)},
+};
+
+Worker_Metrics main_thread_metrics;
+
+static Worker_Thread *admin_workers; // The worker threads whose metrics are served
+static int admin_listen_fd;
+
+static void *run_admin_server(void *arg);
+static void serve_scrape(int admin_fd);
+static void format_metrics(Metrics_Text *text);
+static void format_room_metrics(Metrics_Text *text);
+static void format_latency_metrics(Metrics_Text *text);
+static void format_latency_family(Metrics_Text *text, const char *name, const char *help, const char *label,
+                                  const int label_values[], const Latency_Summary summaries[], int count);
+static unsigned long read_counter(const Worker_Metrics *metrics, size_t offset);
+static void append_metric(Metrics_Text *text, const char *format_str, ...) __attribute__((format(printf, 2, 3)));
+static bool send_all(int admin_fd, const char *data, size_t length);
+
+/**
+ * @brief Opens the admin socket at ADMIN_SOCKET_PATH and starts the thread
+ * serving the metrics on it
+ *
+ * A socket left at the path by a previous run is replaced. The socket is only
+ * accessible to the user running the server. Between scrapes the thread picks
+ * the hot rooms whose fan-out latency is recorded, see rank_hot_rooms().
+ *
+ * @param workers The worker threads, running for the lifetime of the process
+ *
+ * @note This function will exit the program if the socket cannot be opened or
+ * the thread cannot be started
+ */
+void start_admin_server(Worker_Thread workers[]) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(ADMIN_SOCKET_PATH) >= sizeof(address.sun_path)) {
+        print_erro_n_exit("ADMIN_SOCKET_PATH is too long for a Unix domain socket");
+    }
+    strcpy(address.sun_path, ADMIN_SOCKET_PATH);
+
+    admin_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_listen_fd == -1) {
+        print_erro_n_exit("Could not create the admin socket in start_admin_server");
+    }
+    struct stat existing;
+    if (lstat(ADMIN_SOCKET_PATH, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(ADMIN_SOCKET_PATH);
+    }
+    if (bind(admin_listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        print_erro_n_exit("Could not bind the admin socket in start_admin_server");
+    }
+    if (chmod(ADMIN_SOCKET_PATH, 0600) == -1 || listen(admin_listen_fd, SOMAXCONN) == -1) {
+        print_erro_n_exit("Could not listen on the admin socket in start_admin_server");
+    }
+    // accept4() gives up after this long, so the hot rooms are ranked again while no scraper connects
+    const struct timeval ranking_interval = {.tv_sec = HOT_ROOMS_INTERVAL_MS / 1000,
+                                             .tv_usec = HOT_ROOMS_INTERVAL_MS % 1000 * 1000};
+    setsockopt(admin_listen_fd, SOL_SOCKET, SO_RCVTIMEO, &ranking_interval, sizeof(ranking_interval));
+
+    admin_workers = workers;
+    pthread_t admin;
+    if (pthread_create(&admin, NULL, run_admin_server, NULL) != 0) {
+        print_erro_n_exit("Failed to start the admin thread in start_admin_server");
+    }
+    pthread_detach(admin);
+    LOG_INFO("Serving metrics on %s\n", ADMIN_SOCKET_PATH);
+}
+
+/**
+ * @brief Runs the admin thread: serves the scrapers connecting to the admin
+ * socket one at a time, and ranks the hot rooms every HOT_ROOMS_INTERVAL_MS
+ *
+ * @param arg Unused
+ *
+ * @return Never returns
+ */
+static void *run_admin_server(void *arg) {
+    (void)arg;
+    const struct timeval timeout = {.tv_sec = ADMIN_TIMEOUT_MS / 1000, .tv_usec = ADMIN_TIMEOUT_MS % 1000 * 1000};
+    uint64_t next_ranking = monotonic_time_ns();
+    while (1) {
+        int admin_fd = accept4(admin_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (admin_fd == -1 && errno != EINTR && errno != EAGAIN) {
+            LOG_SERVER_ERROR("Accept on the admin socket failed: %s\n", strerror(errno));
+        } else if (admin_fd != -1) {
+            // A scraper that stops reading or never sends its request cannot hold up the next one
+            setsockopt(admin_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(admin_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            serve_scrape(admin_fd);
+            close(admin_fd);
+        }
+
+        if (monotonic_time_ns() >= next_ranking) {
+            rank_hot_rooms();
+            next_ranking = monotonic_time_ns() + HOT_ROOMS_INTERVAL_MS * 1000000ULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Answers a scraper with the current metrics
+ *
+ * The request is read up to the end of its HTTP header, the scraper shutting
+ * down its side or ADMIN_TIMEOUT_MS, whichever comes first. A GET request is
+ * answered with an HTTP response, as Prometheus and curl --unix-socket expect,
+ * anything else with the bare metrics text.
+ *
+ * @param admin_fd The scraper's connection
+ */
+static void serve_scrape(int admin_fd) {
+    char request[ADMIN_REQUEST_LEN + 1];
+    size_t request_length = 0;
+    request[0] = '\0';
+    while (request_length < ADMIN_REQUEST_LEN && strstr(request, "\r\n\r\n") == NULL &&
+           strstr(request, "\n\n") == NULL) {
+        ssize_t bytes = recv(admin_fd, request + request_length, ADMIN_REQUEST_LEN - request_length, 0);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            break;
+        }
+        request_length += bytes;
+        request[request_length] = '\0';
+    }
+
+    Metrics_Text text = {0};
+    format_metrics(&text);
+    if (text.failed) {
+        LOG_SERVER_ERROR("Could not format the metrics for a scrape\n");
+        free(text.data);
+        return;
+    }
+    if (strncmp(request, "GET ", 4) == 0) {
+        char header[128];
+        const int header_length = snprintf(header, sizeof(header),
+                                           "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                           "Content-Length: %zu\r\n\r\n",
+                                           text.length);
+        if (!send_all(admin_fd, header, header_length)) {
+            free(text.data);
+            return;
+        }
+    }
+    send_all(admin_fd, text.data, text.length);
+    free(text.data);
+}
+
+/**
+ * @brief Formats every metric in the Prometheus text format
+ *
+ * The counters are summed nowhere: each worker thread's are read from its own
+ * Worker_Metrics and exported with a worker label, Prometheus aggregates them.
+ *
+ * @param text The text to append the metrics to
+ */
+static void format_metrics(Metrics_Text *text) {
+    append_metric(text,
+                  "# HELP chat_client_placement_info Policy placing new clients on worker threads\n"
+                  "# TYPE chat_client_placement_info gauge\n"
+                  "chat_client_placement_info{policy=\"%s\"} 1\n",
+                  placement_policy_name());
+
+    append_metric(text, "# HELP chat_clients_connected Clients connected to the worker thread\n"
+                        "# TYPE chat_clients_connected gauge\n");
+    for (int i = 0; i < server_limits.worker_threads; i++) {
+        const int num_of_clients = atomic_load_explicit(&admin_workers[i].num_of_clients, memory_order_relaxed);
+        append_metric(text, "chat_clients_connected{worker=\"%d\"} %d\n", i, num_of_clients);
+    }
+
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        const Counter_Description *counter = &counters[c];
+        append_metric(text, "# HELP %s %s\n# TYPE %s counter\n", counter->name, counter->help, counter->name);
+        if (counter->main_thread) {
+            append_metric(text, "%s{worker=\"main\"} %lu\n", counter->name,
+                          read_counter(&main_thread_metrics, counter->offset));
+        }
+        for (int i = 0; i < server_limits.worker_threads; i++) {
+            append_metric(text, "%s{worker=\"%d\"} %lu\n", counter->name, i,
+                          read_counter(&admin_workers[i].metrics, counter->offset));
+        }
+    }
+
+    format_room_metrics(text);
+    format_latency_metrics(text);
+    append_metric(text,
+                  "# HELP chat_log_dropped_lines_total Log lines dropped because a thread's log ring was full\n"
+                  "# TYPE chat_log_dropped_lines_total counter\nchat_log_dropped_lines_total %lu\n",
+                  dropped_log_records());
+}
+
+/**
+ * @brief Formats the number of rooms in use and the members of each of them
+ *
+ * in_use is read under the room's lock, like the room list does, and the
+ * members from member_count, which the room's lock does not guard with
+ * ROOM_ACTORS.
+ *
+ * @param text The text to append the metrics to
+ */
+static void format_room_metrics(Metrics_Text *text) {
+    int rooms_in_use = 0;
+    const int room_id_end = room_id_limit();
+
+    append_metric(text, "# HELP chat_room_members Clients in the room\n# TYPE chat_room_members gauge\n");
+    for (int i = 0; i < room_id_end; i++) {
+        Room *room = get_room(i);
+        if (room == NULL) { // Chunk still being allocated, none of its rooms is in use yet
+            i += ROOM_CHUNK_SIZE - 1 - i % ROOM_CHUNK_SIZE;
+            continue;
+        }
+        pthread_mutex_lock(&room->room_lock);
+        const bool in_use = room->in_use;
+        pthread_mutex_unlock(&room->room_lock);
+        if (in_use) {
+            append_metric(text, "chat_room_members{room=\"%d\"} %d\n", i,
+                          atomic_load_explicit(&room->member_count, memory_order_relaxed));
+            rooms_in_use++;
+        }
+    }
+    append_metric(text, "# HELP chat_rooms_in_use Rooms with at least one client\n# TYPE chat_rooms_in_use gauge\n"
+                        "chat_rooms_in_use %d\n",
+                  rooms_in_use);
+}
+
+/**
+ * @brief Formats the fan-out latency of room messages, as summaries with the
+ * 50th, 99th and 99.9th percentiles and as the longest latency
+ *
+ * The latency of the messages received by each worker thread's clients is
+ * exported since the server started, with a worker label. That of each hot
+ * room since it became hot, with a room label.
+ *
+ * @param text The text to append the metrics to
+ */
+static void format_latency_metrics(Metrics_Text *text) {
+    const int num_workers = server_limits.worker_threads;
+    int *worker_ids = malloc(sizeof(int) * num_workers);
+    Latency_Summary *summaries = malloc(sizeof(Latency_Summary) * (num_workers > HOT_ROOMS ? num_workers : HOT_ROOMS));
+    int room_ids[HOT_ROOMS];
+    const Fanout_Latency *room_latencies[HOT_ROOMS];
+    int num_rooms = 0;
+    if (worker_ids == NULL || summaries == NULL) {
+        text->failed = true;
+        free(worker_ids);
+        free(summaries);
+        return;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        worker_ids[i] = i;
+    }
+    for (int slot = 0; slot < HOT_ROOMS; slot++) {
+        room_latencies[num_rooms] = get_hot_room(slot, &room_ids[num_rooms]);
+        if (room_latencies[num_rooms] != NULL) {
+            num_rooms++;
+        }
+    }
+
+    for (size_t l = 0; l < sizeof(latencies) / sizeof(latencies[0]); l++) {
+        const Latency_Description *latency = &latencies[l];
+        char name[64];
+
+        for (int i = 0; i < num_workers; i++) {
+            const char *histogram = (const char *)&admin_workers[i].fanout_latency + latency->offset;
+            summarize_latency((const Latency_Histogram *)histogram, &summaries[i]);
+        }
+        snprintf(name, sizeof(name), "chat_%s", latency->name);
+        format_latency_family(text, name, latency->help, "worker", worker_ids, summaries, num_workers);
+
+        for (int i = 0; i < num_rooms; i++) {
+            const char *histogram = (const char *)room_latencies[i] + latency->offset;
+            summarize_latency((const Latency_Histogram *)histogram, &summaries[i]);
+        }
+        snprintf(name, sizeof(name), "chat_room_%s", latency->name);
+        format_latency_family(text, name, latency->help, "room", room_ids, summaries, num_rooms);
+    }
+    free(worker_ids);
+    free(summaries);
+}
+
+/**
+ * @brief Formats a latency as a summary family, name_seconds, and a gauge
+ * family of its longest value, name_max_seconds
+ *
+ * A summary without any latency recorded has NaN percentiles.
+ *
+ * @param text         The text to append the metrics to
+ * @param name         Name of the metric without its unit
+ * @param help         What the latency is
+ * @param label        Name of the label telling the summaries apart
+ * @param label_values Value of the label for each summary
+ * @param summaries    The summaries
+ * @param count        Number of summaries
+ */
+static void format_latency_family(Metrics_Text *text, const char *name, const char *help, const char *label,
+                                  const int label_values[], const Latency_Summary summaries[], int count) {
+    append_metric(text, "# HELP %s_seconds %s\n# TYPE %s_seconds summary\n", name, help, name);
+    for (int i = 0; i < count; i++) {
+        const Latency_Summary *summary = &summaries[i];
+        const unsigned long quantiles_ns[] = {summary->p50_ns, summary->p99_ns, summary->p999_ns};
+        const char *quantiles[] = {"0.5", "0.99", "0.999"};
+        for (int q = 0; q < 3; q++) {
+            if (summary->count == 0) {
+                append_metric(text, "%s_seconds{%s=\"%d\",quantile=\"%s\"} NaN\n", name, label, label_values[i],
+                              quantiles[q]);
+            } else {
+                append_metric(text, "%s_seconds{%s=\"%d\",quantile=\"%s\"} %.9f\n", name, label, label_values[i],
+                              quantiles[q], quantiles_ns[q] / 1e9);
+            }
+        }
+        append_metric(text, "%s_seconds_sum{%s=\"%d\"} %.9f\n%s_seconds_count{%s=\"%d\"} %lu\n", name, label,
+                      label_values[i], summary->sum_ns / 1e9, name, label, label_values[i], summary->count);
+    }
+
+    append_metric(text, "# HELP %s_max_seconds Longest of: %s\n# TYPE %s_max_seconds gauge\n", name, help, name);
+    for (int i = 0; i < count; i++) {
+        append_metric(text, "%s_max_seconds{%s=\"%d\"} %.9f\n", name, label, label_values[i],
+                      summaries[i].max_ns / 1e9);
+    }
+}
+
+/**
+ * @brief Reads a counter of a thread's metrics while the thread may be adding
+ * to it
+ *
+ * @param metrics The thread's metrics
+ * @param offset  Offset of the counter in Worker_Metrics
+ *
+ * @return The counter's value
+ */
+static unsigned long read_counter(const Worker_Metrics *metrics, size_t offset) {
+    const atomic_ulong *counter = (const atomic_ulong *)((const char *)metrics + offset);
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * @brief Appends a formatted line to the metrics, growing the text as needed
+ *
+ * @param text       The text to append to
+ * @param format_str printf format of the line
+ * @param ...        Values for the format
+ */
+static void append_metric(Metrics_Text *text, const char *format_str, ...) {
+    while (!text->failed) {
+        va_list args;
+        va_start(args, format_str);
+        const int length = vsnprintf(text->data + text->length, text->capacity - text->length, format_str, args);
+        va_end(args);
+        if (length < 0) {
+            text->failed = true;
+            return;
+        }
+        if ((size_t)length < text->capacity - text->length) {
+            text->length += length;
+            return;
+        }
+
+        const size_t capacity = text->capacity == 0 ? 4096 : text->capacity * 2;
+        char *data = realloc(text->data, capacity);
+        if (data == NULL) {
+            text->failed = true;
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+/**
+ * @brief Writes the whole buffer to the scraper's connection
+ *
+ * @param admin_fd The scraper's connection
+ * @param data     The bytes to send
+ * @param length   Number of bytes
+ *
+ * @return false if the scraper is gone or did not read for ADMIN_TIMEOUT_MS
+ */
+static bool send_all(int admin_fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = send(admin_fd, data, length, MSG_NOSIGNAL);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        data += bytes;
+        length -= bytes;
+    }
+    return true;
+}
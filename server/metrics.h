@@ -0,0 +1,25 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "server_config.h"
+
+// Counters of the main thread, which accepts the connections unless the server runs with --reuseport
+extern Worker_Metrics main_thread_metrics;
+
+void start_admin_server(Worker_Thread workers[]);
+
+/**
+ * @brief Adds to a counter of the calling thread's metrics
+ *
+ * A counter has a single writer, so this is a plain load and store, without
+ * the lock prefix of an atomic add.
+ *
+ * @param counter The counter, in the calling thread's metrics
+ * @param amount  What to add to it
+ */
+static inline void count_metric(atomic_ulong *counter, unsigned long amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+#endif
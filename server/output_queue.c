@@ -0,0 +1,493 @@
+// Local
+#include "output_queue.h"
+
+#include "event_loop.h" // For watch_client_output()
+#include "latency.h"    // For monotonic_time_ns(), record_first_delivery(), record_deliveries()
+#include "logger.h"     // For LOG_INFO, LOG_SERVER_ERROR, LOG_CLIENT_DISCONNECT, set_log_client()
+#include "metrics.h"    // For count_metric()
+#include "protocol.h"   // For CMD_ROOM_MSG
+
+// Library
+#include <errno.h>      // For errno, EAGAIN, EWOULDBLOCK
+#include <stdbool.h>    // For bool type
+#include <stdlib.h>     // For malloc, free
+#include <string.h>     // For memcpy, strerror
+#include <sys/socket.h> // For send, sendmsg, shutdown
+#include <sys/uio.h>    // For struct iovec
+
+#define LOG_CATEGORY LOG_SEND // The log level of this category enables the file's log lines
+
+static Frame *alloc_frame(size_t length, char cmd_type);
+static void write_or_queue(Client *client, const char *data, size_t length, char cmd_type, Frame *shared_frame);
+static bool make_space_in_queue(Client *client, size_t length, char cmd_type);
+static void drop_queue_and_disconnect(Client *client);
+static void free_queued_frames(Output_Queue *queue);
+static void free_queued_frame(Queued_Frame *queued, bool written);
+static void finish_delivery(Frame *frame, bool written);
+
+/**
+ * @brief Formats a message to the protocol into a new reference counted frame
+ *
+ * The frame starts with a single reference owned by the caller, who must drop
+ * it with release_frame() once it has handed the frame to every recipient.
+ *
+ * @param cmd_type Command character to prefix the message.
+ * @param message  Message content, must be NUL terminated.
+ *
+ * @return The new frame, or NULL if it could not be allocated
+ */
+Frame *create_frame(char cmd_type, const char *message) {
+    size_t message_length = strlen(message);
+    size_t length = 2 + message_length + strlen(MSG_TERMINATOR);
+
+    Frame *frame = alloc_frame(length, cmd_type);
+    if (frame == NULL) {
+        LOG_SERVER_ERROR("Could not allocate frame for a %zu byte message\n", message_length);
+        return NULL;
+    }
+    frame->data[0] = cmd_type;
+    frame->data[1] = ' ';
+    memcpy(frame->data + 2, message, message_length);
+    memcpy(frame->data + 2 + message_length, MSG_TERMINATOR, strlen(MSG_TERMINATOR));
+    return frame;
+}
+
+/**
+ * @brief Allocates a frame with a single reference and room for length bytes
+ * of data, not timed for fan-out latency
+ *
+ * @param length   Bytes of data the frame holds, filled in by the caller
+ * @param cmd_type Command character the data starts with
+ *
+ * @return The new frame, or NULL if it could not be allocated
+ */
+static Frame *alloc_frame(size_t length, char cmd_type) {
+    Frame *frame = malloc(sizeof(Frame) + length);
+    if (frame == NULL) {
+        return NULL;
+    }
+    atomic_init(&frame->ref_count, 1);
+    frame->length = length;
+    frame->cmd_type = cmd_type;
+    frame->received_at = 0;
+    atomic_init(&frame->deliveries_left, 0);
+    atomic_init(&frame->delivered, false);
+    frame->worker_latency = NULL;
+    frame->room_latency = NULL;
+    return frame;
+}
+
+/**
+ * @brief Drops a reference to the frame and frees it if it was the last one
+ *
+ * @param frame The frame to release
+ */
+void release_frame(Frame *frame) {
+    if (atomic_fetch_sub_explicit(&frame->ref_count, 1, memory_order_acq_rel) == 1) {
+        free(frame);
+    }
+}
+
+/**
+ * @brief Sends a shared frame to a client, queueing whatever cannot be written
+ * right away.
+ *
+ * No copy of the frame is made, a queued frame just takes another reference on
+ * it. This is what lets a broadcast format its message once for a whole room.
+ * A timed frame counts as delivered to the client once its last byte is
+ * written to the socket, or as done if it is dropped.
+ *
+ * @param client Client to send the frame to
+ * @param frame  The frame to send. The caller keeps its own reference.
+ *
+ * @note Must be called from the worker thread owning the client
+ */
+void send_frame(Client *client, Frame *frame) {
+    const Client *previous_log_client = set_log_client(client);
+    write_or_queue(client, frame->data, frame->length, frame->cmd_type, frame);
+    set_log_client(previous_log_client);
+}
+
+/**
+ * @brief Initializes an empty output queue for a freshly allocated client
+ *
+ * @param client Pointer to the Client structure that owns the queue
+ */
+void init_output_queue(Client *client) {
+    memset(&client->out_queue, 0, sizeof(Output_Queue));
+}
+
+/**
+ * @brief Writes as much of a frame to the client's socket as the socket will
+ * take right now and queues the rest.
+ *
+ * If frames are already waiting in the queue the new frame is appended behind
+ * them so that the ordering of frames is kept. Whatever is left unsent is
+ * flushed by the worker thread owning the client once epoll reports EPOLLOUT.
+ * The function never blocks or spins on a full socket.
+ *
+ * With WRITE_COALESCING, or the io_uring backend, nothing is written right
+ * away. Every frame is queued and the worker writes everything queued for the
+ * client during the event loop iteration with a single sendmsg at the end of
+ * it, so a client joining a busy room gets its join reply, the notifications
+ * and the chat lines of the iteration in one write instead of one per frame.
+ *
+ * @param client   Client to send the frame to
+ * @param data     Fully formatted frame, including the MSG_TERMINATOR
+ * @param length   Number of bytes in data
+ * @param cmd_type The command of the frame, used to decide which frames can be
+ *                 dropped when the queue is full
+ *
+ * @note The data is copied if it has to be queued, use send_frame() to send
+ * a frame to many clients without copies
+ * @note Must be called from the worker thread owning the client
+ */
+void send_or_queue(Client *client, const char *data, size_t length, char cmd_type) {
+    const Client *previous_log_client = set_log_client(client);
+    write_or_queue(client, data, length, cmd_type, NULL);
+    set_log_client(previous_log_client);
+}
+
+/**
+ * @brief Shared implementation of send_or_queue() and send_frame()
+ *
+ * @param client       Client to send the data to
+ * @param data         Fully formatted frame, including the MSG_TERMINATOR
+ * @param length       Number of bytes in data
+ * @param cmd_type     The command of the frame
+ * @param shared_frame The frame data belongs to, referenced by the queue
+ *                     instead of copying data. NULL if data has to be copied.
+ */
+static void write_or_queue(Client *client, const char *data, size_t length, char cmd_type, Frame *shared_frame) {
+    Output_Queue *queue = &client->out_queue;
+    size_t sent = 0;
+
+    if (queue->overflowed) {
+        finish_delivery(shared_frame, false);
+        return;
+    }
+    count_metric(&client->worker->metrics.frames_out, 1);
+
+    // Only write directly if nothing is queued, otherwise the frames would go out of order
+    if (WORKER_BACKEND == BACKEND_EPOLL && !WRITE_COALESCING && queue->head == NULL) {
+        while (sent < length) {
+            ssize_t bytes = send(client->client_fd, data + sent, length - sent, MSG_NOSIGNAL);
+            if (bytes == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    count_metric(&client->worker->metrics.send_would_block, 1);
+                    LOG_INFO("Socket full for client fd %d, queueing %zu bytes\n", client->client_fd, length - sent);
+                    break;
+                }
+                // The owning worker will see EPOLLERR/EPOLLHUP and clean the client up
+                LOG_CLIENT_DISCONNECT("Failed to send message to client fd %d: %s\n", client->client_fd,
+                                      strerror(errno));
+                finish_delivery(shared_frame, false);
+                return;
+            }
+            sent += bytes;
+        }
+        count_metric(&client->worker->metrics.bytes_out, sent);
+        if (sent == length) {
+            finish_delivery(shared_frame, true);
+            return;
+        }
+    }
+
+    if (!make_space_in_queue(client, length - sent, cmd_type)) {
+        finish_delivery(shared_frame, false);
+        return;
+    }
+
+    Queued_Frame *queued = malloc(sizeof(Queued_Frame));
+    Frame *frame = shared_frame;
+    if (queued != NULL && frame == NULL) {
+        // One-off message formatted on the caller's stack, it needs its own copy to outlive the call
+        frame = alloc_frame(length, cmd_type);
+        if (frame != NULL) {
+            memcpy(frame->data, data, length);
+        }
+    }
+    if (queued == NULL || frame == NULL) {
+        LOG_SERVER_ERROR("Could not allocate output frame for client fd %d\n", client->client_fd);
+        free(queued);
+        drop_queue_and_disconnect(client);
+        finish_delivery(shared_frame, false);
+        return;
+    }
+    if (shared_frame != NULL) {
+        atomic_fetch_add_explicit(&shared_frame->ref_count, 1, memory_order_relaxed);
+    }
+    queued->frame = frame;
+    queued->sent = sent;
+    queued->next = NULL;
+
+    if (queue->tail == NULL) {
+        queue->head = queued;
+    } else {
+        queue->tail->next = queued;
+    }
+    queue->tail = queued;
+    queue->queued_bytes += length - sent;
+    watch_client_output(client);
+}
+
+/**
+ * @brief Writes queued frames to the client until the queue is empty or the
+ * socket is full again. Called by the owning worker thread on EPOLLOUT and at
+ * the end of every epoll loop iteration.
+ *
+ * Up to MAX_FRAMES_PER_WRITE frames are gathered into each sendmsg.
+ *
+ * @param client Client whose queue should be flushed
+ */
+void flush_output_queue(Client *client) {
+    Output_Queue *queue = &client->out_queue;
+    struct iovec iov[MAX_FRAMES_PER_WRITE];
+    const Client *previous_log_client = set_log_client(client);
+
+    while (queue->head != NULL) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 0};
+        size_t length = 0;
+        for (Queued_Frame *queued = queue->head; queued != NULL && msg.msg_iovlen < MAX_FRAMES_PER_WRITE;
+             queued = queued->next) {
+            iov[msg.msg_iovlen].iov_base = queued->frame->data + queued->sent;
+            iov[msg.msg_iovlen].iov_len = queued->frame->length - queued->sent;
+            length += iov[msg.msg_iovlen].iov_len;
+            msg.msg_iovlen++;
+        }
+
+        ssize_t bytes = sendmsg(client->client_fd, &msg, MSG_NOSIGNAL);
+        if (bytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                count_metric(&client->worker->metrics.send_would_block, 1);
+            } else {
+                LOG_CLIENT_DISCONNECT("Failed to flush queued messages to client fd %d: %s\n", client->client_fd,
+                                      strerror(errno));
+            }
+            break;
+        }
+        advance_output_queue(client, bytes);
+        if ((size_t)bytes < length) {
+            break;
+        }
+    }
+    LOG_INFO("Flushed output queue of client fd %d, %zu bytes still queued\n", client->client_fd,
+             queue->queued_bytes);
+    set_log_client(previous_log_client);
+}
+
+/**
+ * @brief Takes bytes written to the client's socket off the front of its
+ * queue, freeing every frame that has been written whole
+ *
+ * @param client Client whose queued bytes were written
+ * @param bytes  Number of bytes written, from the first unsent byte of the head
+ */
+void advance_output_queue(Client *client, size_t bytes) {
+    Output_Queue *queue = &client->out_queue;
+
+    count_metric(&client->worker->metrics.bytes_out, bytes);
+    queue->queued_bytes -= bytes;
+    while (queue->head != NULL && bytes > 0) {
+        Queued_Frame *queued = queue->head;
+        size_t unsent = queued->frame->length - queued->sent;
+        if (bytes < unsent) {
+            queued->sent += bytes;
+            return;
+        }
+        bytes -= unsent;
+        queue->head = queued->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        free_queued_frame(queued, true);
+    }
+}
+
+/**
+ * @brief Puts the client on its worker's pending_output list, to have its
+ * queue written at the end of the loop iteration
+ *
+ * @param client Client whose send_pending flag is not set
+ */
+void mark_output_pending(Client *client) {
+    Worker_Thread *thread_context = client->worker;
+    if (COALESCE_MAX_DELAY_US > 0 && thread_context->num_pending_output == 0) {
+        thread_context->output_pending_since = monotonic_time_ns();
+    }
+    client->out_queue.send_pending = true;
+    thread_context->pending_output[thread_context->num_pending_output++] = client;
+}
+
+/**
+ * @brief Checks whether the oldest output waiting for the end of the loop
+ * iteration has waited COALESCE_MAX_DELAY_US
+ *
+ * @param thread_context The worker thread
+ *
+ * @return true if the pending output has to be written now, always false
+ * without COALESCE_MAX_DELAY_US
+ */
+bool output_deadline_passed(const Worker_Thread *thread_context) {
+#if COALESCE_MAX_DELAY_US > 0
+    return thread_context->num_pending_output > 0 &&
+           monotonic_time_ns() - thread_context->output_pending_since >= COALESCE_MAX_DELAY_US * 1000ULL;
+#else
+    (void)thread_context;
+    return false;
+#endif
+}
+
+/**
+ * @brief Frees every frame still in the client's queue.
+ *
+ * @param client Client being cleaned up
+ */
+void destroy_output_queue(Client *client) {
+    free_queued_frames(&client->out_queue);
+}
+
+/**
+ * @brief Applies OUTPUT_QUEUE_FULL_ACTION if queueing length more bytes would
+ * take the queue past OUTPUT_QUEUE_MAX_BYTES
+ *
+ * With DROP_OLDEST_CHAT_FRAMES, the oldest CMD_ROOM_MSG frames that have not
+ * been partially written, and are not being written by an io_uring send, are
+ * unlinked until the new frame fits. If that is not
+ * enough, a new chat frame is dropped itself, while any other frame (which
+ * the client needs to stay in sync with the server) disconnects the client.
+ *
+ * @param client   Client whose queue is checked
+ * @param length   Number of bytes about to be queued
+ * @param cmd_type Command of the frame about to be queued
+ *
+ * @return true if the frame should be queued, false if it has to be discarded
+ */
+static bool make_space_in_queue(Client *client, size_t length, char cmd_type) {
+    Output_Queue *queue = &client->out_queue;
+    if (queue->queued_bytes + length <= OUTPUT_QUEUE_MAX_BYTES) {
+        return true;
+    }
+
+    if (OUTPUT_QUEUE_FULL_ACTION == DISCONNECT_CLIENT) {
+        LOG_CLIENT_DISCONNECT("Output queue of client fd %d is full (%zu bytes), disconnecting\n", client->client_fd,
+                              queue->queued_bytes);
+        drop_queue_and_disconnect(client);
+        return false;
+    }
+
+    Queued_Frame *prev = queue->head;
+    for (int i = 1; i < queue->frames_in_flight && prev != NULL; i++) {
+        prev = prev->next;
+    }
+    while (prev != NULL && queue->queued_bytes + length > OUTPUT_QUEUE_MAX_BYTES) {
+        Queued_Frame *queued = prev->next;
+        if (queued == NULL) {
+            break;
+        }
+        if (queued->frame->cmd_type != CMD_ROOM_MSG || queued->sent != 0) {
+            prev = queued;
+            continue;
+        }
+        prev->next = queued->next;
+        if (queue->tail == queued) {
+            queue->tail = prev;
+        }
+        queue->queued_bytes -= queued->frame->length;
+        free_queued_frame(queued, false);
+    }
+    // The head is checked last as it is the only frame that can be partially written
+    if (queue->queued_bytes + length > OUTPUT_QUEUE_MAX_BYTES && queue->head != NULL && queue->frames_in_flight == 0 &&
+        queue->head->frame->cmd_type == CMD_ROOM_MSG && queue->head->sent == 0) {
+        Queued_Frame *queued = queue->head;
+        queue->head = queued->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->queued_bytes -= queued->frame->length;
+        free_queued_frame(queued, false);
+    }
+
+    if (queue->queued_bytes + length <= OUTPUT_QUEUE_MAX_BYTES) {
+        LOG_INFO("Dropped old chat frames for slow client fd %d\n", client->client_fd);
+        return true;
+    }
+    if (cmd_type == CMD_ROOM_MSG) {
+        LOG_INFO("Output queue of client fd %d is full, dropping chat frame\n", client->client_fd);
+        return false;
+    }
+    LOG_CLIENT_DISCONNECT("Output queue of client fd %d is full of control frames, disconnecting\n",
+                          client->client_fd);
+    drop_queue_and_disconnect(client);
+    return false;
+}
+
+/**
+ * @brief Discards everything queued for the client and shuts its socket down.
+ *
+ * The socket is only shut down, not closed, so the client stays valid for the
+ * rest of the event loop iteration. The owning worker sees EPOLLHUP/EPOLLRDHUP
+ * on its next epoll_wait, or the end of the client's io_uring recv, and runs
+ * the normal disconnection path, which also takes the client out of its room.
+ *
+ * @param client Client to disconnect
+ */
+static void drop_queue_and_disconnect(Client *client) {
+    free_queued_frames(&client->out_queue);
+    client->out_queue.overflowed = true;
+    if (shutdown(client->client_fd, SHUT_RDWR) == -1) {
+        LOG_SERVER_ERROR("Failed to shutdown client fd %d: %s\n", client->client_fd, strerror(errno));
+    }
+}
+
+/**
+ * @brief Frees every frame in the queue and resets it to empty
+ *
+ * @param queue The queue to clear
+ */
+static void free_queued_frames(Output_Queue *queue) {
+    Queued_Frame *queued = queue->head;
+    while (queued != NULL) {
+        Queued_Frame *next = queued->next;
+        free_queued_frame(queued, false);
+        queued = next;
+    }
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->queued_bytes = 0;
+    queue->frames_in_flight = 0;
+}
+
+/**
+ * @brief Frees a queue entry and drops its reference to the frame
+ *
+ * @param queued  The queue entry, already unlinked from the queue
+ * @param written true if the frame's last byte was written to the socket,
+ *                false if it is dropped
+ */
+static void free_queued_frame(Queued_Frame *queued, bool written) {
+    finish_delivery(queued->frame, written);
+    release_frame(queued->frame);
+    free(queued);
+}
+
+/**
+ * @brief Counts the client as done with a timed frame, see expect_deliveries()
+ *
+ * A frame is delivered once its last byte is written to the client's socket,
+ * not when it is queued, so the fan-out latency includes the time it waited
+ * behind the client's backlog. A dropped frame counts as done without being
+ * delivered.
+ *
+ * @param frame   The frame, NULL or not timed for data sent without one
+ * @param written true if the frame reached the socket, false if it is dropped
+ */
+static void finish_delivery(Frame *frame, bool written) {
+    if (frame == NULL) {
+        return;
+    }
+    if (written) {
+        record_first_delivery(frame);
+    }
+    record_deliveries(frame, 1);
+}
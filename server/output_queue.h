@@ -0,0 +1,19 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include "server_config.h"
+#include <stddef.h>
+
+Frame *create_frame(char cmd_type, const char *message);
+void release_frame(Frame *frame);
+
+void init_output_queue(Client *client);
+void send_frame(Client *client, Frame *frame);
+void send_or_queue(Client *client, const char *data, size_t length, char cmd_type);
+void flush_output_queue(Client *client);
+void advance_output_queue(Client *client, size_t bytes);
+void mark_output_pending(Client *client);
+bool output_deadline_passed(const Worker_Thread *thread_context);
+void destroy_output_queue(Client *client);
+
+#endif
@@ -0,0 +1,240 @@
+// Local
+#include "room_list.h"
+
+#include "logger.h"        // For LOG_INFO, LOG_SERVER_ERROR
+#include "output_queue.h"  // For create_frame(), release_frame()
+#include "room_registry.h" // For get_room(), room_id_limit()
+
+// Library
+#include <pthread.h> // For pthread_mutex_lock/unlock
+#include <stdio.h>   // For sprintf
+#include <stdlib.h>  // For calloc, realloc, free
+#include <string.h>  // For memcpy, strcpy
+
+#define LOG_CATEGORY LOG_ROOM // The log level of this category enables the file's log lines
+
+// Bytes of room entries on a page of the room list, leaves space for the line pointing to the next page
+#define ROOM_LIST_PAGE_LEN (MAX_MESSAGE_LEN_FROM_SERVER - 96)
+#define ROOM_LIST_HEADER "=== Available Chat Rooms ===\n\n"
+
+static atomic_ulong room_list_version = 1; // Bumped whenever a room is created or released
+
+// The most recent snapshot, holding a reference of its own. Only the thread rebuilding it takes the lock, reading the
+// room list from a snapshot a worker already holds takes none
+static Room_List_Snapshot *current_snapshot;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Room_List_Snapshot *take_current_snapshot(void);
+static Room_List_Snapshot *build_snapshot(unsigned long version);
+static bool add_page(Room_List_Snapshot *snapshot, int *capacity, const char *page_msg, int first_room_id);
+static void release_snapshot(Room_List_Snapshot *snapshot);
+
+/**
+ * @brief Marks the room list as changed, so the next room list sent is built
+ * from the rooms as they are now
+ *
+ * @note Called after a room is created or released, while the caller still
+ * holds the room's lock
+ */
+void room_list_changed(void) {
+    atomic_fetch_add_explicit(&room_list_version, 1, memory_order_release);
+}
+
+/**
+ * @brief Finds the page of the room list a list request asks for
+ *
+ * As long as no room was created or released, this only compares the room
+ * list version with the one of the snapshot the worker holds and picks the
+ * page, without any lock. Otherwise the worker swaps its snapshot for the
+ * current one, which the first worker to ask after the change rebuilds.
+ *
+ * @param thread_context Worker thread context of the client asking for the list
+ * @param first_room_id  Room id the client wants the page holding
+ *
+ * @return The page's frame, referenced by the worker's snapshot until the
+ * worker takes a newer one, so it must be sent right away with send_frame().
+ * NULL if no snapshot could be built.
+ */
+Frame *get_room_list_page(Worker_Thread *thread_context, int first_room_id) {
+    Room_List_Snapshot *snapshot = thread_context->room_list;
+    if (snapshot == NULL || snapshot->version != atomic_load_explicit(&room_list_version, memory_order_acquire)) {
+        Room_List_Snapshot *current = take_current_snapshot();
+        if (current != NULL) {
+            if (snapshot != NULL) {
+                release_snapshot(snapshot);
+            }
+            thread_context->room_list = current;
+            snapshot = current;
+        }
+    }
+    if (snapshot == NULL) {
+        return NULL;
+    }
+
+    // The last page starting at or before the room id
+    int low = 0;
+    int high = snapshot->num_pages - 1;
+    while (low < high) {
+        const int middle = (low + high + 1) / 2;
+        if (snapshot->pages[middle].first_room_id <= first_room_id) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return snapshot->pages[low].frame;
+}
+
+/**
+ * @brief Takes a reference on the current snapshot, rebuilding it first if a
+ * room was created or released since it was built
+ *
+ * The version is read before the rooms are, so a room changing while the
+ * snapshot is built bumps the version past the snapshot's and the next list
+ * request rebuilds it again.
+ *
+ * @return The current snapshot, possibly an older one if a new one could not
+ * be built, or NULL if there is none
+ */
+static Room_List_Snapshot *take_current_snapshot(void) {
+    pthread_mutex_lock(&snapshot_lock);
+    const unsigned long version = atomic_load_explicit(&room_list_version, memory_order_acquire);
+    if (current_snapshot == NULL || current_snapshot->version != version) {
+        Room_List_Snapshot *snapshot = build_snapshot(version);
+        if (snapshot != NULL) {
+            if (current_snapshot != NULL) {
+                release_snapshot(current_snapshot);
+            }
+            current_snapshot = snapshot;
+        }
+    }
+
+    Room_List_Snapshot *snapshot = current_snapshot;
+    if (snapshot != NULL) {
+        atomic_fetch_add_explicit(&snapshot->ref_count, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return snapshot;
+}
+
+/**
+ * @brief Formats the rooms in use into the pages of a new snapshot
+ *
+ * Each page lists the rooms in use in room id order and fits in
+ * MAX_MESSAGE_LEN_FROM_SERVER. When more rooms follow, a page ends with the
+ * room id the client sends in its next list request to get the next page.
+ *
+ * @param version The room list version read before the rooms
+ *
+ * @return The snapshot with a single reference, or NULL if it could not be
+ * allocated
+ */
+static Room_List_Snapshot *build_snapshot(unsigned long version) {
+    Room_List_Snapshot *snapshot = calloc(1, sizeof(Room_List_Snapshot));
+    if (snapshot == NULL) {
+        LOG_SERVER_ERROR("Could not allocate a room list snapshot\n");
+        return NULL;
+    }
+    atomic_init(&snapshot->ref_count, 1);
+    snapshot->version = version;
+
+    char page_msg[MAX_MESSAGE_LEN_FROM_SERVER] = ROOM_LIST_HEADER;
+    size_t length = strlen(ROOM_LIST_HEADER);
+    int page_first_room_id = 0;
+    int capacity = 0;
+    bool rooms_avail = false;
+    const int room_id_end = room_id_limit();
+
+    for (int i = 0; i < room_id_end; i++) {
+        Room *room = get_room(i);
+        if (room == NULL) { // Chunk still being allocated, none of its rooms is in use yet
+            i += ROOM_CHUNK_SIZE - 1 - i % ROOM_CHUNK_SIZE;
+            continue;
+        }
+        char room_entry[100];
+        int entry_length = 0;
+        pthread_mutex_lock(&room->room_lock);
+        if (room->in_use) {
+            entry_length = sprintf(room_entry, "Room %d: %s\n", i, room->room_name);
+        }
+        pthread_mutex_unlock(&room->room_lock);
+
+        if (entry_length == 0) {
+            continue;
+        }
+        if (length + entry_length >= ROOM_LIST_PAGE_LEN) {
+            sprintf(page_msg + length, "\nMore rooms: send the list command with %d for the next page\n", i);
+            if (!add_page(snapshot, &capacity, page_msg, page_first_room_id)) {
+                release_snapshot(snapshot);
+                return NULL;
+            }
+            page_first_room_id = i;
+            strcpy(page_msg, ROOM_LIST_HEADER);
+            length = strlen(ROOM_LIST_HEADER);
+        }
+        memcpy(page_msg + length, room_entry, entry_length + 1);
+        length += entry_length;
+        rooms_avail = true;
+    }
+
+    if (!rooms_avail) {
+        sprintf(page_msg + length, "No chat rooms available!\nUse the create room command to start "
+                                   "your own chat room.\n");
+    }
+    if (!add_page(snapshot, &capacity, page_msg, page_first_room_id)) {
+        release_snapshot(snapshot);
+        return NULL;
+    }
+    LOG_INFO("Built room list version %lu, %d pages\n", version, snapshot->num_pages);
+    return snapshot;
+}
+
+/**
+ * @brief Formats a page into a frame and appends it to the snapshot
+ *
+ * @param snapshot      The snapshot being built
+ * @param capacity      Pages the snapshot's pages array has space for, updated
+ *                      when the array grows
+ * @param page_msg      Content of the page
+ * @param first_room_id Lowest room id on the page
+ *
+ * @return false if the page could not be allocated
+ */
+static bool add_page(Room_List_Snapshot *snapshot, int *capacity, const char *page_msg, int first_room_id) {
+    if (snapshot->num_pages == *capacity) {
+        const int new_capacity = *capacity == 0 ? 4 : *capacity * 2;
+        Room_List_Page *pages = realloc(snapshot->pages, sizeof(Room_List_Page) * new_capacity);
+        if (pages == NULL) {
+            LOG_SERVER_ERROR("Could not allocate %d room list pages\n", new_capacity);
+            return false;
+        }
+        snapshot->pages = pages;
+        *capacity = new_capacity;
+    }
+
+    Frame *frame = create_frame(CMD_ROOM_LIST_RESPONSE, page_msg);
+    if (frame == NULL) {
+        return false;
+    }
+    snapshot->pages[snapshot->num_pages].frame = frame;
+    snapshot->pages[snapshot->num_pages].first_room_id = first_room_id;
+    snapshot->num_pages++;
+    return true;
+}
+
+/**
+ * @brief Drops a reference to the snapshot, and frees it with its frames if it
+ * was the last one. Frames still queued for clients keep their own reference.
+ *
+ * @param snapshot The snapshot to release
+ */
+static void release_snapshot(Room_List_Snapshot *snapshot) {
+    if (atomic_fetch_sub_explicit(&snapshot->ref_count, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    for (int i = 0; i < snapshot->num_pages; i++) {
+        release_frame(snapshot->pages[i].frame);
+    }
+    free(snapshot->pages);
+    free(snapshot);
+}
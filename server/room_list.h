@@ -0,0 +1,9 @@
+#ifndef ROOM_LIST_H
+#define ROOM_LIST_H
+
+#include "server_config.h"
+
+void room_list_changed(void);
+Frame *get_room_list_page(Worker_Thread *thread_context, int first_room_id);
+
+#endif
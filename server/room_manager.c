@@ -3,234 +3,674 @@
 #include <ctype.h>   // For isdigit()
 #include <stdbool.h> // For bool type
 #include <stdio.h>
-#include <stdlib.h> // For atoi()
-#include <string.h> // For strcpy(), strlen()
+#include <stdlib.h> // For realloc(), free()
+#include <string.h> // For strcmp(), strcpy(), strlen()
 
 #include "client_state_manager.h"
+#include "latency.h"       // For time_fanout(), expect_deliveries()
 #include "logger.h"
+#include "mailbox.h"       // For create_mailbox_message(), post_to_mailbox()
+#include "output_queue.h"  // For create_frame(), release_frame(), send_frame()
+#include "room_list.h"     // For get_room_list_page(), room_list_changed()
+#include "room_registry.h" // For get_room(), claim_room(), find_room_id(), release_room()
+#include "server_limits.h" // For server_limits
+
+#define LOG_CATEGORY LOG_ROOM // The log level of this category enables the file's log lines
 
 /**
- * @brief Helper function to parse and validate the room number from the
- * client's message.
- *
- * Extracts and checks the room number format to ensure it's valid.
+ * @brief Helper function to parse a room id from the content of a client's
+ * message
  *
- * @param client Pointer to the Client structure in the lobby state requesting
- * to join the room
+ * @param content Content of the client's join or list request
  *
- * @return The parsed room number, or -1 if the format is invalid.
- * @NOTE THis function would need to be changed slight, if the max number of rooms exceeds 99 as it can only correctly
- * verify up to 2-digit numbers.
+ * @return The room id, or -1 if the content is not a number of at most 9
+ * digits
  */
-static int parse_room_number(Client *client) {
-    char *room_index = &client->current_msg[2];
-
-    if (!isdigit(*room_index)) {
+static int parse_room_id(const char *content) {
+    int room_id = 0;
+    if (*content == '\0') {
         return -1;
     }
-    // Checks if the number is double-digit
-    if (room_index[1] != '\0') {
-        if (!isdigit(room_index[1]) || room_index[2] != '\0') {
+    for (const char *digit = content; *digit != '\0'; digit++) {
+        if (!isdigit((unsigned char)*digit) || digit - content >= 9) {
             return -1;
         }
+        room_id = room_id * 10 + (*digit - '0');
+    }
+    return room_id;
+}
+
+/**
+ * @brief Makes sure the room's members array has an entry for one more client
+ *
+ * The array starts at ROOM_MEMBERS_MIN entries and doubles, up to
+ * clients_per_room, so a room only takes memory for the clients it has had.
+ *
+ * @param room The room a client joins, with fewer than clients_per_room
+ *             members
+ *
+ * @return false if the array could not be grown
+ *
+ * @note The caller must hold the room's lock, or with ROOM_ACTORS run on the
+ * room's owner
+ */
+static bool reserve_room_member(Room *room) {
+    if (room->num_clients < room->member_capacity) {
+        return true;
+    }
+
+    int capacity = room->member_capacity * 2 > ROOM_MEMBERS_MIN ? room->member_capacity * 2 : ROOM_MEMBERS_MIN;
+    if (capacity > server_limits.clients_per_room) {
+        capacity = server_limits.clients_per_room;
+    }
+    Room_Member *members = realloc(room->members, sizeof(Room_Member) * capacity);
+    if (members == NULL) {
+        LOG_SERVER_ERROR("Could not grow the members of room %d to %d clients\n", room->id, capacity);
+        return false;
+    }
+    room->members = members;
+    room->member_capacity = capacity;
+    return true;
+}
+
+/**
+ * @brief Appends a client to the room's members array
+ *
+ * @param room       The room the client joins, with an entry reserved for it
+ *                   by reserve_room_member()
+ * @param client     The joining client
+ * @param generation The joining client's generation
+ * @param worker     The worker thread owning the joining client
+ *
+ * @note The caller must hold the room's lock, or with ROOM_ACTORS run on the
+ * room's owner. The client's fields are not read, they may belong to another
+ * worker thread.
+ */
+static void add_room_member(Room *room, Client *client, unsigned int generation, Worker_Thread *worker) {
+    Room_Member *member = &room->members[room->num_clients];
+    member->client = client;
+    member->worker = worker;
+    member->generation = generation;
+    atomic_store_explicit(&client->room_member_index, room->num_clients, memory_order_relaxed);
+    room->num_clients++;
+    atomic_store_explicit(&room->member_count, room->num_clients, memory_order_relaxed);
+}
+
+/**
+ * @brief Removes a client from the room's members array, moving the room's
+ * last member into its place
+ *
+ * The client's room_member_index is checked against the members array before
+ * it is trusted, and the array is searched if it does not match. With
+ * ROOM_ACTORS a client can disconnect and its slot be reused before its leave
+ * reaches the owner, and the owner then updates the index of a slot that
+ * already holds another client.
+ *
+ * @param room       The room the client leaves
+ * @param client     The leaving client
+ * @param generation The leaving client's generation
+ *
+ * @return false if the client is not in the room
+ *
+ * @note The caller must hold the room's lock, or with ROOM_ACTORS run on the
+ * room's owner. The moved member's room_member_index is updated even though
+ * it may belong to another worker thread.
+ */
+static bool remove_room_member(Room *room, const Client *client, unsigned int generation) {
+    int index = atomic_load_explicit(&client->room_member_index, memory_order_relaxed);
+    if (index < 0 || index >= room->num_clients || room->members[index].client != client ||
+        room->members[index].generation != generation) {
+        for (index = 0; index < room->num_clients; index++) {
+            if (room->members[index].client == client && room->members[index].generation == generation) {
+                break;
+            }
+        }
+        if (index == room->num_clients) {
+            return false;
+        }
+    }
+
+    room->num_clients--;
+    atomic_store_explicit(&room->member_count, room->num_clients, memory_order_relaxed);
+    if (index != room->num_clients) {
+        room->members[index] = room->members[room->num_clients];
+        atomic_store_explicit(&room->members[index].client->room_member_index, index, memory_order_relaxed);
+    }
+    return true;
+}
+
+/**
+ * @brief Posts a frame to the worker threads of every member of a room but
+ * one
+ *
+ * Nothing is written to a socket here: one message per worker thread that has
+ * members in the room is posted to that worker's mailbox, and each worker
+ * sends the frame to its own clients from its own event loop. A timed client
+ * message learns how many recipients it has before any of them gets it, see
+ * expect_deliveries().
+ *
+ * @param poster The worker thread running this function
+ * @param room   The room to broadcast in
+ * @param frame  The frame to broadcast, every mailbox message takes its own
+ *               reference on it
+ * @param client Member the frame is not sent to, the one it is sent from
+ *
+ * @note The caller must hold the room's lock, or with ROOM_ACTORS run on the
+ * room's owner
+ */
+static void broadcast_frame(Worker_Thread *poster, Room *room, Frame *frame, const Client *client) {
+    // Indexed by worker thread and all zero between broadcasts, only the entries of the workers found are touched
+    int *recipients_per_worker = poster->broadcast_recipients;
+    Mailbox_Message **messages = poster->broadcast_messages;
+    Worker_Thread **workers = poster->broadcast_workers; // The worker threads with recipients, in the order found
+    int num_workers = 0;
+    int recipients = 0;
+
+    for (int i = 0; i < room->num_clients; i++) {
+        const Room_Member *member = &room->members[i];
+        if (member->client != client && recipients_per_worker[member->worker->index]++ == 0) {
+            workers[num_workers++] = member->worker;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        const int index = workers[i]->index;
+        messages[index] = create_mailbox_message(frame, room->id, recipients_per_worker[index]);
+        if (messages[index] != NULL) {
+            recipients += recipients_per_worker[index];
+        }
+    }
+    expect_deliveries(frame, room, recipients);
+
+    for (int i = 0; i < room->num_clients; i++) {
+        const Room_Member *member = &room->members[i];
+        if (member->client != client && messages[member->worker->index] != NULL) {
+            Mailbox_Message *message = messages[member->worker->index];
+            message->recipients[message->num_recipients].client = member->client;
+            message->recipients[message->num_recipients].generation = member->generation;
+            message->num_recipients++;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        const int index = workers[i]->index;
+        if (messages[index] != NULL) {
+            post_to_mailbox(workers[i], messages[index], poster);
+        }
+        recipients_per_worker[index] = 0;
+        messages[index] = NULL;
+    }
+    LOG_INFO("Message broadcast in room %d posted to the worker threads of its members\n", room->id);
+}
+
+/**
+ * @brief Adds a client to a room if it is still in use and has space left, and
+ * tells the room's other members
+ *
+ * @param poster       The worker thread running this function
+ * @param room         The room the client asked to join
+ * @param client       The joining client
+ * @param generation   The joining client's generation
+ * @param worker       The worker thread owning the joining client
+ * @param room_name    Name the client found the room by, empty if it asked for
+ *                     the room's id
+ * @param joined_frame Frame telling the members the client entered the room,
+ *                     or NULL
+ *
+ * @return CMD_ROOM_JOIN_OK, or the error the client gets
+ *
+ * @note The caller must hold the room's lock, or with ROOM_ACTORS run on the
+ * room's owner
+ */
+static char add_client_to_room(Worker_Thread *poster, Room *room, Client *client, unsigned int generation,
+                               Worker_Thread *worker, const char *room_name, Frame *joined_frame) {
+    // A room found by name may have been released, or even created again under another name, since the lookup
+    if (room->in_use == false || (room_name[0] != '\0' && strcmp(room->room_name, room_name) != 0)) {
+        LOG_USER_ERROR("Client attempted to join room %d after it was cleaned up\n", room->id);
+        return ERR_ROOM_NOT_FOUND;
+    }
+
+    if (room->num_clients == server_limits.clients_per_room) {
+        LOG_USER_ERROR("Client attempted to join a full room - %d: %s , Number of clients currently in the room = %d\n",
+                       room->id, room->room_name, room->num_clients);
+        return ERR_ROOM_CAPACITY_FULL;
+    }
+    if (!reserve_room_member(room)) {
+        return ERR_ROOM_CAPACITY_FULL;
+    }
+
+    add_room_member(room, client, generation, worker);
+    if (joined_frame != NULL) {
+        broadcast_frame(poster, room, joined_frame, client);
+    }
+    return CMD_ROOM_JOIN_OK;
+}
+
+/**
+ * @brief Removes a client from a room and tells the room's other members, and
+ * returns the room to the room registry if it is now empty
+ *
+ * @param poster     The worker thread running this function
+ * @param room       The room the client leaves
+ * @param client     The leaving client
+ * @param generation The leaving client's generation
+ * @param left_frame Frame telling the members the client left, or NULL
+ *
+ * @note The caller must hold the room's lock, or with ROOM_ACTORS run on the
+ * room's owner, which then takes the lock only to release the room
+ */
+static void remove_client_from_room(Worker_Thread *poster, Room *room, const Client *client, unsigned int generation,
+                                    Frame *left_frame) {
+    if (!remove_room_member(room, client, generation)) {
+        return;
+    }
+    LOG_INFO("Removed a client from room %d, %d clients remaining\n", room->id, room->num_clients);
+    if (left_frame != NULL) {
+        broadcast_frame(poster, room, left_frame, client);
+    }
+
+    if (room->num_clients == 0) {
+        LOG_INFO("Room %d (%s) is empty, cleaning up\n", room->id, room->room_name);
+        if (ROOM_ACTORS) {
+            pthread_mutex_lock(&room->room_lock);
+        }
+        atomic_store_explicit(&room->owner, NULL, memory_order_relaxed);
+        release_room(room);
+        room_list_changed();
+        if (ROOM_ACTORS) {
+            pthread_mutex_unlock(&room->room_lock);
+        }
     }
-    return atoi(room_index);
 }
+
+/**
+ * @brief Posts a client's room operation to the worker thread owning the room
+ *
+ * @param client      The client the operation is for
+ * @param room        The room the operation is on
+ * @param owner       The worker thread owning the room
+ * @param type        ROOM_JOIN, ROOM_LEAVE or ROOM_SEND
+ * @param frame       Frame the owner broadcasts in the room, or NULL
+ * @param room_name   Name the client found the room by, empty if none
+ * @param wants_reply Whether the owner replies, the client then awaits the
+ *                    reply before its next message is processed. The reply is
+ *                    allocated here, so the owner can always post it
+ *
+ * @return false if the operation or its reply could not be allocated
+ */
+static bool post_room_request(Client *client, const Room *room, Worker_Thread *owner, MAILBOX_MESSAGE_TYPE type,
+                              Frame *frame, const char *room_name, bool wants_reply) {
+    Mailbox_Message *reply_message = NULL;
+    if (wants_reply) {
+        reply_message = create_mailbox_message(NULL, room->id, 1);
+        if (reply_message == NULL) {
+            return false;
+        }
+    }
+    Mailbox_Message *message = create_mailbox_message(frame, room->id, 1);
+    if (message == NULL) {
+        free(reply_message);
+        return false;
+    }
+    message->type = type;
+    message->sender = client->worker;
+    message->reply_message = reply_message;
+    snprintf(message->room_name, sizeof(message->room_name), "%s", room_name);
+    message->recipients[0].client = client;
+    message->recipients[0].generation = client->generation;
+    message->num_recipients = 1;
+
+    client->awaiting_room_reply = wants_reply;
+    post_to_mailbox(owner, message, client->worker);
+    return true;
+}
+
+/**
+ * @brief Posts the owner's answer to a room operation back to the worker
+ * thread of the client that asked for it, in the reply message allocated with
+ * the request
+ *
+ * @param thread_context The owner of the room
+ * @param request        The room operation being answered
+ * @param reply          Command of the answer
+ */
+static void post_room_reply(Worker_Thread *thread_context, const Mailbox_Message *request, char reply) {
+    Mailbox_Message *message = request->reply_message;
+    message->type = ROOM_REPLY;
+    message->reply = reply;
+    message->recipients[0] = request->recipients[0];
+    message->num_recipients = 1;
+    post_to_mailbox(request->sender, message, thread_context);
+}
+
 /**
  * @brief handles a client's request to create a room
  *
  * Initializes a room with the client in it if the following checks do not fail -
  * 1. The room name is less than or equal to MAX_ROOM_NAME_LEN
- * 2. There is currently space for a creation of a room in the array - SERVER_ROOMS
+ * 2. Fewer than server_limits.rooms rooms are in use
+ * 3. The room's members array can be allocated
+ *
+ * The room is taken from the room registry without any global lock, only the
+ * new room's own lock is held while it is set up. The client's worker thread
+ * becomes the room's owner.
  *
  * @param client Pointer to the Client structure requesting the 'creation' of a
  *                room
+ * @param room_name Content of the client's create request
  */
-void create_chat_room(Client *client) {
+void create_chat_room(Client *client, const char *room_name) {
     char success_msg[MAX_MESSAGE_LEN_FROM_SERVER];
-    sprintf(success_msg, "Room created successfully: %s\n", &client->current_msg[2]);
+    sprintf(success_msg, "Room created successfully: %s\n", room_name);
 
-    const char *room_name = &client->current_msg[2];
-    LOG_INFO("Client %s (fd %d) attempting to create room: %s\n", client->name, client->client_fd, room_name);
+    LOG_INFO("Client %s (fd %d) attempting to create room: %s\n", client->cold->name, client->client_fd, room_name);
     if (strlen(room_name) > MAX_ROOM_NAME_LEN) {
-        LOG_USER_ERROR("Client %s (fd %d) provided invalid room name length: %zu\n", client->name, client->client_fd,
+        LOG_USER_ERROR("Client %s (fd %d) provided invalid room name length: %zu\n", client->cold->name, client->client_fd,
                        strlen(room_name));
-        send_message_to_client(client->client_fd, ERR_ROOM_NAME_INVALID,
+        send_message_to_client(client, ERR_ROOM_NAME_INVALID,
                                "Room creation failed: Room name length invalid\n");
         return;
     }
 
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        pthread_mutex_lock(&SERVER_ROOMS[i].room_lock);
-
-        if (!SERVER_ROOMS[i].in_use) {
-            SERVER_ROOMS[i].in_use = true;
-            SERVER_ROOMS[i].num_clients = 1;
-            strcpy(SERVER_ROOMS[i].room_name, room_name);
-            client->room_index = i;
-            SERVER_ROOMS[i].clients[0] = client;
-            client->state = IN_CHAT_ROOM;
-            send_message_to_client(client->client_fd, CMD_ROOM_CREATE_OK, success_msg);
-            LOG_INFO("Room %d: %s - create dby client %s (fd %d)\n", i, room_name, client->name, client->client_fd);
-            pthread_mutex_unlock(&SERVER_ROOMS[i].room_lock);
-            return;
-        }
-        pthread_mutex_unlock(&SERVER_ROOMS[i].room_lock);
+    Room *room = claim_room();
+    if (room == NULL) {
+        send_message_to_client(client, ERR_ROOM_CAPACITY_FULL,
+                               "Room creation failed: Maximum number of rooms reached\n");
+        return;
+    }
+
+    pthread_mutex_lock(&room->room_lock);
+    if (!reserve_room_member(room)) {
+        release_room(room);
+        pthread_mutex_unlock(&room->room_lock);
+        send_message_to_client(client, ERR_ROOM_CAPACITY_FULL, "Room creation failed: Server out of memory\n");
+        return;
     }
-    send_message_to_client(client->client_fd, ERR_ROOM_CAPACITY_FULL,
-                           "Room creation failed: Maximum number of rooms reached\n");
+    room->in_use = true;
+    strcpy(room->room_name, room_name);
+    atomic_store_explicit(&room->owner, client->worker, memory_order_release);
+    add_room_member(room, client, client->generation, client->worker);
+    index_room_name(room);
+    room_list_changed();
+    client->room_index = room->id;
+    client->state = IN_CHAT_ROOM;
+    send_message_to_client(client, CMD_ROOM_CREATE_OK, success_msg);
+    LOG_INFO("Room %d: %s - created by client %s (fd %d)\n", room->id, room_name, client->cold->name, client->client_fd);
+    pthread_mutex_unlock(&room->room_lock);
 }
 
 /**
- * @brief Sends a list of the currently available(running) rooms on the server
+ * @brief Sends a page of the currently available(running) rooms on the server
  * that the client can join
  *
- * @param client Pointer to the Client structure requesting the list of rooms
+ * The pages are formatted once per change to the rooms and shared by every
+ * client listing them, so listing the rooms takes no room lock and costs a
+ * single send of the page's frame.
+ *
+ * @param client     Pointer to the Client structure requesting the list of rooms
+ * @param first_room Content of the client's list request, the room id the page
+ *                   holds. The first page is sent if it is NULL or not a
+ *                   number.
+ * @see get_room_list_page() in room_list.c
  */
-void send_avail_rooms(const Client *client) {
-    char room_list_msg[MAX_MESSAGE_LEN_FROM_SERVER] = "=== Available Chat Rooms ===\n\n";
-    bool rooms_avail = false;
-    LOG_INFO("Sending the list of rooms to client %s (fd %d)\n", client->name, client->client_fd);
+void send_avail_rooms(Client *client, const char *first_room) {
+    const int parsed_room_id = first_room != NULL ? parse_room_id(first_room) : -1;
+    const int first_room_id = parsed_room_id != -1 ? parsed_room_id : 0;
+    LOG_INFO("Sending the list of rooms from room %d to client %s (fd %d)\n", first_room_id, client->cold->name,
+             client->client_fd);
 
-    for (int i = 0; i < MAX_ROOMS; i++) {
-        pthread_mutex_lock(&SERVER_ROOMS[i].room_lock);
-        if (SERVER_ROOMS[i].in_use == true) {
-            char room_entry[100];
-            sprintf(room_entry, "Room %d: %s\n", i, SERVER_ROOMS[i].room_name);
-            strcat(room_list_msg, room_entry);
-            rooms_avail = true;
-        }
-        pthread_mutex_unlock(&SERVER_ROOMS[i].room_lock);
-    }
-
-    if (!rooms_avail) {
-        LOG_INFO("Sending empty room list to client %s (fd %d)\n", client->name, client->client_fd);
-        sprintf(room_list_msg + strlen(room_list_msg), "No chat rooms available!\nUse the create room command to start "
-                                                       "your own chat room.\n");
+    Frame *page = get_room_list_page(client->worker, first_room_id);
+    if (page == NULL) {
+        send_message_to_client(client, CMD_ROOM_LIST_RESPONSE, "Room list unavailable, try again later\n");
+        return;
     }
-    LOG_INFO("Sending Room list: %s \nto client%s (fd %d)\n", room_list_msg, client->name, client->client_fd);
-    send_message_to_client(client->client_fd, CMD_ROOM_LIST_RESPONSE, room_list_msg);
+    send_frame(client, page);
 }
 
 /**
- * @brief Removes a client from a specified room and updates the room's state.
+ * @brief Removes a client from the room it is in, or is waiting to join with
+ * ROOM_ACTORS, and updates the room's state.
  *
  * This function removes the client from the room, broadcasts a message
- * notifying other clients in the room, and cleans up the room's resources there
- * are no more clients in it.
+ * notifying other clients in the room, and returns the room to the room
+ * registry if there are no more clients in it.
  *
- * @param client Pointer to the Client structure being removed from the room.
- * @param room_index The index of the room in the SERVER_ROOMS array.
+ * With ROOM_ACTORS a client on another worker thread than the room's owner
+ * posts the leave to the owner instead. If the client is notified, it then
+ * returns to the lobby once the owner replies.
  *
- * @note The caller must ensure `room_index` is valid and corresponds to an
- * existing room.
+ * @param client        Pointer to the Client structure being removed from the
+ *                      room, its room_index is the room it leaves
+ * @param notify_client Whether the client gets CMD_ROOM_LEAVE_OK and returns to
+ *                      the lobby, false when it disconnects
  */
-void leave_room(Client *client, int room_index) {
-    LOG_INFO("Client %s (fd %d) left room %d (%s)\n", client->name, client->client_fd, room_index,
-             SERVER_ROOMS[room_index].room_name);
-    pthread_mutex_lock(&SERVER_ROOMS[room_index].room_lock);
+void leave_room(Client *client, bool notify_client) {
+    const int room_index = client->room_index;
+    Room *room = get_room(room_index);
+    LOG_INFO("Client %s (fd %d) left room %d\n", client->cold->name, client->client_fd, room_index);
 
     char client_left_msg[MAX_MESSAGE_LEN_FROM_SERVER];
-    sprintf(client_left_msg, "%s left the room\n", client->name);
+    sprintf(client_left_msg, "%s left the room\n", client->cold->name);
+    Frame *left_frame = create_frame(CMD_ROOM_MSG, client_left_msg);
 
-    for (int i = 0; i < MAX_CLIENTS_ROOM; i++) {
-        if (SERVER_ROOMS[room_index].clients[i] == client) {
-            SERVER_ROOMS[room_index].clients[i] = NULL;
-            SERVER_ROOMS[room_index].num_clients--;
-            break;
+    if (!ROOM_ACTORS) {
+        pthread_mutex_lock(&room->room_lock);
+        remove_client_from_room(client->worker, room, client, client->generation, left_frame);
+        pthread_mutex_unlock(&room->room_lock);
+    } else {
+        Worker_Thread *owner = atomic_load_explicit(&room->owner, memory_order_acquire);
+        if (owner == client->worker) {
+            remove_client_from_room(owner, room, client, client->generation, left_frame);
+        } else if (owner != NULL && post_room_request(client, room, owner, ROOM_LEAVE, left_frame, "", notify_client)) {
+            notify_client = false; // The owner's reply returns the client to the lobby
         }
     }
-    LOG_INFO("Removed client %s (fd %d) from room %d, %d clients remaining\n", client->name, client->client_fd,
-             room_index, SERVER_ROOMS[room_index].num_clients);
-    broadcast_message_in_room(client_left_msg, room_index, client);
 
-    if (SERVER_ROOMS[room_index].num_clients == 0) {
-        LOG_INFO("Room %d (%s) is empty, cleaning up\n", room_index, SERVER_ROOMS[room_index].room_name);
-        memset(SERVER_ROOMS[room_index].room_name, 0, sizeof(SERVER_ROOMS[room_index].room_name));
-        memset(SERVER_ROOMS[room_index].clients, 0, sizeof(SERVER_ROOMS[room_index].clients));
-        SERVER_ROOMS[room_index].in_use = false;
+    if (left_frame != NULL) {
+        release_frame(left_frame);
+    }
+    if (notify_client) {
+        apply_room_reply(client, CMD_ROOM_LEAVE_OK, room_index);
     }
-    pthread_mutex_unlock(&SERVER_ROOMS[room_index].room_lock);
 }
 
 /**
  * @brief Broadcasts a message to all clients in the specified chat room.
  *
+ * The CMD_ROOM_MSG frame is formatted once and shared between all recipients,
+ * and posted to the worker threads of the room's members. This keeps the room
+ * lock held only for building the recipient lists, and keeps all socket
+ * writes on the thread owning the socket.
+ *
  * @param msg        The message to broadcast
- * @param room_index The index of the chat room in the SERVER_ROOMS array.
+ * @param room_index The id of the chat room in the room registry.
  * @param client      Client the message is being sent from. The message being
  * broadcast is not send to this client.
  *
- * @note The caller must acquire the room's lock
- * (SERVER_ROOMS[room_index].room_lock) before calling this function to ensure
- * thread safety.
+ * @note The caller must acquire the room's lock (get_room(room_index)->room_lock)
+ * before calling this function to ensure thread safety.
+ * @see deliver_mailbox_messages() in mailbox.c
  */
-void broadcast_message_in_room(const char *msg, const int room_index, const Client *client) {
-    LOG_INFO("Broadcasting message in room %d (%s): %s\n", room_index, SERVER_ROOMS[room_index].room_name, msg);
+static void broadcast_message_in_room(const char *msg, const int room_index, const Client *client) {
+    Room *room = get_room(room_index);
+    LOG_INFO("Broadcasting message in room %d (%s): %s\n", room_index, room->room_name, msg);
 
-    for (int i = 0; i < MAX_CLIENTS_ROOM; i++) {
-        if (SERVER_ROOMS[room_index].clients[i] != NULL && SERVER_ROOMS[room_index].clients[i] != client) {
-            send_message_to_client(SERVER_ROOMS[room_index].clients[i]->client_fd, CMD_ROOM_MSG, msg);
-        }
+    Frame *frame = create_frame(CMD_ROOM_MSG, msg);
+    if (frame == NULL) {
+        return;
     }
-    LOG_INFO("Message broadcasted to all clients in room %d\n", room_index);
+    time_fanout(frame, client->worker);
+    broadcast_frame(client->worker, room, frame, client);
+    release_frame(frame);
+}
+
+/**
+ * @brief Sends a client's message to the other clients in its room
+ *
+ * Without ROOM_ACTORS the message is broadcast under the room's lock. With
+ * ROOM_ACTORS the frame is formatted here and broadcast by the room's owner,
+ * right away if that is the client's own worker thread, otherwise once the
+ * owner takes it from its mailbox. Either way every broadcast in a room is
+ * posted by one thread at a time, so all members get them in the same order.
+ *
+ * @param client The client sending the message, in a chat room
+ * @param msg    The message, already prefixed with the client's name
+ */
+void send_room_message(Client *client, const char *msg) {
+    Room *room = get_room(client->room_index);
+    if (!ROOM_ACTORS) {
+        pthread_mutex_lock(&room->room_lock);
+        broadcast_message_in_room(msg, client->room_index, client);
+        pthread_mutex_unlock(&room->room_lock);
+        return;
+    }
+
+    Frame *frame = create_frame(CMD_ROOM_MSG, msg);
+    if (frame == NULL) {
+        return;
+    }
+    time_fanout(frame, client->worker);
+    Worker_Thread *owner = atomic_load_explicit(&room->owner, memory_order_acquire);
+    if (owner == client->worker) {
+        broadcast_frame(owner, room, frame, client);
+    } else if (owner != NULL) {
+        post_room_request(client, room, owner, ROOM_SEND, frame, "", false);
+    }
+    release_frame(frame);
 }
 
 /**
  * @brief Handles a client's request to join a chat room.
  *
- * Parses the requested room number, validates the room's existence and
- * availability, and adds the client to the room. Broadcasts a join message to
- * other clients in the room and notifies the client of success or failure.
+ * The room is looked up by its id if the request is a number, by its name
+ * otherwise. Validates the room's existence and availability, and adds the
+ * client to the room. Broadcasts a join message to other clients in the room
+ * and notifies the client of success or failure.
+ *
+ * With ROOM_ACTORS a client on another worker thread than the room's owner
+ * posts the join to the owner, and is notified once the owner replies.
  *
  * @param client Pointer to the Client structure representing the client
  * requesting to join.
+ * @param room_request Content of the client's join request, a room id or a
+ * room name
  */
-void join_chat_room(Client *client) {
-    char client_room_join_msg[MAX_MESSAGE_LEN_FROM_SERVER];
-    sprintf(client_room_join_msg, "%s has entered the room\n", client->name);
-    int room_index = parse_room_number(client);
+void join_chat_room(Client *client, const char *room_request) {
+    int room_index = parse_room_id(room_request);
+    const bool by_name = room_index == -1;
+    if (by_name) {
+        room_index = find_room_id(room_request);
+    }
 
-    if (room_index == -1 || room_index >= MAX_ROOMS) {
-        LOG_USER_ERROR("Client %s (fd %d) provided invalid room number for joining\n", client->name, client->client_fd);
-        send_message_to_client(client->client_fd, ERR_ROOM_NOT_FOUND,
-                               "Invalid room number format. Must be a number between 0-49\n");
+    Room *room = get_room(room_index);
+    if (room == NULL) {
+        LOG_USER_ERROR("Client %s (fd %d) attempted to join non-existent room %s\n", client->cold->name, client->client_fd,
+                       room_request);
+        apply_room_reply(client, ERR_ROOM_NOT_FOUND, room_index);
         return;
     }
-    LOG_INFO("Client %s (fd %d) requested to join room %d\n", client->name, client->client_fd, room_index);
+    LOG_INFO("Client %s (fd %d) requested to join room %d\n", client->cold->name, client->client_fd, room_index);
 
-    pthread_mutex_lock(&SERVER_ROOMS[room_index].room_lock);
-    if (SERVER_ROOMS[room_index].in_use == false) {
-        LOG_USER_ERROR("Client %s (fd %d) attempted to join non-existent room %d\n", client->name, client->client_fd,
-                       room_index);
-        send_message_to_client(client->client_fd, ERR_ROOM_NOT_FOUND, "Room does not exist\n");
-        pthread_mutex_unlock(&SERVER_ROOMS[room_index].room_lock);
-        return;
+    char client_room_join_msg[MAX_MESSAGE_LEN_FROM_SERVER];
+    sprintf(client_room_join_msg, "%s has entered the room\n", client->cold->name);
+    Frame *joined_frame = create_frame(CMD_ROOM_MSG, client_room_join_msg);
+    const char *room_name = by_name ? room_request : "";
+
+    if (!ROOM_ACTORS) {
+        pthread_mutex_lock(&room->room_lock);
+        const char reply = add_client_to_room(client->worker, room, client, client->generation, client->worker,
+                                              room_name, joined_frame);
+        apply_room_reply(client, reply, room_index);
+        pthread_mutex_unlock(&room->room_lock);
+    } else {
+        Worker_Thread *owner = atomic_load_explicit(&room->owner, memory_order_acquire);
+        if (owner == client->worker) {
+            const char reply = add_client_to_room(owner, room, client, client->generation, owner, room_name,
+                                                  joined_frame);
+            apply_room_reply(client, reply, room_index);
+        } else if (owner != NULL && post_room_request(client, room, owner, ROOM_JOIN, joined_frame, room_name, true)) {
+            client->room_index = room_index; // Left again if the client disconnects before the owner replies
+        } else {
+            apply_room_reply(client, ERR_ROOM_NOT_FOUND, room_index);
+        }
     }
 
-    if (SERVER_ROOMS[room_index].num_clients == MAX_CLIENTS_ROOM) {
-        LOG_USER_ERROR("Client %s (fd %d) attempted to join a full room - %d: %s , "
-                       "Number of clients "
-                       "currently in the room = %d\n",
-                       client->name, client->client_fd, room_index, SERVER_ROOMS[room_index].room_name,
-                       SERVER_ROOMS[room_index].num_clients);
-        send_message_to_client(client->client_fd, ERR_ROOM_CAPACITY_FULL, "Cannot join room: Room is full\n");
-        pthread_mutex_unlock(&SERVER_ROOMS[room_index].room_lock);
-        return;
+    if (joined_frame != NULL) {
+        release_frame(joined_frame);
     }
+}
+
+/**
+ * @brief Applies the outcome of a client's join or leave request to the client
+ * and tells the client about it
+ *
+ * @param client     The client that asked to join or leave a room
+ * @param reply      CMD_ROOM_JOIN_OK, CMD_ROOM_LEAVE_OK or the join's error
+ * @param room_index The room the client asked to join or leave
+ */
+void apply_room_reply(Client *client, char reply, int room_index) {
+    switch (reply) {
+    case CMD_ROOM_JOIN_OK:
+        send_message_to_client(client, CMD_ROOM_JOIN_OK, "Successfully joined room\n");
+        client->state = IN_CHAT_ROOM;
+        client->room_index = room_index;
+        LOG_INFO("Client %s (fd %d) joined room %d\n", client->cold->name, client->client_fd, room_index);
+        break;
+    case CMD_ROOM_LEAVE_OK:
+        send_message_to_client(client, CMD_ROOM_LEAVE_OK, "You have left the room\n");
+        client->state = IN_CHAT_LOBBY;
+        LOG_INFO("Client %s (fd %d) returned to lobby state\n", client->cold->name, client->client_fd);
+        break;
+    case ERR_ROOM_CAPACITY_FULL:
+        send_message_to_client(client, ERR_ROOM_CAPACITY_FULL, "Cannot join room: Room is full\n");
+        break;
+    default:
+        send_message_to_client(client, ERR_ROOM_NOT_FOUND, "Room does not exist\n");
+        break;
+    }
+}
 
-    for (int i = 0; i < MAX_CLIENTS_ROOM; i++) {
-        if (SERVER_ROOMS[room_index].clients[i] == NULL) {
-            SERVER_ROOMS[room_index].clients[i] = client;
-            SERVER_ROOMS[room_index].num_clients++;
-            LOG_INFO("Client %s (fd %d) joined room- %d: (%s)\n", client->name, client->client_fd, room_index,
-                     SERVER_ROOMS[room_index].room_name);
-            broadcast_message_in_room(client_room_join_msg, room_index, client);
-            send_message_to_client(client->client_fd, CMD_ROOM_JOIN_OK, "Successfully joined room\n");
-            client->state = IN_CHAT_ROOM;
-            client->room_index = room_index;
-            break;
+/**
+ * @brief Runs a room operation posted to the worker thread owning the room,
+ * with ROOM_ACTORS
+ *
+ * Only the owner changes a room's members, so no lock is taken. An operation
+ * reaching a worker that no longer owns the room, because the room was
+ * released before the operation arrived, is answered as if the room did not
+ * exist.
+ *
+ * @param thread_context The worker thread the operation was posted to
+ * @param message        A ROOM_JOIN, ROOM_LEAVE or ROOM_SEND message
+ */
+void handle_room_operation(Worker_Thread *thread_context, const Mailbox_Message *message) {
+    Room *room = get_room(message->room_index);
+    const Mailbox_Recipient *requester = &message->recipients[0];
+    const bool owned = room != NULL && atomic_load_explicit(&room->owner, memory_order_acquire) == thread_context;
+    char reply = ERR_ROOM_NOT_FOUND;
+
+    switch (message->type) {
+    case ROOM_JOIN:
+        if (owned) {
+            reply = add_client_to_room(thread_context, room, requester->client, requester->generation,
+                                       message->sender, message->room_name, message->frame);
         }
+        break;
+    case ROOM_LEAVE:
+        if (owned) {
+            remove_client_from_room(thread_context, room, requester->client, requester->generation, message->frame);
+        }
+        reply = CMD_ROOM_LEAVE_OK;
+        break;
+    case ROOM_SEND:
+        if (owned) {
+            broadcast_frame(thread_context, room, message->frame, requester->client);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (message->reply_message != NULL) {
+        post_room_reply(thread_context, message, reply);
     }
-    pthread_mutex_unlock(&SERVER_ROOMS[room_index].room_lock);
 }
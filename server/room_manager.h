@@ -2,10 +2,12 @@
 #define ROOM_MANAGER_H
 
 #include "server_config.h"
-void create_chat_room(Client *client);
+void create_chat_room(Client *client, const char *room_name);
 
-void join_chat_room(Client *client);
-void send_avail_rooms(const Client *client);
-void broadcast_message_in_room(const char *msg, int room_index, const Client *client);
-void leave_room(Client *client, int room_index);
-#endif
\ No newline at end of file
+void join_chat_room(Client *client, const char *room_request);
+void send_avail_rooms(Client *client, const char *first_room);
+void send_room_message(Client *client, const char *msg);
+void leave_room(Client *client, bool notify_client);
+void apply_room_reply(Client *client, char reply, int room_index);
+void handle_room_operation(Worker_Thread *thread_context, const Mailbox_Message *message);
+#endif
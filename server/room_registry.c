@@ -0,0 +1,303 @@
+// Local
+#include "room_registry.h"
+
+#include "logger.h"        // For LOG_INFO, LOG_SERVER_ERROR, print_erro_n_exit()
+#include "server_limits.h" // For server_limits
+
+// Library
+#include <stdint.h> // For uint32_t, uint64_t
+#include <stdlib.h> // For calloc, free
+#include <string.h> // For memset, strcmp
+
+#define LOG_CATEGORY LOG_ROOM // The log level of this category enables the file's log lines
+
+// Rooms are allocated ROOM_CHUNK_SIZE at a time, the first time one of the chunk's ids is handed out. Chunks are never
+// freed, so a Room pointer stays valid for the lifetime of the process even after the room is released. Holds
+// server_limits.rooms / ROOM_CHUNK_SIZE chunks, rounded up
+static _Atomic(Room *) *room_chunks;
+static atomic_int next_unused_room_id; // Every id below this one has been handed out at least once
+
+// Lock-free stack of released room ids. The low 32 bits hold the id on top plus one, 0 when the stack is empty.
+// The high 32 bits count the changes to the stack, so a pop fails if the same id was popped and pushed back meanwhile
+static _Atomic uint64_t free_room_ids;
+
+// Rooms in use, hashed by name. Each bucket is a list linked through Room.name_next, guarded by one of name_locks
+static Room **name_buckets;
+static size_t name_bucket_mask;
+static pthread_mutex_t name_locks[ROOM_NAME_LOCKS];
+
+static Room *get_or_allocate_room(int room_id);
+static int pop_free_room_id(void);
+static void push_free_room_id(Room *room);
+static int take_unused_room_id(void);
+static size_t name_bucket(const char *room_name);
+
+/**
+ * @brief Sets up the room chunk table and the room name index. No room is
+ * allocated until the first one is created.
+ *
+ * The name index gets a bucket per room the server can hold, rounded up to a
+ * power of two, so a lookup by name stays O(1) with every room in use.
+ *
+ * @note Must be called after load_server_limits(). This function will exit the
+ * program if the tables cannot be allocated
+ */
+void init_room_registry(void) {
+    const int num_chunks = (server_limits.rooms + ROOM_CHUNK_SIZE - 1) / ROOM_CHUNK_SIZE;
+    room_chunks = calloc(num_chunks, sizeof(room_chunks[0]));
+    if (room_chunks == NULL) {
+        print_erro_n_exit("Could not allocate the room chunk table in init_room_registry");
+    }
+
+    size_t num_buckets = ROOM_NAME_LOCKS;
+    while (num_buckets < (size_t)server_limits.rooms) {
+        num_buckets <<= 1;
+    }
+    name_buckets = calloc(num_buckets, sizeof(Room *));
+    if (name_buckets == NULL) {
+        print_erro_n_exit("Could not allocate the room name index in init_room_registry");
+    }
+    name_bucket_mask = num_buckets - 1;
+
+    for (int i = 0; i < ROOM_NAME_LOCKS; i++) {
+        if (pthread_mutex_init(&name_locks[i], NULL) != 0) {
+            print_erro_n_exit("Failed to initialize a room name index mutex in init_room_registry");
+        }
+    }
+    LOG_INFO("Room registry ready for up to %d rooms, %zu name buckets\n", server_limits.rooms, num_buckets);
+}
+
+/**
+ * @brief Looks up a room by its id. Safe to call from any thread without a
+ * lock.
+ *
+ * @param room_id Id of the room, as sent by clients in join requests
+ *
+ * @return The room, or NULL if no room with this id was ever allocated. A room
+ * that is returned may not be in use, callers check in_use under the room lock.
+ */
+Room *get_room(int room_id) {
+    if (room_id < 0 || room_id >= server_limits.rooms) {
+        return NULL;
+    }
+    Room *chunk = atomic_load_explicit(&room_chunks[room_id / ROOM_CHUNK_SIZE], memory_order_acquire);
+    return chunk != NULL ? &chunk[room_id % ROOM_CHUNK_SIZE] : NULL;
+}
+
+/**
+ * @brief Upper bound of the room ids handed out so far, for walking every room
+ * with get_room()
+ *
+ * @return One more than the highest room id that can currently be in use
+ */
+int room_id_limit(void) {
+    return atomic_load_explicit(&next_unused_room_id, memory_order_acquire);
+}
+
+/**
+ * @brief Takes a free room out of the registry for a new room to be created
+ * in. Lock-free.
+ *
+ * The id of the most recently released room is reused first, a new id is only
+ * handed out when none is free, and a new chunk of rooms is only allocated when
+ * that id is the first of its chunk.
+ *
+ * @return A room that is not in use, or NULL if server_limits.rooms rooms are
+ * in use or the room could not be allocated. The caller sets the room up under
+ * its lock and then adds it to the name index with index_room_name().
+ */
+Room *claim_room(void) {
+    int room_id = pop_free_room_id();
+    if (room_id == -1) {
+        room_id = take_unused_room_id();
+    }
+    if (room_id == -1) {
+        return NULL;
+    }
+    return get_or_allocate_room(room_id);
+}
+
+/**
+ * @brief Adds a room that was just set up to the name index, so it can be
+ * joined by name
+ *
+ * @param room Room in use with its room_name set
+ *
+ * @note The caller must hold the room's lock
+ */
+void index_room_name(Room *room) {
+    const size_t bucket = name_bucket(room->room_name);
+    pthread_mutex_t *lock = &name_locks[bucket & (ROOM_NAME_LOCKS - 1)];
+
+    pthread_mutex_lock(lock);
+    room->name_next = name_buckets[bucket];
+    name_buckets[bucket] = room;
+    pthread_mutex_unlock(lock);
+}
+
+/**
+ * @brief Looks up a room in use by its name
+ *
+ * Room names are not unique, if several rooms share the name the most recently
+ * created one is found.
+ *
+ * @param room_name Name of the room
+ *
+ * @return The id of the room, or -1 if no room in use has this name. The room
+ * can be released as soon as this returns, callers check under the room lock
+ * that it is still in use and still has this name.
+ */
+int find_room_id(const char *room_name) {
+    const size_t bucket = name_bucket(room_name);
+    pthread_mutex_t *lock = &name_locks[bucket & (ROOM_NAME_LOCKS - 1)];
+    int room_id = -1;
+
+    pthread_mutex_lock(lock);
+    for (const Room *room = name_buckets[bucket]; room != NULL; room = room->name_next) {
+        if (strcmp(room->room_name, room_name) == 0) {
+            room_id = room->id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return room_id;
+}
+
+/**
+ * @brief Returns an empty room to the registry: removes it from the name index,
+ * clears it and pushes its id on the free id stack
+ *
+ * @param room The room whose last client just left
+ *
+ * @note The caller must hold the room's lock
+ */
+void release_room(Room *room) {
+    const size_t bucket = name_bucket(room->room_name);
+    pthread_mutex_t *lock = &name_locks[bucket & (ROOM_NAME_LOCKS - 1)];
+
+    pthread_mutex_lock(lock);
+    for (Room **link = &name_buckets[bucket]; *link != NULL; link = &(*link)->name_next) {
+        if (*link == room) {
+            *link = room->name_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    memset(room->room_name, 0, sizeof(room->room_name));
+    room->name_next = NULL;
+    room->num_clients = 0;
+    room->in_use = false;
+    atomic_store_explicit(&room->hot_latency, NULL, memory_order_relaxed); // Its slot is freed at the next ranking
+    push_free_room_id(room);
+}
+
+/**
+ * @brief Returns the room with the given id, allocating its chunk if this is
+ * the first id of the chunk handed out
+ *
+ * Two threads can race to allocate the same chunk, the one that loses frees
+ * its copy and uses the winner's.
+ *
+ * @param room_id A room id taken from the free stack or not handed out before
+ *
+ * @return The room, or NULL if its chunk could not be allocated. The id is then
+ * lost, the other ids of the chunk allocate it again when they are handed out.
+ */
+static Room *get_or_allocate_room(int room_id) {
+    Room *room = get_room(room_id);
+    if (room != NULL) {
+        return room;
+    }
+
+    const int chunk_index = room_id / ROOM_CHUNK_SIZE;
+    Room *chunk = calloc(ROOM_CHUNK_SIZE, sizeof(Room));
+    if (chunk == NULL) {
+        LOG_SERVER_ERROR("Could not allocate rooms %d to %d\n", chunk_index * ROOM_CHUNK_SIZE,
+                         (chunk_index + 1) * ROOM_CHUNK_SIZE - 1);
+        return NULL;
+    }
+    for (int i = 0; i < ROOM_CHUNK_SIZE; i++) {
+        pthread_mutex_init(&chunk[i].room_lock, NULL);
+        chunk[i].id = chunk_index * ROOM_CHUNK_SIZE + i;
+        atomic_init(&chunk[i].next_free_id, -1);
+    }
+
+    Room *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&room_chunks[chunk_index], &expected, chunk, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        for (int i = 0; i < ROOM_CHUNK_SIZE; i++) {
+            pthread_mutex_destroy(&chunk[i].room_lock);
+        }
+        free(chunk);
+        chunk = expected;
+    } else {
+        LOG_INFO("Allocated rooms %d to %d\n", chunk_index * ROOM_CHUNK_SIZE, (chunk_index + 1) * ROOM_CHUNK_SIZE - 1);
+    }
+    return &chunk[room_id % ROOM_CHUNK_SIZE];
+}
+
+/**
+ * @brief Pops the id of a released room off the free id stack
+ *
+ * @return The id, or -1 if no released room is waiting to be reused
+ */
+static int pop_free_room_id(void) {
+    uint64_t head = atomic_load_explicit(&free_room_ids, memory_order_acquire);
+    while ((uint32_t)head != 0) {
+        const int room_id = (int)(uint32_t)head - 1;
+        const int below = atomic_load_explicit(&get_room(room_id)->next_free_id, memory_order_relaxed);
+        const uint64_t new_head = (((head >> 32) + 1) << 32) | (uint32_t)(below + 1);
+        if (atomic_compare_exchange_weak_explicit(&free_room_ids, &head, new_head, memory_order_acquire,
+                                                  memory_order_acquire)) {
+            return room_id;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Pushes the id of a released room on the free id stack
+ *
+ * @param room The released room
+ */
+static void push_free_room_id(Room *room) {
+    uint64_t head = atomic_load_explicit(&free_room_ids, memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        atomic_store_explicit(&room->next_free_id, (int)(uint32_t)head - 1, memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | (uint32_t)(room->id + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&free_room_ids, &head, new_head, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/**
+ * @brief Hands out the lowest room id that was never used
+ *
+ * @return The id, or -1 if all server_limits.rooms ids have been handed out
+ */
+static int take_unused_room_id(void) {
+    int room_id = atomic_load_explicit(&next_unused_room_id, memory_order_relaxed);
+    do {
+        if (room_id >= server_limits.rooms) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&next_unused_room_id, &room_id, room_id + 1, memory_order_release,
+                                                    memory_order_relaxed));
+    return room_id;
+}
+
+/**
+ * @brief Hashes a room name to its bucket in the name index (FNV-1a)
+ *
+ * @param room_name Name of the room
+ *
+ * @return Index of the name's bucket
+ */
+static size_t name_bucket(const char *room_name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)room_name; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 1099511628211ULL;
+    }
+    return (size_t)hash & name_bucket_mask;
+}
@@ -0,0 +1,14 @@
+#ifndef ROOM_REGISTRY_H
+#define ROOM_REGISTRY_H
+
+#include "server_config.h"
+
+void init_room_registry(void);
+Room *get_room(int room_id);
+int room_id_limit(void);
+Room *claim_room(void);
+void index_room_name(Room *room);
+int find_room_id(const char *room_name);
+void release_room(Room *room);
+
+#endif
@@ -4,15 +4,143 @@
 #include <pthread.h>
 
 #include "protocol.h"
-#include "semaphore.h"
 #include "stdbool.h"
-// MAX Worker THREADS NEEDED
-#define MAX_THREADS 4
-#define MAX_CLIENTS_PER_THREAD 1500 // How many client does each thread handles
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+// Capacity of the server, set at startup from the command line or LIMITS_CONFIG_FILE, see server_limits.c. These are
+// the defaults, the number of worker threads defaults to the number of online cores
+#ifndef DEFAULT_CLIENTS_PER_THREAD
+#define DEFAULT_CLIENTS_PER_THREAD 1500 // How many client does each thread handles
+#endif
+#ifndef DEFAULT_CLIENTS_PER_ROOM
+#define DEFAULT_CLIENTS_PER_ROOM 120 // Max clients per room
+#endif
+#ifndef DEFAULT_ROOMS
+#define DEFAULT_ROOMS 50 // Max rooms open at the same time, make ROOMS=... to change
+#endif
+#define MAX_WORKER_THREADS 1024    // Most worker threads the server can be started with
+#define MAX_SERVER_LIMIT (1 << 24) // Most clients per thread, rooms or clients per room
+#ifndef LIMITS_CONFIG_FILE
+#define LIMITS_CONFIG_FILE "server_limits.conf" // Relative to the directory the server is started in
+#endif
+
+// Rooms are allocated in chunks as they are created, so only the rooms in use cost memory
+#define ROOM_CHUNK_SIZE 64 // Rooms allocated together when the room registry grows
+#define ROOM_NAME_LOCKS 64 // Mutexes striped over the buckets of the room name index, must be a power of two
+#define ROOM_MEMBERS_MIN 8 // Member entries a room gets when it is first used, doubled whenever it fills up
+
+// Each room is owned by the worker thread of the client that created it, and joins, leaves and messages of clients
+// on other workers are posted to the owner's mailbox instead of taking the room's lock. make ROOM_ACTORS=1 to enable
+#ifndef ROOM_ACTORS
+#define ROOM_ACTORS 0
+#endif
+
+#define CACHE_LINE_SIZE 64
+#define MEMORY_PAGE_SIZE 4096 // Memory is placed on a NUMA node a page at a time
+
+// Client sockets are registered edge triggered and read until EAGAIN, make EDGE_TRIGGERED=0 for level triggered reads
+#ifndef EDGE_TRIGGERED_READS
+#define EDGE_TRIGGERED_READS 1
+#endif
+#ifndef WORKER_RECV_BUFFER_SIZE
+#define WORKER_RECV_BUFFER_SIZE (16 * 1024) // Bytes read from a client socket per recv
+#endif
+#ifndef CLIENT_READ_BUDGET
+#define CLIENT_READ_BUDGET (64 * 1024) // Most bytes read from one client per epoll loop iteration
+#endif
+
+// Event loop a worker thread runs its clients with, make BACKEND=uring for io_uring (Linux 6.0 or newer)
+#define BACKEND_EPOLL 0 // epoll_loop.c
+#define BACKEND_URING 1 // uring_loop.c
+#ifndef WORKER_BACKEND
+#define WORKER_BACKEND BACKEND_EPOLL
+#endif
+#ifndef URING_QUEUE_DEPTH
+#define URING_QUEUE_DEPTH 4096 // Submission queue entries of a worker's io_uring, its completion queue has 4 times more
+#endif
+#ifndef URING_RECV_BUFFERS
+#define URING_RECV_BUFFERS 512 // Buffers in a worker's provided buffer ring, must be a power of two
+#endif
+#ifndef URING_RECV_BUFFER_SIZE
+#define URING_RECV_BUFFER_SIZE 4096 // Bytes the kernel receives into a provided buffer per completion
+#endif
+#ifndef URING_RECV_BUDGET
+#define URING_RECV_BUDGET (16 * 1024) // Most received bytes processed per io_uring loop iteration
+#endif
+
+// What to do when a client is not reading fast enough and its output queue would grow past
+// OUTPUT_QUEUE_MAX_BYTES
+typedef enum OUTPUT_QUEUE_FULL_POLICY {
+    DROP_OLDEST_CHAT_FRAMES, // Discard the oldest queued CMD_ROOM_MSG frames to make space for the new one
+    DISCONNECT_CLIENT,       // Treat the client as dead and disconnect it
+} OUTPUT_QUEUE_FULL_POLICY;
+
+#ifndef OUTPUT_QUEUE_MAX_BYTES
+#define OUTPUT_QUEUE_MAX_BYTES (64 * 1024) // Max bytes buffered for a single client
+#endif
+#ifndef OUTPUT_QUEUE_FULL_ACTION
+#define OUTPUT_QUEUE_FULL_ACTION DROP_OLDEST_CHAT_FRAMES // Can be overridden with make QUEUE_FULL_POLICY=...
+#endif
+
+// Frames queued for a client during an epoll loop iteration are written with a single sendmsg at the end of it,
+// make COALESCE=0 to write every frame right away. The io_uring backend always does this
+#ifndef WRITE_COALESCING
+#define WRITE_COALESCING 1
+#endif
+#ifndef COALESCE_MAX_DELAY_US
+#define COALESCE_MAX_DELAY_US 0 // Most microseconds a frame waits for the end of the loop iteration, 0 for no limit
+#endif
+#define MAX_FRAMES_PER_WRITE 64 // Most queued frames gathered into a single sendmsg
+
+// Each thread formats its log lines into a ring of its own, and a writer thread copies them to the log
+// file with batched writes. A thread finding its ring full drops the line and counts it instead of waiting
+#ifndef LOG_RING_RECORDS
+#define LOG_RING_RECORDS 8192 // Log lines a thread's ring holds, must be a power of two
+#endif
+#define LOG_RECORD_SIZE 512 // Most bytes of a log line, longer lines are cut
+#ifndef LOG_FLUSH_INTERVAL_MS
+#define LOG_FLUSH_INTERVAL_MS 5 // How long the writer thread sleeps once the rings are drained
+#endif
+#define LOG_WRITE_BATCH_SIZE (64 * 1024) // Most bytes written to the log file with a single write
+
+// The LOG_* macros are always compiled in, each category's level is set at runtime. Every category starts at
+// LOG_DEFAULT_LEVEL, then the control file is applied, and applied again whenever the server gets SIGHUP
+#ifndef LOG_CONTROL_FILE
+#define LOG_CONTROL_FILE "log_levels.conf" // Relative to the directory the server is started in
+#endif
+#ifdef LOG
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_OFF
+#endif
+
+// Metrics are served in the Prometheus text format on a Unix domain socket, by a thread of their own
+#ifndef ADMIN_SOCKET_PATH
+#define ADMIN_SOCKET_PATH "chat_server_admin.sock" // Relative to the directory the server is started in
+#endif
+#define ADMIN_TIMEOUT_MS 1000 // Longest wait for a scraper's request, or for it to take the response
 
-#define MAX_CLIENTS_ROOM 120                       // Max clients per room
-#define MAX_ROOMS 50                               // Max rooms
-#define MAX_CLIENTS (MAX_CLIENTS_ROOM * MAX_ROOMS) // Total possible clients
+// The fan-out latency of room messages, from receiving a message to sending it to its first and to its last recipient,
+// is recorded per worker thread and for the HOT_ROOMS rooms broadcasting the most, and served with the metrics
+#ifndef HOT_ROOMS
+#define HOT_ROOMS 8 // Rooms whose latency is recorded at the same time
+#endif
+#define HOT_ROOMS_INTERVAL_MS 1000   // How often the admin thread picks the hot rooms again
+#define LOAD_SAMPLE_INTERVAL_MS 100  // How often the main thread samples how busy the worker threads were
+#define LATENCY_SUB_BUCKET_BITS 5    // Buckets per power of two are 1 << this, a latency is off by at most 1/32
+#define LATENCY_BUCKETS (32 << LATENCY_SUB_BUCKET_BITS) // Up to 2^36 ns, about 68 s, longer latencies count as that
+
+// How the main thread picks the worker thread a new client is handed to, set with --placement
+typedef enum PLACEMENT_POLICY {
+    PLACE_ROUND_ROBIN,  // The next worker thread with space left
+    PLACE_TWO_CHOICES,  // The less loaded of two worker threads picked at random, see client_distributor.c
+    PLACE_LEAST_LOADED, // The least loaded of all the worker threads
+    PLACE_INCOMING_CPU, // The worker thread pinned to the CPU the connection came in on, see SO_INCOMING_CPU
+    PLACE_REUSEPORT,    // The kernel spreads the connections, with --reuseport
+} PLACEMENT_POLICY;
+
+struct Worker_Thread;
 
 typedef enum ClIENT_STATE {
     AWAITING_USERNAME,
@@ -20,34 +148,255 @@ typedef enum ClIENT_STATE {
     IN_CHAT_ROOM,
 } ClIENT_STATE;
 
-typedef struct Client {
-    int client_fd;
+// A message fully formatted to the protocol. Broadcasts format it once and share it between all
+// recipients, it is freed when the last reference is released
+typedef struct Frame {
+    atomic_int ref_count;
+    size_t length; // Total bytes in data, including the MSG_TERMINATOR
+    char cmd_type;
+    // Fan-out timing of a client's room message, see latency.c. received_at is 0 for frames that are not timed
+    uint64_t received_at;                  // Time in ns the message was received from its sender
+    atomic_int deliveries_left;            // Recipients not done with the frame yet, see finish_delivery()
+    atomic_bool delivered;                 // The frame was written to the socket of its first recipient
+    struct Fanout_Latency *worker_latency; // Of the worker thread that received the message
+    struct Fanout_Latency *room_latency;   // Of the room it was broadcast in, NULL unless the room is hot
+    char data[];
+} Frame;
+
+// A frame that could not be written to the socket right away
+typedef struct Queued_Frame {
+    struct Queued_Frame *next;
+    Frame *frame;
+    size_t sent; // Bytes of the frame already written to the socket
+} Queued_Frame;
+
+// Frames waiting for the client's socket to become writable, flushed on EPOLLOUT or by an io_uring send.
+// Only ever touched by the worker thread owning the client
+typedef struct Output_Queue {
+    Queued_Frame *head;
+    Queued_Frame *tail;
+    size_t queued_bytes;
+    bool epollout_armed;  // EPOLLOUT is currently registered for the client
+    bool overflowed;      // The queue filled up and the client is being disconnected
+    bool send_pending;    // On the worker's pending_output list, written at the end of the loop iteration
+    int frames_in_flight; // Frames at the head of the queue an io_uring send is writing, they cannot be dropped
+} Output_Queue;
+
+// Incremental decoder splitting a client's byte stream into messages terminated by MSG_TERMINATOR
+typedef struct Frame_Decoder {
+    char *input; // Received bytes not decoded yet, points into the worker's recv_buffer
+    size_t input_length;
+    char *partial; // Start of a message split over several reads, MAX_MESSAGE_LEN_TO_SERVER bytes in the Client_Cold
+    size_t partial_length;
+    bool carried_cr; // The last byte of the previous read was a '\r' of the message being decoded
+    bool discarding; // The message being decoded is too long, its bytes are skipped up to its terminator
+} Frame_Decoder;
+
+// What of a client is not needed for most of its events: its name, only read to format the messages it sends or is
+// named in, and the input it could not handle yet. Kept in the worker's client_cold array, apart from the Client
+typedef struct Client_Cold {
     char name[MAX_USERNAME_LEN + 1];
+    char *held_input; // Bytes received while awaiting_room_reply, processed once the reply arrives
+    size_t held_input_length;
+    uint64_t held_input_received_at;         // Time in ns the first held byte was received
+    char partial[MAX_MESSAGE_LEN_TO_SERVER]; // The decoder's partial message, not cleared when the slot is freed
+} Client_Cold;
+
+// What the worker thread reads and writes for most of a client's events, in two cache lines: the first has what a
+// read needs, the second the output queue. Everything else is in the client's Client_Cold
+typedef struct Client {
+    _Alignas(CACHE_LINE_SIZE) int client_fd;
     ClIENT_STATE state;
     int room_index;
+    unsigned int generation;      // Tells apart the clients that used the same slot, see Mailbox_Recipient
+    struct Worker_Thread *worker; // The worker thread whose event loop the client is registered with
+    Frame_Decoder decoder;
+    Output_Queue out_queue;
+    struct Client *ready_prev; // Neighbours on the worker's ready list, see on_ready_list
+    struct Client *ready_next;
     bool in_use;
-    char current_msg[MAX_MESSAGE_LEN_TO_SERVER * 3];
+    bool on_ready_list;       // Used up its read budget with data possibly still unread, only in edge triggered mode
+    bool awaiting_room_reply; // Waiting for the owner of a room to answer its join or leave, see ROOM_ACTORS
+    bool replay_pending;      // The owner answered, the input held meanwhile waits for the end of the loop iteration
+    // Position in its room's members array, written by whoever changes the members. It and cold stay after the fields
+    // cleared when the slot is freed, since with ROOM_ACTORS a room's owner can write it while the client's worker
+    // clears the slot for reuse
+    atomic_int room_member_index;
+    Client_Cold *cold; // The slot's entry in the worker's client_cold
 } Client;
 
+// A client a broadcast should be delivered to. The generation is compared with the client's when the
+// message is delivered, in case the client disconnected and its slot was reused in the meantime
+typedef struct Mailbox_Recipient {
+    Client *client;
+    unsigned int generation;
+} Mailbox_Recipient;
+
+// What a mailbox message asks the worker thread it is posted to to do
+typedef enum MAILBOX_MESSAGE_TYPE {
+    ROOM_BROADCAST, // Send the frame to the recipients
+    ROOM_JOIN,      // Add recipients[0] to the room the worker owns, and reply to the sender
+    ROOM_LEAVE,     // Remove recipients[0] from the room the worker owns, and reply to the sender if it wants a reply
+    ROOM_SEND,      // Broadcast the frame sent by recipients[0] in the room the worker owns
+    ROOM_REPLY,     // The owner's answer to a ROOM_JOIN or ROOM_LEAVE of recipients[0]
+} MAILBOX_MESSAGE_TYPE;
+
+// A room message posted to a worker thread's mailbox, for the worker to send to its own clients. With ROOM_ACTORS
+// it also carries the room operations of clients on other workers to the room's owner, and the owner's replies back
+typedef struct Mailbox_Message {
+    struct Mailbox_Message *next;
+    MAILBOX_MESSAGE_TYPE type;
+    Frame *frame; // NULL for operations without a frame to broadcast
+    int room_index;
+    struct Worker_Thread *sender; // Worker thread of recipients[0] for room operations, the reply is posted to it
+    char reply;                   // Command of the reply, for ROOM_REPLY
+    // The ROOM_REPLY to a join or leave, allocated with the request so that the owner's answer cannot fail to be
+    // posted. NULL if the sender wants no reply
+    struct Mailbox_Message *reply_message;
+    char room_name[MAX_ROOM_NAME_LEN + 1]; // Room name a ROOM_JOIN found the room by, empty if joined by id
+    int num_recipients;
+    Mailbox_Recipient recipients[];
+} Mailbox_Message;
+
+// Single producer, single consumer ring of accepted client fds waiting to be set up by a worker thread.
+// Only the main thread advances tail and only the worker advances head. Handed over fds are counted in
+// num_of_clients, so a ring of at least clients_per_thread fds never fills.
+typedef struct New_Client_Queue {
+    int *fds;                                     // Power of two number of entries
+    size_t mask;                                  // Entries of fds minus one
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // Next fd the worker will take
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // Next free position for the main thread
+} New_Client_Queue;
+
+// A page of the room list, formatted once into a CMD_ROOM_LIST_RESPONSE frame
+typedef struct Room_List_Page {
+    Frame *frame;
+    int first_room_id; // Lowest room id listed on the page, 0 for the first page
+} Room_List_Page;
+
+// The room list as it was at one version of the room list. It is only rebuilt after rooms were created or released,
+// and is shared by the worker threads, each holding a reference on the snapshot it sends pages from
+typedef struct Room_List_Snapshot {
+    atomic_int ref_count;
+    unsigned long version;
+    int num_pages;
+    Room_List_Page *pages;
+} Room_List_Snapshot;
+
+// Counters of a worker thread. Only the worker writes them, with count_metric(), and the admin thread reads them
+// when the metrics are scraped. Writes from other threads would make them contend for the cache line
+typedef struct Worker_Metrics {
+    atomic_ulong accepted_clients; // Connections accepted on the worker's own listening socket
+    atomic_ulong rejected_clients; // Connections turned away with ERR_SERVER_FULL
+    atomic_ulong messages_in;      // Complete messages decoded from clients
+    atomic_ulong bytes_in;         // Bytes received from clients
+    atomic_ulong frames_out;       // Frames sent or queued for clients
+    atomic_ulong bytes_out;        // Bytes written to client sockets
+    atomic_ulong send_would_block; // Writes to a client that found its socket full (EAGAIN), leaving output queued
+    atomic_ulong wakeups;          // Returns from epoll_wait or the waiting io_uring_enter
+    atomic_ulong events;           // Events or completions handled over all the wakeups
+    atomic_ulong busy_ns;          // Time in ns spent handling the wakeups, the rest of the time the worker waits
+} Worker_Metrics;
+
+// Log-linear histogram of latencies in ns: each power of two is split into 1 << LATENCY_SUB_BUCKET_BITS buckets, like
+// HdrHistogram does. Any thread records into it with relaxed atomic adds, the admin thread reads it when scraped
+typedef struct Latency_Histogram {
+    atomic_ulong buckets[LATENCY_BUCKETS];
+    atomic_ulong sum_ns;
+    atomic_ulong max_ns;
+} Latency_Histogram;
+
+// How long room messages take to reach the first and the last of their recipients
+typedef struct Fanout_Latency {
+    Latency_Histogram first_delivery;
+    Latency_Histogram last_delivery;
+} Fanout_Latency;
+
+// What is exported of a Latency_Histogram, see summarize_latency()
+typedef struct Latency_Summary {
+    unsigned long count;
+    unsigned long sum_ns;
+    unsigned long max_ns;
+    unsigned long p50_ns;
+    unsigned long p99_ns;
+    unsigned long p999_ns;
+} Latency_Summary;
+
+// Capacity of the server. Set once by the main thread before any other thread is started, and only read afterwards
+typedef struct Server_Limits {
+    int worker_threads;     // One per online core by default
+    int clients_per_thread; // Most clients a worker thread handles
+    int rooms;              // Most rooms open at the same time
+    int clients_per_room;   // Most clients in a room
+} Server_Limits;
+
+// The fields are grouped by the threads writing them, each group on its own cache lines, so that the main thread
+// handing over clients and the worker threads posting to the mailbox do not take the worker's own lines from it
 typedef struct Worker_Thread {
+    // Set before the worker thread runs, or by it before its event loop starts, and only read afterwards
     pthread_t id;
-    int num_of_clients;
-    int notification_fd;
-    int epoll_fd;
-    Client clients[MAX_CLIENTS_PER_THREAD];
-    pthread_mutex_t num_of_clients_lock;
-    sem_t new_client;
-
+    int index;           // Position in the worker thread array
+    int notification_fd; // eventfd rung by the main thread after adding fds to new_clients
+    int epoll_fd;        // Only used by the epoll backend
+    int listen_fd;       // The worker's own SO_REUSEPORT listening socket, -1 if the main thread accepts
+    int mailbox_fd;      // eventfd rung when the mailbox goes from empty to non empty
+    int cpu;             // CPU the worker thread is pinned to, -1 if it runs on any
+    Client *clients;     // clients_per_thread slots, mapped up front and committed as they are first used
+    Client_Cold *client_cold;    // client_cold[i] holds the cold fields of clients[i], committed the same way
+    uint64_t *free_client_slots; // Bit i is set while clients[i] is free
+    int free_slot_words;         // 64 bit words in free_client_slots
+    Client **pending_output;     // Clients with output queued during this loop iteration, up to clients_per_thread
+    // Clients whose room reply arrived during this loop iteration while they held input, up to clients_per_thread
+    Mailbox_Recipient *replay_clients;
+    // Scratch space of the worker's broadcasts, one entry per worker thread. Zeroed between broadcasts
+    int *broadcast_recipients;                // Recipients of the broadcast on each worker
+    Mailbox_Message **broadcast_messages;     // Message of the broadcast posted to each worker
+    struct Worker_Thread **broadcast_workers; // Workers with recipients, in the order they were found
+    // Written by every worker thread posting to the worker
+    _Alignas(CACHE_LINE_SIZE) _Atomic(Mailbox_Message *) mailbox; // Lock-free stack of posted messages
+    // Clients handed to the worker and not gone yet. Only raised by the main thread handing clients over, or with
+    // --reuseport by the worker itself, so a check against clients_per_thread holds until the raise. Lowered by the
+    // worker as clients disconnect, read by the admin thread
+    _Alignas(CACHE_LINE_SIZE) atomic_int num_of_clients;
+    New_Client_Queue new_clients;
+    // Only used by the worker thread. On pages of their own, the fields above are written by the main thread before the
+    // worker runs, so that they are first touched by the worker and placed on its NUMA node
+    _Alignas(MEMORY_PAGE_SIZE) unsigned int next_client_generation;
+    int first_free_slot_word; // No word before this one has a free slot
+    Client *ready_clients;    // Clients to read from again without waiting for epoll
+    int num_pending_output;
+    int num_replay_clients;
+    uint64_t output_pending_since;             // Time in ns pending_output got its first client
+    Room_List_Snapshot *room_list;             // Snapshot the worker sends room list pages from, or NULL
+    uint64_t received_at;                      // Time in ns the data being processed was received
+    char recv_buffer[WORKER_RECV_BUFFER_SIZE]; // Shared by all the worker's clients
+    _Alignas(CACHE_LINE_SIZE) Worker_Metrics metrics;
+    _Alignas(CACHE_LINE_SIZE) Fanout_Latency fanout_latency; // Of the messages received by the worker's clients
 } Worker_Thread;
 
+// A client's entry in its room's members array. It holds what a broadcast needs, so building the recipient lists does
+// not read the Client structs, which live in the memory of other worker threads
+typedef struct Room_Member {
+    Client *client;
+    Worker_Thread *worker; // The worker thread owning the client
+    unsigned int generation;
+} Room_Member;
+
 typedef struct Room {
-    struct Client *clients[MAX_CLIENTS_ROOM];
+    Room_Member *members; // The first num_clients entries are the room's clients, in any order
+    int member_capacity;  // Entries of members, grown up to clients_per_room and kept once the room is released
     char room_name[MAX_ROOM_NAME_LEN + 1];
     int num_clients;
+    atomic_int member_count; // Copy of num_clients for the admin thread, which reads it without the room's lock
     bool in_use;
     pthread_mutex_t room_lock;
+    int id;                                // Position in the room registry, clients join the room with it
+    _Atomic(Worker_Thread *) owner;        // Worker thread of the client that created the room, NULL once released
+    struct Room *name_next;                // Next room in the same bucket of the registry's name index
+    atomic_int next_free_id;               // Room id below this one on the registry's free id stack, -1 at the bottom
+    atomic_ulong timed_broadcasts;         // Client messages broadcast in the room, counted by whoever broadcasts them
+    unsigned long ranked_broadcasts;       // timed_broadcasts when the admin thread last picked the hot rooms
+    _Atomic(Fanout_Latency *) hot_latency; // Latency recorded for the room while it is hot, NULL otherwise
 } Room;
 
-extern Room SERVER_ROOMS[MAX_ROOMS];
-
 #endif
@@ -0,0 +1,169 @@
+// Local
+#include "server_limits.h"
+
+// Library
+#include <errno.h>    // For errno
+#include <stdio.h>    // For fopen, fgets, fprintf
+#include <stdlib.h>   // For strtol, exit
+#include <string.h>   // For strcmp, strcspn, strspn, strerror
+#include <sys/mman.h> // For mmap
+#include <unistd.h>   // For sysconf
+
+#define LIMITS_LINE_LEN 256 // Longest line of the limits file
+
+Server_Limits server_limits;
+
+// A limit, set with --<name> on the command line or <name>=<value> in the limits file, '-' and '_' being the same
+typedef struct Limit_Description {
+    const char *name;
+    size_t offset; // Of the limit in Server_Limits
+    int max;
+} Limit_Description;
+
+static const Limit_Description limit_descriptions[] = {
+    {"worker_threads", offsetof(Server_Limits, worker_threads), MAX_WORKER_THREADS},
+    {"clients_per_thread", offsetof(Server_Limits, clients_per_thread), MAX_SERVER_LIMIT},
+    {"rooms", offsetof(Server_Limits, rooms), MAX_SERVER_LIMIT},
+    {"clients_per_room", offsetof(Server_Limits, clients_per_room), MAX_SERVER_LIMIT},
+};
+
+static bool set_limit(Server_Limits *limits, const char *name, const char *value);
+static void read_limits_file(const char *path, Server_Limits *limits);
+
+/**
+ * @brief Sets a limit given on the command line
+ *
+ * @param limits The limits to set it in
+ * @param option The option, e.g. --clients-per-thread
+ * @param value  The option's value, a number from 1 to the limit's maximum
+ *
+ * @return false if the option is not a limit or the value is not valid for it
+ */
+bool set_limit_option(Server_Limits *limits, const char *option, const char *value) {
+    return strncmp(option, "--", 2) == 0 && set_limit(limits, option + 2, value);
+}
+
+/**
+ * @brief Sets server_limits from the defaults, the limits file and the
+ * command line, each overriding the one before
+ *
+ * The limits file is config_file if one was given, it then has to exist.
+ * Otherwise LIMITS_CONFIG_FILE is read if it exists. It holds a limit per
+ * line, e.g. clients_per_thread = 5000, empty lines and # comments are
+ * skipped.
+ *
+ * @param config_file The limits file given on the command line, or NULL
+ * @param overrides   The limits given on the command line, 0 for those not
+ *                    given
+ *
+ * @note Must be called before any thread is started. Exits the process if the
+ * limits file cannot be read or holds a line that is not a valid limit.
+ */
+void load_server_limits(const char *config_file, const Server_Limits *overrides) {
+    const long online_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    server_limits.worker_threads = online_cores < 1 ? 1 : online_cores > MAX_WORKER_THREADS ? MAX_WORKER_THREADS
+                                                                                             : (int)online_cores;
+    server_limits.clients_per_thread = DEFAULT_CLIENTS_PER_THREAD;
+    server_limits.rooms = DEFAULT_ROOMS;
+    server_limits.clients_per_room = DEFAULT_CLIENTS_PER_ROOM;
+
+    if (config_file != NULL) {
+        read_limits_file(config_file, &server_limits);
+    } else if (access(LIMITS_CONFIG_FILE, F_OK) == 0) {
+        read_limits_file(LIMITS_CONFIG_FILE, &server_limits);
+    }
+
+    for (size_t i = 0; i < sizeof(limit_descriptions) / sizeof(limit_descriptions[0]); i++) {
+        const int override = *(const int *)((const char *)overrides + limit_descriptions[i].offset);
+        if (override != 0) {
+            *(int *)((char *)&server_limits + limit_descriptions[i].offset) = override;
+        }
+    }
+}
+
+/**
+ * @brief Reserves zeroed memory that is only committed page by page as it is
+ * first written, so a table sized for the server's limits costs memory in
+ * proportion to how much of it is used
+ *
+ * @param size Bytes to reserve
+ *
+ * @return The memory, or NULL if it could not be mapped
+ */
+void *allocate_lazily(size_t size) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return memory != MAP_FAILED ? memory : NULL;
+}
+
+/**
+ * @brief Sets a limit by name
+ *
+ * @param limits The limits to set it in
+ * @param name   Name of the limit, with '-' or '_' between words
+ * @param value  A number from 1 to the limit's maximum
+ *
+ * @return false if there is no such limit or the value is not valid for it
+ */
+static bool set_limit(Server_Limits *limits, const char *name, const char *value) {
+    for (size_t i = 0; i < sizeof(limit_descriptions) / sizeof(limit_descriptions[0]); i++) {
+        const Limit_Description *limit = &limit_descriptions[i];
+        size_t c = 0;
+        while (limit->name[c] != '\0' && (name[c] == limit->name[c] || (name[c] == '-' && limit->name[c] == '_'))) {
+            c++;
+        }
+        if (limit->name[c] != '\0' || name[c] != '\0') {
+            continue;
+        }
+
+        char *end;
+        errno = 0;
+        const long number = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || errno != 0 || number < 1 || number > limit->max) {
+            fprintf(stderr, "Invalid %s: %s, must be a number from 1 to %d\n", limit->name, value, limit->max);
+            return false;
+        }
+        *(int *)((char *)limits + limit->offset) = (int)number;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Sets the limits found in a limits file
+ *
+ * @param path   The limits file
+ * @param limits The limits to set them in
+ *
+ * @note Exits the process if the file cannot be read or holds a line that is
+ * not a valid limit
+ */
+static void read_limits_file(const char *path, Server_Limits *limits) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char line[LIMITS_LINE_LEN];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *name = line + strspn(line, " \t");
+        char *value = strchr(name, '=');
+        if (value == NULL && *name == '\0') {
+            continue;
+        }
+        if (value != NULL) {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+            name[strcspn(name, " \t")] = '\0';
+            value[strcspn(value, " \t")] = '\0';
+        }
+        if (value == NULL || !set_limit(limits, name, value)) {
+            fprintf(stderr, "Line %d of %s is not a valid limit\n", line_number, path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(file);
+}
@@ -0,0 +1,13 @@
+#ifndef SERVER_LIMITS_H
+#define SERVER_LIMITS_H
+
+#include "server_config.h"
+
+// Capacity of the server, see load_server_limits()
+extern Server_Limits server_limits;
+
+bool set_limit_option(Server_Limits *limits, const char *option, const char *value);
+void load_server_limits(const char *config_file, const Server_Limits *overrides);
+void *allocate_lazily(size_t size);
+
+#endif
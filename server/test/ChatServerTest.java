@@ -41,6 +41,7 @@ public class ChatServerTest {
   public static final char ERR_USERNAME_LENGTH = 0x2d;
   public static final char ERR_ROOM_NAME_INVALID = 0x24;
   public static final char ERR_ROOM_CAPACITY_FULL = 0x25;
+  public static final char ERR_ROOM_NOT_FOUND = 0x26;
   public static final char CMD_EXIT = 0x01;
   public static final char ERR_PROTOCOL_INVALID_STATE_CMD = 0x28;
   public static final char ERR_PROTOCOL_INVALID_FORMAT = 0x29;
@@ -514,6 +515,29 @@ public class ChatServerTest {
     disconnectClients(roomJoiners);
   }
 
+  /**
+   * Tests that the server correctly: Lets a client join a room by its name, and rejects a name no
+   * room in use has, including the name of a room that was cleaned up.
+   */
+  @Test
+  public void testJoinRoomByName() throws IOException, InterruptedException {
+    Client roomCreator = setupRoomCreator("Room Creator", "Named room");
+    Client closedRoomCreator = setupRoomCreator("Closed Room Creator", "Closed room");
+    closedRoomCreator.sendMessage(CMD_LEAVE_ROOM, "dummy");
+    assertTrue(closedRoomCreator.getResponse(CMD_ROOM_LEAVE_OK).contains("left the room"));
+
+    Client joiner = setupClientWithUsername("Joiner");
+    joiner.sendMessage(CMD_ROOM_JOIN_REQUEST, "Named room");
+    assertTrue(joiner.getResponse(CMD_ROOM_JOIN_OK).contains("joined"));
+    assertTrue(roomCreator.getResponse(CMD_ROOM_MSG).contains("Joiner has entered the room"));
+
+    Client lateJoiner = setupClientWithUsername("Late joiner");
+    lateJoiner.sendMessage(CMD_ROOM_JOIN_REQUEST, "Closed room");
+    assertTrue(lateJoiner.getResponse(ERR_ROOM_NOT_FOUND).contains("Room does not exist"));
+
+    disconnectClients(List.of(roomCreator, closedRoomCreator, joiner, lateJoiner));
+  }
+
   /**
    * Tests that the server correctly: Broadcasts all message by one client to other clients in a
    * single room.
@@ -699,6 +723,106 @@ public class ChatServerTest {
     client.close();
   }
 
+  /**
+   * Sets up a room with a sender and a receiver in it. The receiver has already consumed the
+   * sender's join notification.
+   *
+   * @return The sender at index 0 and the receiver at index 1
+   */
+  private List<Client> setupSenderAndReceiverInRoom() throws IOException, InterruptedException {
+    Client receiver = setupRoomCreator("Receiver", "Framing Room");
+    Client sender = setupClientsWithinRoom(1, 0).get(0);
+    assertTrue(receiver.getResponse(CMD_ROOM_MSG).contains("entered the room"));
+    return Arrays.asList(sender, receiver);
+  }
+
+  /**
+   * Tests that the server correctly: Puts a message back together when it arrives in several reads,
+   * including a terminator split between its '\r' and '\n'
+   */
+  @Test(timeout = 10000)
+  public void testServerHandlesMessageSplitAcrossReads() throws IOException, InterruptedException {
+    List<Client> clients = setupSenderAndReceiverInRoom();
+    Client sender = clients.get(0);
+    Client receiver = clients.get(1);
+
+    for (String part : new String[] {CMD_ROOM_MESSAGE_SEND + " spl", "it\r", "\n"}) {
+      sender.sendRaw(part);
+      Thread.sleep(100);
+    }
+    assertTrue(receiver.getResponse(CMD_ROOM_MSG).contains("split"));
+
+    for (char c : (CMD_ROOM_MESSAGE_SEND + " one byte at a time\r\n").toCharArray()) {
+      sender.sendRaw(String.valueOf(c));
+      Thread.sleep(5);
+    }
+    assertTrue(receiver.getResponse(CMD_ROOM_MSG).contains("one byte at a time"));
+    disconnectClients(clients);
+  }
+
+  /**
+   * Tests that the server correctly: Handles every message when several arrive in one read, in the
+   * order they were sent
+   */
+  @Test(timeout = 10000)
+  public void testServerHandlesCoalescedMessages() throws IOException, InterruptedException {
+    List<Client> clients = setupSenderAndReceiverInRoom();
+    Client sender = clients.get(0);
+    Client receiver = clients.get(1);
+
+    StringBuilder messages = new StringBuilder();
+    for (int i = 0; i < 50; i++) {
+      messages.append(CMD_ROOM_MESSAGE_SEND + " coalesced " + i + "\r\n");
+    }
+    sender.sendRaw(messages.toString());
+    for (int i = 0; i < 50; i++) {
+      assertTrue(receiver.getResponse(CMD_ROOM_MSG).endsWith("coalesced " + i));
+    }
+    disconnectClients(clients);
+  }
+
+  /**
+   * Tests that the server correctly: Accepts content of MAX_CONTENT_LENGTH and rejects anything
+   * longer, including an unterminated message split over several reads, and goes on with the
+   * messages that follow it
+   */
+  @Test(timeout = 10000)
+  public void testServerRejectsMessagesLongerThanMax() throws IOException, InterruptedException {
+    List<Client> clients = setupSenderAndReceiverInRoom();
+    Client sender = clients.get(0);
+    Client receiver = clients.get(1);
+    String maxContent = getRandomStrings(1, MAX_CONTENT_LENGTH).get(0);
+
+    sender.sendMessage(CMD_ROOM_MESSAGE_SEND, maxContent);
+    assertTrue(receiver.getResponse(CMD_ROOM_MSG).contains(maxContent));
+
+    sender.sendMessage(CMD_ROOM_MESSAGE_SEND, maxContent + "X");
+    assertTrue(sender.getResponse(ERR_PROTOCOL_INVALID_FORMAT).contains("too long"));
+
+    sender.sendRaw(CMD_ROOM_MESSAGE_SEND + " " + maxContent);
+    Thread.sleep(100);
+    sender.sendRaw(maxContent + maxContent + "\r");
+    Thread.sleep(100);
+    sender.sendRaw("\n" + CMD_ROOM_MESSAGE_SEND + " after the long one\r\n");
+    assertTrue(sender.getResponse(ERR_PROTOCOL_INVALID_FORMAT).contains("too long"));
+    assertTrue(receiver.getResponse(CMD_ROOM_MSG).contains("after the long one"));
+    assertFalse(receiver.hasMessages());
+    disconnectClients(clients);
+  }
+
+  /** Tests that the server correctly: Rejects a message with a NUL byte in its content */
+  @Test(timeout = 10000)
+  public void testServerRejectsEmbeddedNul() throws IOException, InterruptedException {
+    List<Client> clients = setupSenderAndReceiverInRoom();
+    Client sender = clients.get(0);
+    Client receiver = clients.get(1);
+
+    sender.sendMessage(CMD_ROOM_MESSAGE_SEND, "before\0after");
+    assertTrue(sender.getResponse(ERR_PROTOCOL_INVALID_FORMAT).contains("NUL"));
+    assertFalse(receiver.hasMessages());
+    disconnectClients(clients);
+  }
+
   public class Client {
 
     // Server Config
@@ -778,6 +902,17 @@ public class ChatServerTest {
       writer.flush();
     }
 
+    /**
+     * Sends the given data to the server socket as is, without adding a terminator
+     *
+     * @param data Bytes to send, one char per byte
+     */
+    public void sendRaw(String data) throws IOException {
+      socket.setTcpNoDelay(true);
+      writer.write(data);
+      writer.flush();
+    }
+
     /** Checks if the socket has messages with a 100 milliseconds */
     public boolean hasMessages() throws IOException {
       socket.setSoTimeout(100);
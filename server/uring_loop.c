@@ -0,0 +1,605 @@
+#define _GNU_SOURCE // Enables GNU extensions required for the syscall() function
+
+// Local
+#include "event_loop.h"
+
+#include "client_state_manager.h" // For process_client_data(), handle_client_disconnection(), replay_held_input()
+#include "connection_handler.h"   // For register_new_clients(), add_accepted_client()
+#include "latency.h"      // For monotonic_time_ns()
+#include "logger.h"       // Has the logging function for LOG_INFO, LOG_SERVER_ERROR, LOG_WARNING and print_ero_n_exit
+#include "mailbox.h"      // For handle_mailbox_notification(), deliver_mailbox_messages()
+#include "metrics.h"      // For count_metric()
+#include "output_queue.h" // For advance_output_queue(), mark_output_pending(), release_frame()
+#include "server_config.h" // Custom header containing server configuration
+#include "server_limits.h" // For server_limits
+
+// Library
+#include <errno.h>          // For errno, EINTR, ENOBUFS
+#include <linux/io_uring.h> // For the io_uring structs, opcodes and flags, used through the raw syscalls
+#include <poll.h>           // For POLLIN
+#include <stdbool.h>        // For bool type
+#include <stdint.h>         // For uint64_t, uintptr_t
+#include <stdlib.h>         // For malloc, free
+#include <string.h>         // For memset, strerror
+#include <sys/mman.h>       // For mmap
+#include <sys/socket.h>     // For struct msghdr, shutdown, SOCK_NONBLOCK
+#include <sys/syscall.h>    // For __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register
+#include <sys/uio.h>        // For struct iovec
+#include <unistd.h>         // For syscall
+
+#define LOG_CATEGORY LOG_EVENTS // The log level of this category enables the file's log lines
+
+// What a completion is for, kept in the low bits of the request's user_data. A recv keeps the client's slot
+// and generation in the other bits, a send the address of its Uring_Send
+#define TAG_BITS 3
+#define TAG_MASK ((1ULL << TAG_BITS) - 1)
+#define TAG_HANDLED 0 // Completion already handled out of order, see send_early()
+#define TAG_RECV 1
+#define TAG_SEND 2
+#define TAG_NOTIFICATION 3
+#define TAG_MAILBOX 4
+#define TAG_ACCEPT 5
+
+#define RECV_BUFFER_GROUP 0 // Buffer group id of the worker's provided buffer ring
+
+// A sendmsg submitted for the frames at the head of a client's output queue. It holds its own reference on
+// every frame, so the frames stay valid for the kernel even if the client is disconnected in the meantime
+typedef struct Uring_Send {
+    struct Uring_Send *next; // Next free Uring_Send while on the free list
+    Client *client;
+    unsigned int generation;
+    int num_frames;
+    Frame *frames[MAX_FRAMES_PER_WRITE];
+    struct iovec iov[MAX_FRAMES_PER_WRITE];
+    struct msghdr msg;
+} Uring_Send;
+
+// The worker's io_uring instance, mapped from the kernel
+typedef struct Uring {
+    int ring_fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned int sqe_tail; // Tail including the SQEs not handed to the kernel yet
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring; // Provided buffers multishot recvs receive into
+    uint16_t buf_ring_tail;
+    char *recv_buffers;
+    bool sending_early; // In send_early(), which must not be reentered from the completions it handles
+    Uring_Send *free_sends;
+} Uring;
+
+// Every worker thread runs its own ring, only ever touched by that thread
+static _Thread_local Uring ring;
+
+static void setup_ring(void);
+static void setup_buffer_ring(void);
+static void recycle_recv_buffer(uint16_t buffer_id);
+static struct io_uring_sqe *get_sqe(void);
+static int enter_ring(unsigned int min_complete, unsigned int flags);
+
+static void arm_recv(Client *client);
+static void arm_poll(int fd, uint64_t tag);
+static void arm_accept(int listen_fd);
+static void submit_send(Client *client);
+static void submit_pending_sends(Worker_Thread *thread_context);
+static void send_early(Worker_Thread *thread_context);
+
+static void process_completions(Worker_Thread *thread_context);
+static void handle_completion(Worker_Thread *thread_context, uint64_t user_data, int res, uint32_t flags);
+static void handle_recv_completion(Worker_Thread *thread_context, uint64_t user_data, int res, uint32_t flags);
+static void handle_send_completion(Uring_Send *send_op, int res);
+
+/**
+ * @brief Runs the worker's io_uring loop, never returns
+ *
+ * Every client has a multishot recv that receives into the worker's provided
+ * buffer ring, the notification fd and mailbox fd have a multishot poll and,
+ * in --reuseport mode, the listening socket has a multishot accept. The loop
+ * submits the sends for every client that got output in the last iteration
+ * and waits for completions in a single io_uring_enter.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ */
+void run_event_loop(Worker_Thread *thread_context) {
+    setup_ring();
+    setup_buffer_ring();
+    LOG_INFO("Created io_uring fd %d for worker %d\n", ring.ring_fd, thread_context->index);
+
+    arm_poll(thread_context->notification_fd, TAG_NOTIFICATION);
+    arm_poll(thread_context->mailbox_fd, TAG_MAILBOX);
+    if (thread_context->listen_fd != -1) {
+        arm_accept(thread_context->listen_fd);
+    }
+
+    while (1) {
+        submit_pending_sends(thread_context);
+        // Completions already in the ring are still processed if the wait failed
+        if (enter_ring(1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+            LOG_SERVER_ERROR("io_uring_enter failed: %s\n", strerror(errno));
+        }
+        const uint64_t woke_at = monotonic_time_ns();
+        count_metric(&thread_context->metrics.wakeups, 1);
+        process_completions(thread_context);
+        deliver_mailbox_messages(thread_context);
+        replay_held_input(thread_context);
+        count_metric(&thread_context->metrics.busy_ns, monotonic_time_ns() - woke_at);
+    }
+}
+
+/**
+ * @brief Starts receiving from a freshly set up client
+ *
+ * @param thread_context Worker thread context owning the ring
+ * @param client The new client
+ *
+ * @return bool always true, a failed recv is reported by its completion
+ */
+bool watch_client(Worker_Thread *thread_context, Client *client) {
+    (void)thread_context;
+    arm_recv(client);
+    return true;
+}
+
+/**
+ * @brief Stops watching a client that is being cleaned up
+ *
+ * What is still queued for the client is written if the socket takes it and
+ * no send is in flight. The socket is then shut down so the client's
+ * multishot recv and any send in flight complete right away, before the
+ * socket is closed. Their completions are ignored since the client's slot is
+ * free or has a new generation by then.
+ *
+ * @param thread_context Worker thread context owning the ring
+ * @param client The client being cleaned up
+ */
+void unwatch_client(Worker_Thread *thread_context, Client *client) {
+    (void)thread_context;
+    if (!client->out_queue.overflowed && client->out_queue.frames_in_flight == 0) {
+        flush_output_queue(client);
+    }
+    if (shutdown(client->client_fd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+        LOG_SERVER_ERROR("Failed to shutdown client fd %d: %s\n", client->client_fd, strerror(errno));
+    }
+}
+
+/**
+ * @brief Called once output has been queued for the client, puts it on the
+ * list of clients a send is submitted for at the end of the loop iteration
+ *
+ * A room broadcast queues its frame for every member first, so their sends
+ * all go to the kernel in the same io_uring_enter. A client that already has
+ * a send in flight gets the rest of its queue sent once that send completes.
+ *
+ * @param client The client with queued output
+ */
+void watch_client_output(Client *client) {
+    Output_Queue *queue = &client->out_queue;
+    Worker_Thread *thread_context = client->worker;
+    if (!queue->send_pending && queue->frames_in_flight == 0) {
+        if (thread_context->num_pending_output == server_limits.clients_per_thread) {
+            // Only happens when released slots are reused within the iteration, leaving stale entries behind
+            submit_pending_sends(thread_context);
+        }
+        mark_output_pending(client);
+    }
+
+    // A burst of room messages, from the mailbox or many recv completions, can fill the queue before the
+    // loop iteration ends. Once it passes half of OUTPUT_QUEUE_MAX_BYTES the sends are submitted right away,
+    // instead of dropping frames a client reading fast enough would have taken
+    size_t added = queue->tail->frame->length - queue->tail->sent;
+    bool passed_half =
+        queue->queued_bytes > OUTPUT_QUEUE_MAX_BYTES / 2 && queue->queued_bytes - added <= OUTPUT_QUEUE_MAX_BYTES / 2;
+    if (!ring.sending_early && (passed_half || output_deadline_passed(thread_context))) {
+        send_early(thread_context);
+    }
+}
+
+/**
+ * @brief Submits the pending sends in the middle of a loop iteration and
+ * handles the sends that complete right away
+ *
+ * A send to a socket with space completes while it is submitted. Its
+ * completion is handled here, out of order, so its frames leave the client's
+ * queue, and it is marked as handled for when the loop gets to it.
+ *
+ * @param thread_context Worker thread context owning the pending_output list
+ */
+static void send_early(Worker_Thread *thread_context) {
+    ring.sending_early = true;
+    submit_pending_sends(thread_context);
+    if (enter_ring(0, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+        LOG_SERVER_ERROR("io_uring_enter failed: %s\n", strerror(errno));
+    }
+
+    unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (unsigned int i = *ring.cq_head; i != tail; i++) {
+        struct io_uring_cqe *cqe = &ring.cqes[i & ring.cq_mask];
+        if ((cqe->user_data & TAG_MASK) == TAG_SEND) {
+            handle_send_completion((Uring_Send *)(uintptr_t)(cqe->user_data & ~TAG_MASK), cqe->res);
+            cqe->user_data = TAG_HANDLED;
+        }
+    }
+    ring.sending_early = false;
+}
+
+/**
+ * @brief Creates the worker's ring and maps its queues
+ */
+static void setup_ring(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_QUEUE_DEPTH * 4;
+
+    ring.ring_fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+    if (ring.ring_fd == -1 && errno == EINVAL) {
+        // Kernels before 6.1 have no deferred task running, completions are then posted as they happen
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        ring.ring_fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+    }
+    if (ring.ring_fd == -1) {
+        print_erro_n_exit("Could not create io_uring instance");
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        print_erro_n_exit("Kernel io_uring is too old, make BACKEND=epoll instead");
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = mmap(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.ring_fd, IORING_OFF_SQ_RING);
+    ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.ring_fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        print_erro_n_exit("Could not map io_uring queues");
+    }
+
+    ring.sq_entries = params.sq_entries;
+    ring.sq_head = (unsigned int *)(rings + params.sq_off.head);
+    ring.sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+    ring.sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    ring.sqe_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned int *)(rings + params.cq_off.head);
+    ring.cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+    ring.cq_mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    // SQE i always sits at position i of the submission queue
+    unsigned int *sq_array = (unsigned int *)(rings + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+}
+
+/**
+ * @brief Registers the worker's provided buffer ring and fills it with
+ * URING_RECV_BUFFERS buffers of URING_RECV_BUFFER_SIZE bytes
+ *
+ * The kernel picks a buffer from the ring for every recv completion, so a
+ * client only takes up a buffer while the worker is processing its data,
+ * instead of every client having a buffer of its own.
+ */
+static void setup_buffer_ring(void) {
+    ring.buf_ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.recv_buffers = mmap(NULL, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buf_ring == MAP_FAILED || ring.recv_buffers == MAP_FAILED) {
+        print_erro_n_exit("Could not allocate io_uring receive buffers");
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uintptr_t)ring.buf_ring;
+    registration.ring_entries = URING_RECV_BUFFERS;
+    registration.bgid = RECV_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring.ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) == -1) {
+        print_erro_n_exit("Could not register io_uring buffer ring");
+    }
+
+    for (int i = 0; i < URING_RECV_BUFFERS; i++) {
+        recycle_recv_buffer(i);
+    }
+}
+
+/**
+ * @brief Gives a provided buffer back to the kernel once its data is processed
+ *
+ * @param buffer_id Id of the buffer, from the recv completion's flags
+ */
+static void recycle_recv_buffer(uint16_t buffer_id) {
+    struct io_uring_buf *buffer = &ring.buf_ring->bufs[ring.buf_ring_tail & (URING_RECV_BUFFERS - 1)];
+    buffer->addr = (uintptr_t)(ring.recv_buffers + (size_t)buffer_id * URING_RECV_BUFFER_SIZE);
+    buffer->len = URING_RECV_BUFFER_SIZE;
+    buffer->bid = buffer_id;
+    ring.buf_ring_tail++;
+    __atomic_store_n(&ring.buf_ring->tail, ring.buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Takes the next free SQE, handing the queued ones to the kernel first
+ * if the submission queue is full
+ *
+ * @return The SQE, zeroed out
+ */
+static struct io_uring_sqe *get_sqe(void) {
+    while (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) {
+        if (enter_ring(0, 0) == -1 && errno != EINTR) {
+            print_erro_n_exit("Could not submit to a full io_uring submission queue");
+        }
+    }
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sqe_tail & ring.sq_mask];
+    ring.sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * @brief Hands every SQE prepared since the last call to the kernel and
+ * optionally waits for completions
+ *
+ * @param min_complete Number of completions to wait for
+ * @param flags        io_uring_enter flags, IORING_ENTER_GETEVENTS to wait
+ *
+ * @return The number of SQEs submitted, -1 on error with errno set
+ */
+static int enter_ring(unsigned int min_complete, unsigned int flags) {
+    unsigned int to_submit = ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, ring.ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * @brief Queues a multishot recv for the client, receiving into the provided
+ * buffer ring until the client disconnects
+ *
+ * @param client The client to receive from
+ */
+static void arm_recv(Client *client) {
+    uint64_t slot = client - client->worker->clients;
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->client_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)client->generation << 32 | slot << TAG_BITS | TAG_RECV;
+}
+
+/**
+ * @brief Queues a multishot poll for one of the worker's eventfds
+ *
+ * @param fd  The eventfd to poll
+ * @param tag TAG_NOTIFICATION or TAG_MAILBOX
+ */
+static void arm_poll(int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tag;
+}
+
+/**
+ * @brief Queues a multishot accept on the worker's own SO_REUSEPORT listening
+ * socket
+ *
+ * @param listen_fd The worker's listening socket
+ */
+static void arm_accept(int listen_fd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+/**
+ * @brief Queues a sendmsg of the frames at the head of the client's output
+ * queue, at most MAX_FRAMES_PER_WRITE of them
+ *
+ * @param client The client to send to, its queue must not be empty
+ */
+static void submit_send(Client *client) {
+    Uring_Send *send_op = ring.free_sends;
+    if (send_op != NULL) {
+        ring.free_sends = send_op->next;
+    } else if ((send_op = malloc(sizeof(Uring_Send))) == NULL) {
+        LOG_SERVER_ERROR("Could not allocate io_uring send for client fd %d\n", client->client_fd);
+        return;
+    }
+    send_op->client = client;
+    send_op->generation = client->generation;
+    send_op->num_frames = 0;
+
+    for (Queued_Frame *queued = client->out_queue.head; queued != NULL && send_op->num_frames < MAX_FRAMES_PER_WRITE;
+         queued = queued->next) {
+        atomic_fetch_add_explicit(&queued->frame->ref_count, 1, memory_order_relaxed);
+        send_op->frames[send_op->num_frames] = queued->frame;
+        send_op->iov[send_op->num_frames].iov_base = queued->frame->data + queued->sent;
+        send_op->iov[send_op->num_frames].iov_len = queued->frame->length - queued->sent;
+        send_op->num_frames++;
+    }
+    client->out_queue.frames_in_flight = send_op->num_frames;
+
+    memset(&send_op->msg, 0, sizeof(send_op->msg));
+    send_op->msg.msg_iov = send_op->iov;
+    send_op->msg.msg_iovlen = send_op->num_frames;
+
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->client_fd;
+    sqe->addr = (uintptr_t)&send_op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)send_op | TAG_SEND;
+}
+
+/**
+ * @brief Queues a send for every client that got output during the loop
+ * iteration
+ *
+ * @param thread_context Worker thread context owning the pending_output list
+ */
+static void submit_pending_sends(Worker_Thread *thread_context) {
+    for (int i = 0; i < thread_context->num_pending_output; i++) {
+        Client *client = thread_context->pending_output[i];
+        Output_Queue *queue = &client->out_queue;
+        // The client may have been cleaned up, or its slot reused, since it was put on the list
+        if (!client->in_use || !queue->send_pending) {
+            continue;
+        }
+        queue->send_pending = false;
+        if (!queue->overflowed && queue->head != NULL && queue->frames_in_flight == 0) {
+            submit_send(client);
+        }
+    }
+    thread_context->num_pending_output = 0;
+}
+
+/**
+ * @brief Handles every completion waiting in the completion queue
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ */
+static void process_completions(Worker_Thread *thread_context) {
+    unsigned int head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        count_metric(&thread_context->metrics.events, 1);
+
+        if ((user_data & TAG_MASK) == TAG_RECV) {
+            handle_recv_completion(thread_context, user_data, res, flags);
+        } else {
+            handle_completion(thread_context, user_data, res, flags);
+        }
+        if (output_deadline_passed(thread_context)) {
+            send_early(thread_context);
+        }
+    }
+}
+
+/**
+ * @brief Handles a completion other than a recv
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ * @param user_data      The request's user_data
+ * @param res            The request's result
+ * @param flags          The completion's flags
+ */
+static void handle_completion(Worker_Thread *thread_context, uint64_t user_data, int res, uint32_t flags) {
+    switch (user_data & TAG_MASK) {
+    case TAG_SEND:
+        handle_send_completion((Uring_Send *)(uintptr_t)(user_data & ~TAG_MASK), res);
+        break;
+    case TAG_NOTIFICATION:
+        LOG_INFO("Received new client notification\n");
+        register_new_clients(thread_context);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            arm_poll(thread_context->notification_fd, TAG_NOTIFICATION);
+        }
+        break;
+    case TAG_MAILBOX:
+        handle_mailbox_notification(thread_context);
+        if (!(flags & IORING_CQE_F_MORE)) {
+            arm_poll(thread_context->mailbox_fd, TAG_MAILBOX);
+        }
+        break;
+    case TAG_ACCEPT:
+        if (res >= 0) {
+            add_accepted_client(thread_context, res);
+        } else {
+            LOG_SERVER_ERROR("Accept failed: %s\n", strerror(-res));
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            arm_accept(thread_context->listen_fd);
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Handles a completion of a client's multishot recv
+ *
+ * The received data is processed straight from the provided buffer, which
+ * goes back to the ring right after. A recv that completes with nothing read
+ * or an error other than running out of buffers means the client is gone.
+ *
+ * @param thread_context Worker thread context containing data about the thread
+ * @param user_data      The recv's user_data, with the client's slot and generation
+ * @param res            Bytes received or a negative errno
+ * @param flags          The completion's flags
+ */
+static void handle_recv_completion(Worker_Thread *thread_context, uint64_t user_data, int res, uint32_t flags) {
+    Client *client = &thread_context->clients[(user_data & 0xffffffff) >> TAG_BITS];
+    unsigned int generation = user_data >> 32;
+    bool alive = client->in_use && client->generation == generation;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (alive && res > 0) {
+            process_client_data(client, thread_context,
+                                ring.recv_buffers + (size_t)buffer_id * URING_RECV_BUFFER_SIZE, res);
+        }
+        recycle_recv_buffer(buffer_id);
+    }
+    // A completion for a client that has been cleaned up in the meantime
+    if (!client->in_use || client->generation != generation) {
+        return;
+    }
+    if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+        LOG_INFO("Client fd %d disconnected during receive: %s\n", client->client_fd,
+                 res == 0 ? "connection closed" : strerror(-res));
+        handle_client_disconnection(client, thread_context);
+        return;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        arm_recv(client);
+    }
+}
+
+/**
+ * @brief Handles a completed send, taking what was written off the client's
+ * queue and sending the rest
+ *
+ * A failed send is only logged. The client's recv fails too and runs the
+ * normal disconnection path.
+ *
+ * @param send_op The completed send
+ * @param res     Bytes written or a negative errno
+ */
+static void handle_send_completion(Uring_Send *send_op, int res) {
+    Client *client = send_op->client;
+    // The queue the send was made from is gone if the client overflowed or was cleaned up
+    if (client->in_use && client->generation == send_op->generation && client->out_queue.frames_in_flight > 0) {
+        client->out_queue.frames_in_flight = 0;
+        if (res >= 0) {
+            advance_output_queue(client, res);
+        } else if (res != -EAGAIN) {
+            LOG_CLIENT_DISCONNECT("Failed to send message to client fd %d: %s\n", client->client_fd, strerror(-res));
+        }
+        if ((res >= 0 || res == -EAGAIN) && client->out_queue.head != NULL) {
+            watch_client_output(client);
+        }
+    }
+
+    for (int i = 0; i < send_op->num_frames; i++) {
+        release_frame(send_op->frames[i]);
+    }
+    send_op->next = ring.free_sends;
+    ring.free_sends = send_op;
+}